@@ -0,0 +1,79 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <atomic>
+#include "metrics.h"
+
+/*
+    CoDel风格的准入控制，用于单Reactor + 线程池模式
+    事件循环把请求交给线程池时记下时间，工作线程取出请求时报告它在队列中等待的时间(sojourn time)：
+      - 等待时间低于target，说明队列能及时排空，不是过载
+      - 等待时间持续interval都高于target，说明队列中形成了消化不掉的积压，进入过载状态
+    未过载时只拒绝等待超过interval的请求，突发流量造成的短暂排队不受影响；
+    过载时等待超过target的请求都以503拒绝，不再解析，同时事件循环暂停accept，让新连接留在内核的监听队列中
+    一个请求的等待时间低于target，或者interval内没有请求出队（队列已经空了），就退出过载状态
+    多个工作线程并发更新，状态之间的竞争只会让判断推迟一个请求，不需要加锁
+*/
+class admission
+{
+public:
+    admission(int target_ms = 5, int interval_ms = 100)
+        : m_target(target_ms * 1000UL), m_interval(interval_ms * 1000UL), m_first_above(0), m_last_dequeue(0),
+          m_overloaded(false), m_shed(0)
+    {
+    }
+
+    // 工作线程取出请求时调用，enqueue_us为入队时间，now为当前时间(monotonic_us)，返回false表示该请求应当以503拒绝
+    bool admit(unsigned long enqueue_us, unsigned long now)
+    {
+        unsigned long sojourn = now > enqueue_us ? now - enqueue_us : 0;
+        m_last_dequeue.store(now, std::memory_order_relaxed);
+        if (sojourn < m_target)
+        {
+            m_first_above.store(0, std::memory_order_relaxed);
+            m_overloaded.store(false, std::memory_order_relaxed);
+            return true;
+        }
+        unsigned long first_above = m_first_above.load(std::memory_order_relaxed);
+        if (first_above == 0)
+        {
+            // 第一次高于target，再持续interval才算过载
+            m_first_above.store(now + m_interval, std::memory_order_relaxed);
+        }
+        else if (now >= first_above)
+        {
+            m_overloaded.store(true, std::memory_order_relaxed);
+        }
+        unsigned long limit = m_overloaded.load(std::memory_order_relaxed) ? m_target : m_interval;
+        if (sojourn > limit)
+        {
+            m_shed.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        return true;
+    }
+
+    // 事件循环据此决定是否暂停accept
+    bool overloaded() const
+    {
+        if (!m_overloaded.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+        // 过载后interval内没有请求出队，队列已经空了
+        unsigned long last = m_last_dequeue.load(std::memory_order_relaxed);
+        return monotonic_us() < last + m_interval;
+    }
+
+    unsigned long shed() const { return m_shed.load(std::memory_order_relaxed); } // 累计以503拒绝的请求数
+
+private:
+    const unsigned long m_target;   // 可以接受的排队时间(微秒)
+    const unsigned long m_interval; // 排队时间持续高于target多久算作过载(微秒)
+    std::atomic<unsigned long> m_first_above; // 排队时间第一次高于target之后再过interval的时刻，0表示目前低于target
+    std::atomic<unsigned long> m_last_dequeue; // 最近一次有请求出队的时刻
+    std::atomic<bool> m_overloaded;
+    std::atomic<unsigned long> m_shed;
+};
+
+#endif
@@ -0,0 +1,206 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <string>
+#include <vector>
+
+/*
+    CPU绑定与NUMA
+    拓扑从/sys/devices/system/node中读取，读不到时当作只有一个节点；只使用本进程可以运行的CPU(sched_getaffinity)
+    线程绑定到一个CPU后，内存分配策略也设为优先该CPU所在的节点：事件循环的连接对象池、缓冲区池都是在循环线程中
+    按需分配和第一次写入的，因此连接状态落在处理它的CPU所在节点的本地内存上
+    直接调用set_mempolicy系统调用，不依赖libnuma
+*/
+
+// 展开形如0-3,8的CPU列表，格式错误返回false
+inline bool parse_cpu_list(const char *text, std::vector<int> &cpus)
+{
+    cpus.clear();
+    const char *p = text;
+    while (*p && *p != '\n')
+    {
+        char *end = NULL;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0)
+        {
+            return false;
+        }
+        p = end;
+        if (*p == '-')
+        {
+            last = strtol(p + 1, &end, 10);
+            if (end == p + 1 || last < first)
+            {
+                return false;
+            }
+            p = end;
+        }
+        if (*p == ',')
+        {
+            ++p;
+        }
+        else if (*p && *p != '\n')
+        {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; ++cpu)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return true;
+}
+
+class cpu_topology
+{
+public:
+    // 进程内只读取一次
+    static const cpu_topology &get()
+    {
+        static cpu_topology topology;
+        return topology;
+    }
+
+    int node_count() const { return m_node_cpus.size(); }
+    const std::vector<int> &node_cpus(int index) const { return m_node_cpus[index]; } // 第index个节点上本进程可用的CPU
+    int node_id(int index) const { return m_node_ids[index]; }
+
+    // cpu所在节点的下标，不知道时返回0
+    int node_of(int cpu) const
+    {
+        for (size_t i = 0; i < m_node_cpus.size(); ++i)
+        {
+            for (size_t j = 0; j < m_node_cpus[i].size(); ++j)
+            {
+                if (m_node_cpus[i][j] == cpu)
+                {
+                    return i;
+                }
+            }
+        }
+        return 0;
+    }
+
+    // 本进程可用的所有CPU，各节点轮流取一个，循环数少于CPU数时也能均匀分布到各节点
+    std::vector<int> interleaved() const
+    {
+        std::vector<int> cpus;
+        for (size_t j = 0;; ++j)
+        {
+            size_t before = cpus.size();
+            for (size_t i = 0; i < m_node_cpus.size(); ++i)
+            {
+                if (j < m_node_cpus[i].size())
+                {
+                    cpus.push_back(m_node_cpus[i][j]);
+                }
+            }
+            if (cpus.size() == before)
+            {
+                return cpus;
+            }
+        }
+    }
+
+private:
+    cpu_topology()
+    {
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        std::vector<int> nodes;
+        std::string online = read_file("/sys/devices/system/node/online");
+        if (online.empty() || !parse_cpu_list(online.c_str(), nodes))
+        {
+            nodes.clear();
+        }
+        for (size_t i = 0; i < nodes.size(); ++i)
+        {
+            char path[64];
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", nodes[i]);
+            std::vector<int> cpus, usable;
+            parse_cpu_list(read_file(path).c_str(), cpus);
+            for (size_t j = 0; j < cpus.size(); ++j)
+            {
+                if (cpus[j] < CPU_SETSIZE && CPU_ISSET(cpus[j], &allowed))
+                {
+                    usable.push_back(cpus[j]);
+                }
+            }
+            // 没有可用CPU的节点(只有内存的节点，或者被cpuset排除)不参与分配
+            if (!usable.empty())
+            {
+                m_node_ids.push_back(nodes[i]);
+                m_node_cpus.push_back(usable);
+            }
+        }
+        if (m_node_cpus.empty())
+        {
+            std::vector<int> usable;
+            for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            {
+                if (CPU_ISSET(cpu, &allowed))
+                {
+                    usable.push_back(cpu);
+                }
+            }
+            m_node_ids.push_back(0);
+            m_node_cpus.push_back(usable);
+        }
+    }
+
+    static std::string read_file(const char *path)
+    {
+        std::string text;
+        FILE *fp = fopen(path, "r");
+        if (fp)
+        {
+            char buf[4096];
+            if (fgets(buf, sizeof(buf), fp))
+            {
+                text = buf;
+            }
+            fclose(fp);
+        }
+        return text;
+    }
+
+    std::vector<int> m_node_ids;                // 节点编号
+    std::vector<std::vector<int> > m_node_cpus; // 每个节点上本进程可用的CPU
+};
+
+// 把当前线程绑定到cpu上，多节点的机器上同时让它此后分配的内存优先来自cpu所在的节点，cpu为负数时什么也不做
+inline bool pin_thread(int cpu)
+{
+    if (cpu < 0)
+    {
+        return true;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    {
+        return false;
+    }
+    const cpu_topology &topology = cpu_topology::get();
+    int node = topology.node_id(topology.node_of(cpu));
+    if (topology.node_count() > 1 && node < 1024)
+    {
+        unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {0};
+        mask[node / (8 * sizeof(unsigned long))] |= 1UL << (node % (8 * sizeof(unsigned long)));
+        // 只是优先，本节点内存不足时仍然可以从其他节点分配
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8);
+    }
+    return true;
+}
+
+#endif
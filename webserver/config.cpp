@@ -0,0 +1,378 @@
+#include "config.h"
+#include "slab.h"
+#include "affinity.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <algorithm>
+
+// 配置项的描述，用成员指针把名字映射到字段上
+struct config_option
+{
+    const char *name;
+    int server_config::*ival;         // 整数项
+    std::string server_config::*sval; // 字符串项，二者只有一个不为NULL
+    long min;
+    long max;
+    const char *choices; // 字符串项允许的取值，用|分隔，NULL为不限
+    const char *help;
+};
+
+static const config_option options[] = {
+    {"port", &server_config::port, NULL, 1, 65535, NULL, "listening port (required)"},
+    {"loops", &server_config::loops, NULL, -1, 1024, NULL,
+     "0 for single reactor + threadpool, n > 0 for n reactors with SO_REUSEPORT, -1 for one per CPU (default 0)"},
+    {"threads", &server_config::threads, NULL, 1, 1024, NULL, "threadpool threads (default: online CPUs)"},
+    {"queue_size", &server_config::queue_size, NULL, 1, 1 << 24, NULL, "threadpool request queue length (default 10000)"},
+    {"queue_mode", NULL, &server_config::queue_mode, 0, 0, "list|ring|steal", "threadpool request queue (default ring)"},
+    {"send_mode", NULL, &server_config::send_mode, 0, 0, "sendfile|mmap", "how file bodies are sent (default sendfile)"},
+    {"io_mode", NULL, &server_config::io_mode, 0, 0, "epoll|uring",
+     "I/O backend, uring runs max(1, loops) io_uring loops without threadpool (default epoll)"},
+    {"cache_mb", &server_config::cache_mb, NULL, 0, 1 << 20, NULL, "static file cache size in MB, 0 disables it (default 64)"},
+    {"cache_file_kb", &server_config::cache_file_kb, NULL, 1, 1 << 20, NULL, "largest file kept in the cache (default 1024)"},
+    {"backlog", &server_config::backlog, NULL, 1, 65535, NULL, "listen queue length, capped by net.core.somaxconn (default 1024)"},
+    {"defer_accept", &server_config::defer_accept, NULL, 0, 3600, NULL,
+     "TCP_DEFER_ACCEPT seconds, wake up only when the first request data arrives (default 0, off)"},
+    {"max_fd", &server_config::max_fd, NULL, 64, 1 << 22, NULL, "largest file descriptor, also the connection limit (default 65536)"},
+    {"max_events", &server_config::max_events, NULL, 1, 1 << 20, NULL, "events returned by one epoll_wait (default 10000)"},
+    {"read_buffer_size", &server_config::read_buffer_size, NULL, 256, (long)buffer_pool::MAX_BLOCK, NULL,
+     "first read buffer block of a request in bytes (default 2048)"},
+    {"write_buffer_size", &server_config::write_buffer_size, NULL, 512, (long)buffer_pool::MAX_BLOCK, NULL,
+     "response header buffer in bytes (default 1024)"},
+    {"max_header_size", &server_config::max_header_size, NULL, 256, 64 << 20, NULL,
+     "request line and headers limit in bytes (default 32768)"},
+    {"max_body_size", &server_config::max_body_size, NULL, 0, INT_MAX, NULL, "request body limit in bytes, larger gets 413 (default 1048576)"},
+    {"idle_timeout_ms", &server_config::idle_timeout_ms, NULL, 1, 86400000, NULL, "keep-alive and send stall timeout (default 60000)"},
+    {"header_timeout_ms", &server_config::header_timeout_ms, NULL, 1, 86400000, NULL,
+     "time allowed to receive the request line and headers (default 10000)"},
+    {"body_timeout_ms", &server_config::body_timeout_ms, NULL, 1, 86400000, NULL, "read stall timeout for request bodies (default 30000)"},
+    {"drain_timeout_ms", &server_config::drain_timeout_ms, NULL, 0, 86400000, NULL,
+     "on SIGTERM or upgrade, wait this long for in-flight requests (default 30000)"},
+    {"timer_tick_ms", &server_config::timer_tick_ms, NULL, 0, 1000, NULL,
+     "timeout wheel resolution, 0 picks a tenth of the smallest timeout within 10-1000 (default 0)"},
+    {"admission_target_ms", &server_config::admission_target_ms, NULL, 1, 60000, NULL,
+     "acceptable threadpool queue wait before shedding (default 5)"},
+    {"admission_interval_ms", &server_config::admission_interval_ms, NULL, 1, 60000, NULL,
+     "how long the queue wait stays above target before overload (default 100)"},
+    {"doc_root", NULL, &server_config::doc_root, 0, 0, NULL, "directory served to clients"},
+    {"metrics_url", NULL, &server_config::metrics_url, 0, 0, NULL, "URL serving Prometheus metrics on the public listener, e.g. /metrics; off disables it (default off)"},
+    {"log_file", NULL, &server_config::log_file, 0, 0, NULL, "file for error and debug logs, - for stderr (default)"},
+    {"access_log", NULL, &server_config::access_log, 0, 0, NULL, "file for the access log, one line per response (default off)"},
+    {"cpus", NULL, &server_config::cpus, 0, 0, NULL,
+     "CPUs the event loops are pinned to in turn, e.g. 0-3,8; reactor listeners also steer connections by SO_INCOMING_CPU (default none)"},
+    {"worker_cpus", NULL, &server_config::worker_cpus, 0, 0, NULL, "CPUs the threadpool threads are pinned to in turn (default none)"},
+    {"numa", &server_config::numa, NULL, 0, 1, NULL,
+     "1 to place threads by NUMA node: one event loop and threadpool per node, or reactors spread over the nodes (default 0)"},
+};
+
+static const int OPTION_COUNT = sizeof(options) / sizeof(options[0]);
+
+// 旧的按位置传递的参数依次对应的配置项
+static const char *positional[] = {"port", "loops", "queue_mode", "send_mode", "cache_mb", "io_mode",
+                                   "backlog", "defer_accept", "metrics_url", "log_file", "access_log"};
+
+static const int POSITIONAL_COUNT = sizeof(positional) / sizeof(positional[0]);
+
+server_config::server_config()
+    : port(0), loops(0), threads(sysconf(_SC_NPROCESSORS_ONLN)), queue_size(10000), queue_mode("ring"),
+      send_mode("sendfile"), io_mode("epoll"), cache_mb(64), cache_file_kb(1024), backlog(1024), defer_accept(0),
+      max_fd(65536), max_events(10000), read_buffer_size(2048), write_buffer_size(1024), max_header_size(32 * 1024),
+      max_body_size(1024 * 1024), idle_timeout_ms(60000), header_timeout_ms(10000), body_timeout_ms(30000),
+      drain_timeout_ms(30000), timer_tick_ms(0), admission_target_ms(5), admission_interval_ms(100),
+      doc_root("/home/lichunlin/webserver/resources"), metrics_url("off"), numa(0)
+{
+    if (threads < 1)
+    {
+        threads = 1;
+    }
+}
+
+static std::string trim(const std::string &s)
+{
+    size_t begin = s.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos)
+    {
+        return "";
+    }
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(begin, end - begin + 1);
+}
+
+static bool in_choices(const char *value, const char *choices)
+{
+    size_t len = strlen(value);
+    for (const char *p = choices; *p;)
+    {
+        const char *bar = strchr(p, '|');
+        size_t n = bar ? (size_t)(bar - p) : strlen(p);
+        if (n == len && strncasecmp(p, value, n) == 0)
+        {
+            return true;
+        }
+        p += n + (bar ? 1 : 0);
+    }
+    return false;
+}
+
+bool server_config::set(const char *key, const char *value, std::string &err)
+{
+    for (int i = 0; i < OPTION_COUNT; ++i)
+    {
+        const config_option &opt = options[i];
+        if (strcmp(opt.name, key) != 0)
+        {
+            continue;
+        }
+        if (opt.sval)
+        {
+            if (opt.choices && !in_choices(value, opt.choices))
+            {
+                err = std::string(key) + " must be one of " + opt.choices + ", got '" + value + "'";
+                return false;
+            }
+            this->*opt.sval = value;
+            return true;
+        }
+        char *end = NULL;
+        errno = 0;
+        long n = strtol(value, &end, 10);
+        if (errno || end == value || *end != '\0')
+        {
+            err = std::string(key) + " expects an integer, got '" + value + "'";
+            return false;
+        }
+        if (n < opt.min || n > opt.max)
+        {
+            char buf[128];
+            snprintf(buf, sizeof(buf), " must be between %ld and %ld, got %ld", opt.min, opt.max, n);
+            err = std::string(key) + buf;
+            return false;
+        }
+        this->*opt.ival = (int)n;
+        return true;
+    }
+    err = std::string("unknown option '") + key + "'";
+    return false;
+}
+
+bool server_config::load_file(const char *path, std::string &err)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        err = std::string("cannot open config file ") + path + ": " + strerror(errno);
+        return false;
+    }
+    char line[1024];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp))
+    {
+        ++lineno;
+        std::string text(line);
+        size_t hash = text.find('#');
+        if (hash != std::string::npos)
+        {
+            text.erase(hash);
+        }
+        text = trim(text);
+        if (text.empty())
+        {
+            continue;
+        }
+        size_t eq = text.find('=');
+        std::string key = trim(text.substr(0, eq));
+        if (eq == std::string::npos || key.empty())
+        {
+            err = "expected key = value";
+            ok = false;
+        }
+        else
+        {
+            ok = set(key.c_str(), trim(text.substr(eq + 1)).c_str(), err);
+        }
+        if (!ok)
+        {
+            char where[64];
+            snprintf(where, sizeof(where), ":%d: ", lineno);
+            err = path + std::string(where) + err;
+        }
+    }
+    fclose(fp);
+    return ok;
+}
+
+bool server_config::parse(int argc, char *argv[], std::string &err)
+{
+    if (argc <= 1)
+    {
+        err.clear();
+        return false;
+    }
+    // 先读配置文件，命令行中的其他参数不论出现在前还是在后都覆盖配置文件
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+        {
+            err.clear();
+            return false;
+        }
+        if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0)
+        {
+            if (i + 1 >= argc)
+            {
+                err = std::string(argv[i]) + " expects a file";
+                return false;
+            }
+            if (!load_file(argv[++i], err))
+            {
+                return false;
+            }
+        }
+    }
+    int position = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char *arg = argv[i];
+        if (strcmp(arg, "-c") == 0 || strcmp(arg, "--config") == 0)
+        {
+            ++i;
+            continue;
+        }
+        if (strncmp(arg, "--", 2) == 0)
+        {
+            // --key=value 或 --key value
+            std::string key(arg + 2);
+            std::string value;
+            size_t eq = key.find('=');
+            if (eq != std::string::npos)
+            {
+                value = key.substr(eq + 1);
+                key.erase(eq);
+            }
+            else if (i + 1 < argc)
+            {
+                value = argv[++i];
+            }
+            else
+            {
+                err = std::string(arg) + " expects a value";
+                return false;
+            }
+            if (!set(key.c_str(), value.c_str(), err))
+            {
+                return false;
+            }
+            continue;
+        }
+        if (position >= POSITIONAL_COUNT)
+        {
+            err = std::string("unexpected argument '") + arg + "'";
+            return false;
+        }
+        if (!set(positional[position++], arg, err))
+        {
+            return false;
+        }
+    }
+    return validate(err);
+}
+
+// 检查CPU列表的格式，并且每个CPU都是本进程可以使用的
+static bool check_cpus(const char *key, const std::string &text, std::vector<int> &cpus, std::string &err)
+{
+    if (!parse_cpu_list(text.c_str(), cpus))
+    {
+        err = std::string(key) + " expects a list like 0-3,8, got '" + text + "'";
+        return false;
+    }
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (size_t i = 0; i < cpus.size(); ++i)
+    {
+        if (cpus[i] >= CPU_SETSIZE || !CPU_ISSET(cpus[i], &allowed))
+        {
+            char buf[64];
+            snprintf(buf, sizeof(buf), " cpu %d is not available to this process", cpus[i]);
+            err = key + std::string(buf);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool server_config::validate(std::string &err)
+{
+    if (port == 0)
+    {
+        err = "port is required";
+        return false;
+    }
+    struct stat st;
+    if (stat(doc_root.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+    {
+        err = "doc_root " + doc_root + " is not a directory";
+        return false;
+    }
+    // 完整路径是doc_root + URL，要给URL留出空间
+    if (doc_root.size() > 100)
+    {
+        err = "doc_root must be at most 100 characters";
+        return false;
+    }
+    if (metrics_url != "off" && metrics_url[0] != '/')
+    {
+        err = "metrics_url must start with / or be off";
+        return false;
+    }
+    if (max_header_size < read_buffer_size)
+    {
+        err = "max_header_size must not be smaller than read_buffer_size";
+        return false;
+    }
+
+    // 超时最多晚一个tick才被发现，取最小超时的十分之一，让各项超时的误差都在10%以内
+    if (timer_tick_ms == 0)
+    {
+        int shortest = std::min(idle_timeout_ms, std::min(header_timeout_ms, body_timeout_ms));
+        timer_tick_ms = std::max(10, std::min(1000, shortest / 10));
+    }
+
+    if (!check_cpus("cpus", cpus, cpu_list, err) || !check_cpus("worker_cpus", worker_cpus, worker_cpu_list, err))
+    {
+        return false;
+    }
+    if (numa && (!cpu_list.empty() || !worker_cpu_list.empty()))
+    {
+        err = "numa places threads by node itself, do not combine it with cpus or worker_cpus";
+        return false;
+    }
+
+    // 连接数上限受RLIMIT_NOFILE限制，尽量把软限制提高到max_fd
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)max_fd)
+    {
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= (rlim_t)max_fd) ? (rlim_t)max_fd : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return true;
+}
+
+void server_config::usage(const char *prog)
+{
+    printf("usage: %s [-c config_file] [--key=value ...] [port [loops [queue_mode [send_mode [cache_mb [io_mode [backlog "
+           "[defer_accept [metrics_url [log_file [access_log]]]]]]]]]]]\n",
+           prog);
+    printf("the config file has one key = value per line, command line options override it\n");
+    for (int i = 0; i < OPTION_COUNT; ++i)
+    {
+        printf("  %-22s %s\n", options[i].name, options[i].help);
+    }
+}
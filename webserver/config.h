@@ -0,0 +1,68 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <string>
+#include <vector>
+
+/*
+    运行时配置
+    先取默认值，再读取配置文件，最后用命令行参数覆盖，全部读完后统一检查取值范围，检查不通过时服务器不启动
+    配置文件每行一个 key = value，#之后是注释：
+        port = 9006
+        threads = 16
+        cpus = 0-7,16-23
+    命令行：
+        ./server -c server.conf --threads=16 --idle_timeout_ms 30000
+    为了兼容旧的用法，不带--的参数依次对应 port loops queue_mode send_mode cache_mb io_mode backlog defer_accept
+    metrics_url log_file access_log
+*/
+struct server_config
+{
+    int port;
+    int loops;          // 事件循环的数量，0为单Reactor + 线程池，-1为每个CPU一个
+    int threads;        // 线程池的线程数，默认为在线的CPU数
+    int queue_size;     // 线程池请求队列的长度
+    std::string queue_mode; // list、ring或steal
+    std::string send_mode;  // sendfile或mmap
+    std::string io_mode;    // epoll或uring
+    int cache_mb;       // 静态文件缓存的大小，0为不缓存
+    int cache_file_kb;  // 可以缓存的单个文件的上限
+    int backlog;
+    int defer_accept;
+    int max_fd;         // 最大的文件描述符，也是最大连接数
+    int max_events;     // 一次epoll_wait最多返回的事件数
+    int read_buffer_size;
+    int write_buffer_size;
+    int max_header_size;
+    int max_body_size;
+    int idle_timeout_ms;
+    int header_timeout_ms;
+    int body_timeout_ms;
+    int drain_timeout_ms; // 退出时等待正在处理的请求的最长时间
+    int timer_tick_ms;    // 超时时间轮的精度，0为按最小的超时时间自动选择，检查后是实际使用的值
+    int admission_target_ms;
+    int admission_interval_ms;
+    std::string doc_root;
+    std::string metrics_url; // off为不提供(默认)，监控指标与网页走同一个端口，任何客户端都能访问
+    std::string log_file;    // 空或者-为标准错误
+    std::string access_log;  // 空为不记录
+    std::string cpus;        // 事件循环绑定的CPU列表，如0-3,8，空为不绑定
+    std::string worker_cpus; // 线程池的线程绑定的CPU列表
+    int numa;                // 为1时按NUMA节点放置线程，不能与cpus、worker_cpus同时使用
+
+    std::vector<int> cpu_list;        // 检查时由cpus展开
+    std::vector<int> worker_cpu_list; // 检查时由worker_cpus展开
+
+    server_config(); // 默认值
+
+    // 解析命令行，其中-c/--config指定的配置文件先于其他参数读取；出错时把原因写到err并返回false，
+    // 请求帮助(-h)时返回false并且err为空
+    bool parse(int argc, char *argv[], std::string &err);
+    bool load_file(const char *path, std::string &err);
+    bool set(const char *key, const char *value, std::string &err);
+    bool validate(std::string &err);
+
+    static void usage(const char *prog);
+};
+
+#endif
@@ -0,0 +1,242 @@
+#include "control.h"
+#include "http_conn.h"
+#include "log.h"
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+
+extern char **environ;
+
+// 新进程从这个环境变量得到与旧进程相连的UNIX socket
+static const char UPGRADE_ENV[] = "WEBSERVER_UPGRADE_FD";
+// 等待新进程就绪的最长时间
+static const int UPGRADE_TIMEOUT_MS = 10000;
+static const int MAX_LISTENFDS = 256;
+
+static char g_exe[PATH_MAX];
+static char **g_argv = NULL;
+static sigset_t g_signals;
+static std::vector<int> g_listenfds;
+static int g_upgrade_fd = -1; // 新进程中与旧进程相连的socket，就绪后关闭
+
+void server_control::init(int argc, char *argv[])
+{
+    // 热升级时执行的是磁盘上新的可执行文件，旧文件已被替换时readlink的结果带有" (deleted)"
+    ssize_t len = readlink("/proc/self/exe", g_exe, sizeof(g_exe) - 1);
+    if (len < 0)
+    {
+        len = 0;
+    }
+    g_exe[len] = '\0';
+    const char *deleted = " (deleted)";
+    size_t n = strlen(deleted);
+    if ((size_t)len > n && strcmp(g_exe + len - n, deleted) == 0)
+    {
+        g_exe[len - n] = '\0';
+    }
+    g_argv = argv;
+    (void)argc;
+    // 之后创建的线程都继承这个屏蔽字，这些信号只由控制线程接收
+    sigemptyset(&g_signals);
+    sigaddset(&g_signals, SIGTERM);
+    sigaddset(&g_signals, SIGINT);
+    sigaddset(&g_signals, SIGHUP);
+    sigaddset(&g_signals, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &g_signals, NULL);
+}
+
+int server_control::inherit_listenfds(int *fds, int max)
+{
+    const char *env = getenv(UPGRADE_ENV);
+    if (!env)
+    {
+        return 0;
+    }
+    int sock = atoi(env);
+    unsetenv(UPGRADE_ENV);
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+    if (max > MAX_LISTENFDS)
+    {
+        max = MAX_LISTENFDS;
+    }
+    char byte;
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTENFDS)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * max);
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) <= 0)
+    {
+        close(sock);
+        return 0;
+    }
+    int count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+        }
+    }
+    g_upgrade_fd = sock;
+    return count;
+}
+
+bool server_control::start(const int *listenfds, int count)
+{
+    g_listenfds.assign(listenfds, listenfds + count);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run, NULL) != 0)
+    {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+void server_control::ready()
+{
+    if (g_upgrade_fd < 0)
+    {
+        return;
+    }
+    if (write(g_upgrade_fd, "R", 1) != 1)
+    {
+        LOG_WARN("notify the old process failed, errno is: %d", errno);
+    }
+    close(g_upgrade_fd);
+    g_upgrade_fd = -1;
+}
+
+void *server_control::run(void *)
+{
+    while (true)
+    {
+        siginfo_t info;
+        int sig = sigwaitinfo(&g_signals, &info);
+        if (sig < 0)
+        {
+            continue;
+        }
+        if (sig == SIGHUP || sig == SIGUSR2)
+        {
+            upgrade();
+        }
+        else if (http_conn::m_draining.exchange(true))
+        {
+            // 第二次退出信号，不再等待正在处理的请求
+            LOG_WARN("signal %d while draining, exit now", sig);
+            _exit(1);
+        }
+        else
+        {
+            LOG_INFO("signal %d, stop accepting and drain connections", sig);
+        }
+    }
+    return NULL;
+}
+
+void server_control::upgrade()
+{
+    if (http_conn::m_draining.load())
+    {
+        return;
+    }
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        LOG_ERROR("upgrade: socketpair failed, errno is: %d", errno);
+        return;
+    }
+    // fork之后子进程中只能调用异步信号安全的函数，环境变量在fork之前准备好
+    std::vector<std::string> env;
+    for (char **e = environ; *e; ++e)
+    {
+        if (strncmp(*e, UPGRADE_ENV, sizeof(UPGRADE_ENV) - 1) != 0)
+        {
+            env.push_back(*e);
+        }
+    }
+    env.push_back(std::string(UPGRADE_ENV) + "=" + std::to_string(sv[1]));
+    std::vector<char *> envp;
+    for (size_t i = 0; i < env.size(); ++i)
+    {
+        envp.push_back(&env[i][0]);
+    }
+    envp.push_back(NULL);
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        LOG_ERROR("upgrade: fork failed, errno is: %d", errno);
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0)
+    {
+        // 只有这一端留给新进程，其余的文件描述符都带有CLOEXEC
+        fcntl(sv[1], F_SETFD, 0);
+        execve(g_exe, g_argv, &envp[0]);
+        _exit(127);
+    }
+    close(sv[1]);
+    bool ok = send_fds(sv[0], &g_listenfds[0], g_listenfds.size());
+    char reply = 0;
+    struct pollfd pfd;
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    ok = ok && poll(&pfd, 1, UPGRADE_TIMEOUT_MS) == 1 && read(sv[0], &reply, 1) == 1 && reply == 'R';
+    close(sv[0]);
+    if (!ok)
+    {
+        // 新进程没能就绪，杀掉它，旧进程继续服务
+        LOG_ERROR("upgrade: new process %d did not become ready, keep serving", pid);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return;
+    }
+    LOG_INFO("upgrade: new process %d is ready, drain connections", pid);
+    http_conn::m_draining.store(true);
+}
+
+bool server_control::send_fds(int sock, const int *fds, int count)
+{
+    if (count <= 0 || count > MAX_LISTENFDS)
+    {
+        return false;
+    }
+    char byte = 'F';
+    struct iovec iov;
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    char control[CMSG_SPACE(sizeof(int) * MAX_LISTENFDS)];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) == 1;
+}
@@ -0,0 +1,32 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+/*
+    进程控制：优雅退出与热升级
+    SIGTERM/SIGINT：设置http_conn::m_draining，各个事件循环在下一个tick停止accept、关闭空闲的keep-alive连接，
+        正在处理的请求发送完响应后关闭连接，全部连接关闭(或超过drain_timeout_ms)后循环返回，主线程再依次回收
+        线程池的线程和其他资源。退出过程中再收到一次SIGTERM/SIGINT时立即退出
+    SIGUSR2/SIGHUP：用同样的参数重新执行磁盘上的可执行文件，通过UNIX socket(SCM_RIGHTS)把监听socket交给新进程，
+        新进程创建好事件循环后回复就绪，旧进程随后按上面的方式退出。两个进程共用同一批监听socket，
+        accept队列中的连接不会丢失；新进程启动失败时旧进程继续服务
+    信号由一个专门的控制线程用sigwaitinfo同步接收，不在信号处理函数中做任何事
+*/
+class server_control
+{
+public:
+    // 必须在创建任何线程之前调用：屏蔽由控制线程处理的信号，记下重新执行自己需要的路径和参数
+    static void init(int argc, char *argv[]);
+    // 由旧进程启动时从它那里接收监听socket，返回个数，不是热升级启动时返回0
+    static int inherit_listenfds(int *fds, int max);
+    // 启动控制线程，热升级时把这些监听socket交给新进程
+    static bool start(const int *listenfds, int count);
+    // 新进程准备好服务后通知旧进程，旧进程开始退出
+    static void ready();
+
+private:
+    static void *run(void *arg);
+    static void upgrade();
+    static bool send_fds(int sock, const int *fds, int count);
+};
+
+#endif
@@ -0,0 +1,395 @@
+#include "eventloop.h"
+#include "http_response.h"
+#include <sys/timerfd.h>
+#include <netinet/tcp.h>
+#include <sched.h>
+#include <time.h>
+
+// 添加epoll文件描述符函数
+extern void addfd(int epollfd, int fd, bool one_shot);
+
+// 当前线程运行的事件循环，时间轮的回调函数通过它找到连接所属的循环
+static thread_local eventloop *t_loop = NULL;
+
+// 单调时钟的当前时间，与时间轮使用同一个时钟
+static unsigned long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int eventloop::m_max_fd = 65536;
+int eventloop::m_max_events = 10000;
+int eventloop::m_drain_timeout = 30000;
+int eventloop::m_tick_ms = 1000;
+
+int create_listenfd(int port, bool reuseport, int backlog, int defer_accept, int incoming_cpu)
+{
+    int listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenfd < 0)
+    {
+        return -1;
+    }
+
+    struct sockaddr_in address;
+    bzero(&address, sizeof(address));
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+
+    // 端口复用，在绑定之前设置
+    int reuse = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (reuseport)
+    {
+        // 每个事件循环绑定同一个端口，内核按四元组哈希把新连接分配到各个监听socket
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse));
+    }
+    if (incoming_cpu >= 0)
+    {
+        setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, sizeof(incoming_cpu));
+    }
+    if (defer_accept > 0)
+    {
+        setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_accept, sizeof(defer_accept));
+    }
+    // 绑定
+    if (bind(listenfd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close(listenfd);
+        return -1;
+    }
+    // 监听
+    if (listen(listenfd, backlog) < 0)
+    {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+void send_unavailable(int fd)
+{
+    const std::string *response = fixed_response(503, false);
+    send(fd, response->data(), response->size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+eventloop::eventloop(int listenfd, http_conn **users, threadpool<http_conn> *pool)
+    : m_epollfd(-1), m_listenfd(listenfd), m_users(users), m_pool(pool), m_events(NULL), m_timerfd(-1),
+      m_timers(m_tick_ms), m_now(now_ms()), m_accept_paused(false), m_cpu(-1), m_conn_count(0), m_draining(false),
+      m_drain_deadline(0)
+{
+    // 创建epoll对象
+    m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epollfd < 0)
+    {
+        throw std::exception();
+    }
+    // 以时间轮的精度周期性触发的定时器，和其他事件一起由epoll_wait返回，不需要信号
+    m_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (m_timerfd < 0)
+    {
+        close(m_epollfd);
+        throw std::exception();
+    }
+    struct itimerspec its;
+    its.it_value.tv_sec = its.it_interval.tv_sec = m_timers.tick_ms() / 1000;
+    its.it_value.tv_nsec = its.it_interval.tv_nsec = (m_timers.tick_ms() % 1000) * 1000000L;
+    timerfd_settime(m_timerfd, 0, &its, NULL);
+
+    m_events = new epoll_event[m_max_events];
+    // 添加到epoll对象中
+    addfd(m_epollfd, m_listenfd, false);
+    addfd(m_epollfd, m_timerfd, false);
+}
+
+eventloop::~eventloop()
+{
+    close(m_timerfd);
+    close(m_epollfd);
+    delete[] m_events;
+}
+
+bool eventloop::start()
+{
+    return pthread_create(&m_thread, NULL, worker, this) == 0;
+}
+
+void eventloop::join()
+{
+    pthread_join(m_thread, NULL);
+}
+
+void *eventloop::worker(void *arg)
+{
+    eventloop *el = (eventloop *)arg;
+    el->loop();
+    return el;
+}
+
+void eventloop::loop()
+{
+    t_loop = this;
+    if (!pin_thread(m_cpu))
+    {
+        LOG_WARN("pin event loop to cpu %d failed", m_cpu);
+    }
+    while (true)
+    {
+        // 循环监测有无事件发生
+        int number = epoll_wait(m_epollfd, m_events, m_max_events, -1);
+
+        if ((number < 0) && (errno != EINTR))
+        {
+            LOG_ERROR("epoll failure, errno is: %d", errno);
+            break;
+        }
+        m_now = now_ms();
+        // 循环遍历事件数
+        for (int i = 0; i < number; i++)
+        {
+            // 监听到的文件描述符
+            int sockfd = m_events[i].data.fd;
+            // 有客户端连接
+            if (sockfd == m_listenfd)
+            {
+                handle_accept();
+            }
+            else if (sockfd == m_timerfd)
+            {
+                handle_timer();
+            }
+            else if (!m_users[sockfd])
+            {
+                // 同一批事件中前面的处理已经关闭了这个连接
+                continue;
+            }
+            else if (m_events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                // 对方异常断开或者错误等事件
+                close_conn(sockfd);
+            }
+            else if (m_events[i].events & EPOLLIN) // 是否有读的事件发生
+            {
+                handle_read(sockfd);
+            }
+            else if (m_events[i].events & EPOLLOUT)
+            {
+                handle_write(sockfd);
+            }
+        }
+        update_accept();
+        if (m_draining && m_conn_count == 0)
+        {
+            break;
+        }
+    }
+}
+
+void eventloop::handle_accept()
+{
+    unsigned long batch = 0;
+    while (batch < MAX_ACCEPT_BATCH)
+    {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+        // 新连接直接设为非阻塞和close-on-exec，省去之后的fcntl
+        int connfd = accept4(m_listenfd, (struct sockaddr *)&client_address, &client_addrlength,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            // EAGAIN表示队列已经取空
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                LOG_WARN("accept failed, errno is: %d", errno);
+            }
+            break;
+        }
+        ++batch;
+
+        if (connfd >= m_max_fd || http_conn::m_user_count >= m_max_fd) // 目前连接数满
+        {
+            // 目前连接满，给客户端写一个信息：服务器正满
+            send_unavailable(connfd);
+            close(connfd); // 关闭连接
+            local_metrics()->accept_rejected.add();
+            continue;
+        }
+        // 从本循环的对象池中取出连接对象并初始化，连接注册到本循环的epoll上；读写缓冲区等到有数据时再分配
+        http_conn *user = m_conns.alloc();
+        ++m_conn_count;
+        m_users[connfd] = user;
+        user->init(connfd, client_address, m_epollfd);
+        // 新连接在空闲超时内必须开始发送请求
+        user->touch(m_now, false);
+        tw_timer<http_conn> *timer = user->timer();
+        timer->user_data = user;
+        timer->cb_func = on_timeout;
+        m_timers.add_timer(timer, user->timeout_left(m_now));
+    }
+    thread_metrics *metrics = local_metrics();
+    metrics->accept_wakeups.add();
+    metrics->accepts.add(batch);
+    metrics->accept_max_batch.max(batch);
+}
+
+void eventloop::handle_read(int sockfd)
+{
+    http_conn *user = m_users[sockfd];
+    bool start = user->idle();
+    if (!user->attach_buffers(&m_buffers) || !user->read()) // 一次性把所有数据读完
+    {
+        close_conn(sockfd); // 关闭连接
+        return;
+    }
+    user->touch(m_now, start);
+    // 延长只修改到期时间，只有期限提前（比如新请求开始，头部超时比空闲超时短）时才移动定时器
+    m_timers.adjust_timer(user->timer(), user->timeout_left(m_now));
+    dispatch(sockfd);
+}
+
+void eventloop::dispatch(int sockfd)
+{
+    http_conn *user = m_users[sockfd];
+    user->set_busy();
+    if (m_pool)
+    {
+        user->set_enqueue_time(monotonic_us());
+        // 交给工作线程处理，工作窃取模式下同一个连接尽量由同一个线程处理
+        if (!m_pool->append(user, sockfd))
+        {
+            // 请求队列已满，回复503后关闭
+            user->clear_busy();
+            send_unavailable(sockfd);
+            close_conn(sockfd);
+        }
+        return;
+    }
+    // 多Reactor模式：在本线程内解析并立即尝试写回，省去一次epoll_wait往返
+    if (user->process())
+    {
+        handle_write(sockfd);
+    }
+}
+
+void eventloop::handle_write(int sockfd)
+{
+    http_conn *user = m_users[sockfd];
+    if (!user->write()) // 写事件，一次性写完所有数据
+    {
+        close_conn(sockfd); // 关闭连接
+        return;
+    }
+    user->touch(m_now, false);
+    m_timers.adjust_timer(user->timer(), user->timeout_left(m_now));
+    // 流水线：读缓冲区中还有已经收到的请求，它们不会再触发EPOLLIN，直接继续处理
+    if (user->has_pending_request())
+    {
+        dispatch(sockfd);
+    }
+    else if (user->idle())
+    {
+        // 等待下一个请求期间不占用缓冲区
+        user->release_buffers(&m_buffers);
+    }
+}
+
+void eventloop::handle_timer()
+{
+    uint64_t expirations;
+    if (read(m_timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    {
+        return;
+    }
+    m_now = now_ms();
+    m_timers.tick();
+    if (http_conn::m_draining.load(std::memory_order_relaxed))
+    {
+        drain();
+    }
+}
+
+void eventloop::drain()
+{
+    if (!m_draining)
+    {
+        // 监听socket不在这里关闭：热升级时新进程持有它的副本，队列中的连接由新进程accept
+        m_draining = true;
+        m_drain_deadline = m_now + m_drain_timeout;
+        epoll_ctl(m_epollfd, EPOLL_CTL_DEL, m_listenfd, 0);
+    }
+    // 正在被工作线程处理的连接等到下一个tick
+    bool expired = m_now >= m_drain_deadline;
+    m_conns.for_each([this, expired](http_conn *user) {
+        if (user->sockfd() >= 0 && !user->busy() && (expired || user->idle()))
+        {
+            close_conn(user->sockfd());
+        }
+    });
+}
+
+void eventloop::update_accept()
+{
+    if (m_draining)
+    {
+        return;
+    }
+    bool pause = http_conn::m_user_count >= m_max_fd || (http_conn::m_admission && http_conn::m_admission->overloaded());
+    if (pause == m_accept_paused)
+    {
+        return;
+    }
+    // 监听socket是水平触发的，恢复监听后积压在队列中的连接会立即产生事件
+    m_accept_paused = pause;
+    epoll_event event;
+    event.data.fd = m_listenfd;
+    event.events = pause ? 0 : (EPOLLIN | EPOLLRDHUP);
+    epoll_ctl(m_epollfd, EPOLL_CTL_MOD, m_listenfd, &event);
+}
+
+void eventloop::close_conn(int sockfd)
+{
+    http_conn *user = m_users[sockfd];
+    // 工作线程重新注册事件之后、结束busy状态之前的短暂窗口内连接就可能被关闭，等它结束再回收对象
+    while (user->busy())
+    {
+        sched_yield();
+    }
+    // 先清除映射再关闭socket，关闭之后同一个fd可能立即被其他循环accept
+    m_users[sockfd] = NULL;
+    m_timers.del_timer(user->timer());
+    user->close_conn();
+    user->release_buffers(&m_buffers);
+    m_conns.release(user);
+    --m_conn_count;
+}
+
+void eventloop::on_timeout(http_conn *user)
+{
+    t_loop->expire(user);
+}
+
+void eventloop::expire(http_conn *user)
+{
+    // 到期的定时器已经从时间轮上摘下
+    if (user->busy())
+    {
+        // 工作线程正在处理，稍后再检查
+        m_timers.add_timer(user->timer(), m_timers.tick_ms());
+        return;
+    }
+    // 工作线程解析请求时连接的阶段可能已经变化，这里按当前的阶段算出真正的期限
+    long left = user->timeout_left(m_now);
+    if (left > 0)
+    {
+        m_timers.add_timer(user->timer(), left);
+        return;
+    }
+    local_metrics()->timeouts.add();
+    close_conn(user->sockfd());
+}
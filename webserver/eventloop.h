@@ -0,0 +1,87 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include "http_conn.h"
+#include "threadpool.h"
+#include "time_wheel.h"
+#include "slab.h"
+#include "metrics.h"
+#include "affinity.h"
+
+#define MAX_ACCEPT_BATCH 256   // 一次唤醒最多接受的连接数，剩下的留给下一轮，避免连接风暴时饿死已有连接
+
+// 创建并监听端口，reuseport为true时设置SO_REUSEPORT，使多个监听socket绑定同一端口，由内核做负载均衡
+// backlog为listen的全连接队列长度(受net.core.somaxconn限制)，defer_accept大于0时设置TCP_DEFER_ACCEPT，
+// 连接在收到第一个数据包(或超过这么多秒)之后才能被accept，不发数据的连接不会唤醒事件循环
+// incoming_cpu不为负数时设置SO_INCOMING_CPU：同一组SO_REUSEPORT监听socket中，内核优先把在这个CPU上收到的连接
+// 交给它，与把循环绑定到同一个CPU(网卡队列的中断所在的CPU)配合，连接从收包到处理都不离开这个CPU
+// 返回的监听socket是非阻塞的
+int create_listenfd(int port, bool reuseport, int backlog, int defer_accept, int incoming_cpu);
+
+// 尽力发送预先生成的503响应(带Retry-After)，不阻塞，用于连接数已满或者请求队列已满时拒绝客户端，之后由调用者关闭连接
+void send_unavailable(int fd);
+
+/*
+    事件循环类，一个eventloop拥有一个epoll实例和一个监听socket
+    单Reactor模式：主线程运行唯一的eventloop，负责accept和读写，请求的解析交给线程池
+    多Reactor模式(one loop per thread)：每个线程运行自己的eventloop，拥有自己的SO_REUSEPORT监听socket，
+    连接从accept到读、解析、写都在本线程内完成，线程之间没有任何交接
+    每个循环用一个timerfd驱动自己的时间轮，负责关闭本循环中空闲、收头部太慢或者收请求体太慢的连接
+    服务器退出(http_conn::m_draining)时，循环在下一个tick停止accept、关闭空闲的连接，正在处理的请求发送完响应后关闭，
+    本循环的连接全部关闭(或者超过m_drain_timeout强制关闭)后loop()返回
+*/
+class eventloop
+{
+public:
+    // pool为NULL时，请求在本线程内直接处理
+    eventloop(int listenfd, http_conn **users, threadpool<http_conn> *pool);
+    ~eventloop();
+
+    bool start(); // 创建一个线程运行事件循环
+    void join();  // 等待事件循环线程结束
+    void loop();  // 在当前线程运行事件循环
+    void set_cpu(int cpu) { m_cpu = cpu; } // 运行循环的线程绑定到cpu上，在start或loop之前调用
+
+    static int m_max_fd;     // 最大的文件描述符，也是最大连接数
+    static int m_max_events; // 一次epoll_wait最多返回的事件数
+    static int m_drain_timeout; // 退出时等待正在处理的请求的最长时间(毫秒)
+    static int m_tick_ms;       // 时间轮的精度(毫秒)，io_uring后端也使用它
+
+private:
+    static void *worker(void *arg);
+    void handle_accept(); // 一次接受监听队列中所有的连接，最多MAX_ACCEPT_BATCH个
+    void handle_read(int sockfd);
+    void dispatch(int sockfd); // 处理读缓冲区中的请求：交给线程池，或者在本线程内解析
+    void handle_write(int sockfd);
+    void handle_timer();            // timerfd到期，推进时间轮
+    void update_accept();           // 过载或者连接数已满时暂停监听socket的事件，恢复后重新监听
+    void drain();                   // 退出过程中每个tick调用一次，关闭已经空闲的连接，超过期限后关闭所有连接
+    void close_conn(int sockfd);    // 删除定时器并关闭连接，连接只在这里关闭
+    static void on_timeout(http_conn *user); // 时间轮的回调函数
+    void expire(http_conn *user);
+
+private:
+    int m_epollfd;                 // 本循环的epoll实例
+    int m_listenfd;                // 本循环的监听socket
+    http_conn **m_users;           // 所有循环共享的文件描述符到连接的映射，不同循环的fd互不相同，没有连接时为NULL
+    threadpool<http_conn> *m_pool; // 单Reactor模式下的线程池
+    epoll_event *m_events;         // epoll_wait返回的事件数组
+    int m_timerfd;                 // 按时间轮的精度周期性触发
+    time_wheel<http_conn> m_timers; // 本循环中所有连接的超时定时器
+    object_pool<http_conn> m_conns; // 本循环的连接对象，关闭后放回重复使用
+    buffer_pool m_buffers;          // 本循环的连接使用的读写缓冲区
+    unsigned long m_now;           // 本轮事件处理开始时的时间(毫秒)，所有读写共用，省去每次取时间
+    bool m_accept_paused;          // 监听socket是否已从epoll中暂停，暂停期间新连接留在内核的监听队列中
+    int m_cpu;                     // 绑定的CPU，-1表示不绑定
+    int m_conn_count;              // 本循环中打开的连接数
+    bool m_draining;               // 已经开始退出，不再accept
+    unsigned long m_drain_deadline; // 超过这个时间(毫秒)关闭所有连接
+    pthread_t m_thread;
+};
+
+#endif
@@ -0,0 +1,394 @@
+#include "file_cache.h"
+#include "http_response.h"
+#include <sys/inotify.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+
+file_cache::file_cache(const char *root, size_t capacity, size_t max_file_size)
+    : m_shard_capacity(capacity / SHARDS), m_max_file_size(max_file_size), m_inotify_fd(-1)
+{
+    // 一个文件只能放在它所在的分片中
+    if (m_max_file_size > m_shard_capacity)
+    {
+        m_max_file_size = m_shard_capacity;
+    }
+    char buf[PATH_MAX];
+    int len = normalize(root, buf, sizeof(buf));
+    if (len < 0)
+    {
+        throw std::exception();
+    }
+    m_root.assign(buf, len);
+    m_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_inotify_fd < 0)
+    {
+        throw std::exception();
+    }
+    if (pipe2(m_stop_pipe, O_CLOEXEC) < 0)
+    {
+        close(m_inotify_fd);
+        throw std::exception();
+    }
+    watch_dir(m_root);
+    if (pthread_create(&m_thread, NULL, watcher, this) != 0)
+    {
+        close(m_inotify_fd);
+        close(m_stop_pipe[0]);
+        close(m_stop_pipe[1]);
+        throw std::exception();
+    }
+}
+
+file_cache::~file_cache()
+{
+    // 唤醒监视线程并等待它退出
+    char c = 0;
+    if (::write(m_stop_pipe[1], &c, 1) == 1)
+    {
+        pthread_join(m_thread, NULL);
+    }
+    close(m_inotify_fd);
+    close(m_stop_pipe[0]);
+    close(m_stop_pipe[1]);
+}
+
+// FNV-1a
+size_t file_cache::hash(const char *data, size_t len)
+{
+    size_t h = 14695981039346656037UL;
+    for (size_t i = 0; i < len; ++i)
+    {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+int file_cache::normalize(const char *path, char *buf, int size)
+{
+    // 逐段处理，".."回退到上一段，不会越过根
+    int n = 0;
+    const char *p = path;
+    while (*p)
+    {
+        while (*p == '/')
+        {
+            ++p;
+        }
+        const char *end = p;
+        while (*end && *end != '/')
+        {
+            ++end;
+        }
+        int len = end - p;
+        if (len == 0 || (len == 1 && p[0] == '.'))
+        {
+            // 空段或"."
+        }
+        else if (len == 2 && p[0] == '.' && p[1] == '.')
+        {
+            while (n > 0 && buf[n - 1] != '/')
+            {
+                --n;
+            }
+            if (n > 0)
+            {
+                --n;
+            }
+        }
+        else
+        {
+            if (n + 1 + len >= size)
+            {
+                return -1;
+            }
+            buf[n++] = '/';
+            memcpy(buf + n, p, len);
+            n += len;
+        }
+        p = end;
+    }
+    if (n == 0)
+    {
+        buf[n++] = '/';
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+std::shared_ptr<const cached_file> file_cache::get(const char *path)
+{
+    char buf[PATH_MAX];
+    int len = normalize(path, buf, sizeof(buf));
+    if (len < 0 || (size_t)len <= m_root.size() || memcmp(buf, m_root.data(), m_root.size()) != 0 ||
+        buf[m_root.size()] != '/')
+    {
+        return std::shared_ptr<const cached_file>();
+    }
+    path_key key = {buf, (size_t)len};
+    shard &s = shard_of(key);
+
+    s.lock.lock();
+    entry_map::iterator it = s.entries.find(key);
+    if (it != s.entries.end())
+    {
+        // 命中，移到LRU表头
+        s.lru.splice(s.lru.begin(), s.lru, it->second);
+        std::shared_ptr<const cached_file> file = *it->second;
+        s.lock.unlock();
+        return file;
+    }
+    unsigned long generation = s.generation;
+    s.lock.unlock();
+
+    // 未命中，在锁外读取文件，避免阻塞其他线程的查找
+    std::shared_ptr<cached_file> file = load(key);
+
+    s.lock.lock();
+    // 加载期间有文件发生了变化，读到的内容可能已经过时，只给这一次请求使用
+    if (generation == s.generation)
+    {
+        it = s.entries.find(key);
+        if (it != s.entries.end())
+        {
+            // 其他线程已经加载过了，使用缓存中的那一份
+            file = *it->second;
+        }
+        else
+        {
+            insert(s, file);
+        }
+    }
+    s.lock.unlock();
+    return file;
+}
+
+std::shared_ptr<cached_file> file_cache::load(const path_key &key)
+{
+    std::shared_ptr<cached_file> file(new cached_file);
+    file->path.assign(key.data, key.len);
+    if (stat(key.data, &file->st) < 0)
+    {
+        file->kind = cached_file::FILE_MISSING;
+        return file;
+    }
+    const struct stat &st = file->st;
+    // 只缓存其他用户可读的普通文件的内容，其余情况只记下stat的结果，由调用者按原来的方式处理
+    file->kind = cached_file::FILE_STAT;
+    if (!S_ISREG(st.st_mode) || !(st.st_mode & S_IROTH) || (size_t)st.st_size > m_max_file_size)
+    {
+        return file;
+    }
+    int fd = open(key.data, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return file;
+    }
+
+    file->data.resize(st.st_size);
+    size_t have_read = 0;
+    while (have_read < (size_t)st.st_size)
+    {
+        ssize_t n = read(fd, &file->data[have_read], st.st_size - have_read);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            // 文件在读取过程中被截断，不缓存内容
+            close(fd);
+            file->data.clear();
+            return file;
+        }
+        have_read += n;
+    }
+    close(fd);
+
+    // 响应头与http_conn::process_write生成的200、304响应完全一致
+    char header[FILE_HEADER_MAX];
+    for (int linger = 0; linger < 2; ++linger)
+    {
+        int len = build_file_header(header, st, linger);
+        file->header[linger].assign(header, len);
+        len = build_not_modified_header(header, st, linger);
+        file->not_modified[linger].assign(header, len);
+    }
+    file->etag.assign(header, build_etag(header, st));
+    file->kind = cached_file::FILE_DATA;
+    return file;
+}
+
+void file_cache::insert(shard &s, const std::shared_ptr<cached_file> &file)
+{
+    size_t size = charge(*file);
+    if (size > m_shard_capacity)
+    {
+        return;
+    }
+    s.lru.push_front(file);
+    path_key key = {file->path.data(), file->path.size()};
+    s.entries[key] = s.lru.begin();
+    s.size += size;
+    // 从LRU表尾开始淘汰，直到总大小不超过容量；键指向缓存项，先删索引再删节点
+    while (s.size > m_shard_capacity)
+    {
+        const cached_file &victim = *s.lru.back();
+        s.size -= charge(victim);
+        path_key victim_key = {victim.path.data(), victim.path.size()};
+        s.entries.erase(victim_key);
+        s.lru.pop_back();
+    }
+}
+
+void file_cache::invalidate(const std::string &path)
+{
+    path_key key = {path.data(), path.size()};
+    shard &s = shard_of(key);
+    s.lock.lock();
+    ++s.generation;
+    entry_map::iterator it = s.entries.find(key);
+    if (it != s.entries.end())
+    {
+        lru_list::iterator node = it->second;
+        s.size -= charge(**node);
+        s.entries.erase(it);
+        s.lru.erase(node);
+    }
+    s.lock.unlock();
+}
+
+void file_cache::invalidate_all()
+{
+    for (int i = 0; i < SHARDS; ++i)
+    {
+        shard &s = m_shards[i];
+        s.lock.lock();
+        ++s.generation;
+        s.entries.clear();
+        s.lru.clear();
+        s.size = 0;
+        s.lock.unlock();
+    }
+}
+
+void file_cache::watch_dir(const std::string &dir)
+{
+    int wd = inotify_add_watch(m_inotify_fd, dir.c_str(),
+                               IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE |
+                                   IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+    if (wd < 0)
+    {
+        return;
+    }
+    m_watch_dirs[wd] = dir;
+
+    // inotify不会递归，子目录需要单独监视
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+    {
+        return;
+    }
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL)
+    {
+        if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+        {
+            continue;
+        }
+        std::string sub = dir + "/" + ent->d_name;
+        struct stat st;
+        if (lstat(sub.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            watch_dir(sub);
+        }
+    }
+    closedir(d);
+}
+
+void *file_cache::watcher(void *arg)
+{
+    file_cache *cache = (file_cache *)arg;
+    cache->run_watcher();
+    return cache;
+}
+
+void file_cache::run_watcher()
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2];
+    fds[0].fd = m_inotify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_stop_pipe[0];
+    fds[1].events = POLLIN;
+    while (true)
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if (fds[1].revents)
+        {
+            break;
+        }
+        ssize_t len;
+        while ((len = read(m_inotify_fd, buf, sizeof(buf))) > 0)
+        {
+            for (char *p = buf; p < buf + len;)
+            {
+                struct inotify_event *ev = (struct inotify_event *)p;
+                p += sizeof(struct inotify_event) + ev->len;
+
+                if (ev->mask & IN_Q_OVERFLOW)
+                {
+                    // 事件丢失，无法知道哪些文件变了
+                    invalidate_all();
+                    continue;
+                }
+                std::unordered_map<int, std::string>::iterator it = m_watch_dirs.find(ev->wd);
+                if (it == m_watch_dirs.end())
+                {
+                    continue;
+                }
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                {
+                    // 整个目录被删除或移走，其中的文件全部失效
+                    if (ev->mask & IN_IGNORED)
+                    {
+                        m_watch_dirs.erase(it);
+                    }
+                    invalidate_all();
+                    continue;
+                }
+                if (ev->len == 0)
+                {
+                    continue;
+                }
+                std::string path = it->second + "/" + ev->name;
+                if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+                {
+                    // 新的子目录也需要监视
+                    watch_dir(path);
+                }
+                if (ev->mask & IN_ISDIR)
+                {
+                    // 子目录的增删、移动和权限变化会改变其下所有路径的查找结果，包括记录为不存在的路径
+                    invalidate_all();
+                    continue;
+                }
+                invalidate(path);
+            }
+        }
+    }
+}
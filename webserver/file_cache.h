@@ -0,0 +1,109 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <pthread.h>
+#include <string.h>
+#include <string>
+#include <list>
+#include <memory>
+#include <unordered_map>
+#include "locker.h"
+
+// 缓存中的一个路径：文件内容、stat信息和预先生成好的响应头；不能缓存内容的路径只记录stat的结果
+struct cached_file
+{
+    enum KIND
+    {
+        FILE_DATA = 0, // 内容、响应头都有效
+        FILE_STAT,     // 只有st有效：不是普通文件、其他用户不可读或者太大，由调用者按原来的方式处理
+        FILE_MISSING   // stat失败，路径不存在
+    };
+    KIND kind;
+    std::string path;      // 规范化后的完整路径，也是缓存的键
+    struct stat st;        // 加载时的文件状态
+    std::string data;      // 文件内容
+    std::string header[2]; // 预先生成的200响应头，[0]为Connection: close，[1]为keep-alive
+    std::string not_modified[2]; // 预先生成的304响应头，条件请求命中时使用
+    std::string etag;            // 带引号的强ETag，与响应头中的一致
+};
+
+/*
+    静态文件缓存，所有连接和线程共享
+    按路径查找，命中时不需要stat、open、mmap等任何文件系统调用；不存在的路径和不能缓存内容的文件也记录下来，
+    404和大文件不必每次都stat。缓存按路径的哈希分成SHARDS个分片，每个分片有自己的锁、LRU和容量，
+    各个事件循环查找不同的文件时不会争用同一把锁；查找用栈上的缓冲区规范化路径，不分配内存。
+    分片的总大小超过容量时按LRU淘汰，根目录下的文件发生变化时由inotify通知，后台线程将对应的缓存项删除。
+    缓存项通过shared_ptr交给连接使用，被淘汰或失效的文件在最后一个响应发送完之前不会被释放。
+*/
+class file_cache
+{
+public:
+    static const int SHARDS = 16;
+    static const size_t ENTRY_OVERHEAD = 256; // 每个缓存项在内容之外计入容量的字节数，限制不存在的路径占用的内存
+
+    // root为被监视的网站根目录，capacity为缓存的总字节数上限，max_file_size为单个可缓存文件的上限，不超过一个分片的容量
+    file_cache(const char *root, size_t capacity, size_t max_file_size);
+    ~file_cache();
+
+    // 查找路径，未命中时stat并放入缓存；返回的缓存项按kind区分，路径在根目录之外或者太长时返回空指针，由调用者自己stat
+    std::shared_ptr<const cached_file> get(const char *path);
+
+private:
+    // 不持有内存的字符串，指向缓存项中的path或者查找时栈上的缓冲区
+    struct path_key
+    {
+        const char *data;
+        size_t len;
+    };
+    struct path_hash
+    {
+        size_t operator()(const path_key &key) const { return hash(key.data, key.len); }
+    };
+    struct path_equal
+    {
+        bool operator()(const path_key &a, const path_key &b) const
+        {
+            return a.len == b.len && memcmp(a.data, b.data, a.len) == 0;
+        }
+    };
+    typedef std::list<std::shared_ptr<cached_file> > lru_list;
+    typedef std::unordered_map<path_key, lru_list::iterator, path_hash, path_equal> entry_map;
+
+    struct shard
+    {
+        locker lock;                // 保护这个分片
+        lru_list lru;               // 最近使用的在表头
+        entry_map entries;          // 路径到LRU节点的索引，键指向节点中缓存项的path
+        size_t size;                // 分片中缓存项计入容量的总字节数
+        unsigned long generation;   // 每次失效加一，用来丢弃加载期间文件已经变化的结果
+        shard() : size(0), generation(0) {}
+    };
+
+    std::shared_ptr<cached_file> load(const path_key &key); // 从磁盘读取文件，不持有锁
+    void insert(shard &s, const std::shared_ptr<cached_file> &file); // 放入缓存并按LRU淘汰，调用者持有分片的锁
+    void invalidate(const std::string &path);                   // 删除路径对应的缓存项
+    void invalidate_all();
+    void watch_dir(const std::string &dir); // 递归地为目录及其子目录添加inotify监视
+    static void *watcher(void *arg);
+    void run_watcher();
+
+    static size_t hash(const char *data, size_t len);
+    static size_t charge(const cached_file &file) { return file.data.size() + file.path.size() + ENTRY_OVERHEAD; }
+    shard &shard_of(const path_key &key) { return m_shards[hash(key.data, key.len) % SHARDS]; }
+    // 合并重复的'/'，去掉'.'和'..'，保证同一个文件只有一个键；结果写到buf，返回长度，放不下时返回-1
+    static int normalize(const char *path, char *buf, int size);
+
+private:
+    std::string m_root; // 规范化后的根目录，根目录之外的文件不缓存
+    shard m_shards[SHARDS];
+    size_t m_shard_capacity;
+    size_t m_max_file_size;
+
+    int m_inotify_fd;
+    int m_stop_pipe[2];                                // 析构时通知监视线程退出
+    std::unordered_map<int, std::string> m_watch_dirs; // inotify监视描述符到目录路径，只由监视线程和构造函数访问
+    pthread_t m_thread;
+};
+
+#endif
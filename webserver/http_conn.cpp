@@ -1,28 +1,12 @@
 #include "http_conn.h"
+#include <sys/sendfile.h>
+#include "http_response.h"
+#include "http_scan.h"
+#include <algorithm>
 
-// 定义HTTP响应的一些状态信息
-const char *ok_200_title = "OK";
-const char *error_400_title = "Bad Request";
-const char *error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
-const char *error_403_title = "Forbidden";
-const char *error_403_form = "You do not have permission to get file from this server.\n";
-const char *error_404_title = "Not Found";
-const char *error_404_form = "The requested file was not found on this server.\n";
-const char *error_500_title = "Internal Error";
-const char *error_500_form = "There was an unusual problem serving the requested file.\n";
-
-// 网站的根目录
+// 网站的根目录，main按配置覆盖
 const char *doc_root = "/home/lichunlin/webserver/resources";
-// 设置非阻塞
-int setnonblocking(int fd)
-{
-    int old_option = fcntl(fd, F_GETFL);
-    int new_option = old_option | O_NONBLOCK;
-    fcntl(fd, F_SETFL, new_option);
-    return old_option;
-}
-
-// 向epoll中添加需要监听的文件描述符
+// 向epoll中添加需要监听的文件描述符，fd在创建时(accept4、SOCK_NONBLOCK、TFD_NONBLOCK)就已经是非阻塞的
 void addfd(int epollfd, int fd, bool one_shot)
 {
     epoll_event event;
@@ -34,8 +18,6 @@ void addfd(int epollfd, int fd, bool one_shot)
         event.events |= EPOLLONESHOT;
     }
     epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-    // 设置文件描述符非阻塞
-    setnonblocking(fd);
 }
 
 // 从epoll中移除监听的文件描述符
@@ -55,39 +37,89 @@ void modfd(int epollfd, int fd, int ev)
 }
 
 // 所有的客户数
-int http_conn::m_user_count = 0;
-// 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-int http_conn::m_epollfd = -1;
+std::atomic<int> http_conn::m_user_count(0);
+// 默认使用sendfile零拷贝发送文件
+bool http_conn::m_sendfile = true;
+// 静态文件缓存，由main创建
+file_cache *http_conn::m_cache = NULL;
+admission *http_conn::m_admission = NULL;
+const char *http_conn::m_metrics_url = NULL;
+// 超时时间
+int http_conn::m_idle_timeout = 60000;
+int http_conn::m_header_timeout = 10000;
+int http_conn::m_body_timeout = 30000;
+// 请求大小的上限
+int http_conn::m_max_header_size = 32 * 1024;
+int http_conn::m_max_body_size = 1024 * 1024;
+// 缓冲区大小
+int http_conn::m_read_buffer_size = 2048;
+int http_conn::m_write_buffer_size = 1024;
+std::atomic<bool> http_conn::m_draining(false);
 
 // 关闭连接
 void http_conn::close_conn()
 {
     if (m_sockfd != -1)
     {
-        removefd(m_epollfd, m_sockfd);
+        if (m_epollfd >= 0)
+        {
+            removefd(m_epollfd, m_sockfd);
+        }
+        else
+        {
+            close(m_sockfd);
+        }
         m_sockfd = -1;
+        release_file();
         m_user_count--; // 关闭一个连接，将客户总数量-1
     }
 }
 
 // 初始化连接,外部调用初始化套接字地址
-void http_conn::init(int sockfd, const sockaddr_in &addr)
+void http_conn::init(int sockfd, const sockaddr_in &addr, int epollfd)
 {
+    m_epollfd = epollfd;
     m_sockfd = sockfd;
     m_address = addr;
-
-    // 端口复用
-    int reuse = 1;
-    setsockopt(m_sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    m_file_address = 0;
+    m_map_start = 0;
+    m_map_len = 0;
+    m_file_fd = -1;
+    m_busy.store(0, std::memory_order_relaxed);
+    m_enqueue_us = 0;
+    m_request_start_us = 0;
 
     // 添加到epoll对象中
-    addfd(m_epollfd, sockfd, true);
+    if (m_epollfd >= 0)
+    {
+        addfd(m_epollfd, sockfd, true);
+    }
     // 总用户数加一
     m_user_count++;
     init();
 }
 
 void http_conn::init()
+{
+    init_request();
+    m_start_line = 0;
+    m_checked_idx = 0;
+    m_read_idx = 0;
+    m_write_idx = 0;
+    m_bytes_to_send = 0;
+    m_file_left = 0;
+    m_iv_count = 0;
+    m_iv_start = 0;
+    m_map_count = 0;
+    m_batch_cache_count = 0;
+    m_response_count = 0;
+    m_batch_linger = false;
+    m_access_count = 0;
+    m_queue_wait_us = 0;
+}
+
+// 为解析下一个请求重置状态，读缓冲区中尚未解析的数据（流水线中的后续请求）保留
+void http_conn::init_request()
 {
     m_check_state = CHECK_STATE_REQUESTLINE; // 初始状态为检查请求行
     m_linger = false;                        // 默认不保持链接  Connection : keep-alive保持连接
@@ -96,29 +128,47 @@ void http_conn::init()
     m_url = 0;
     m_version = 0;
     m_content_length = 0;
+    m_body_left = 0;
     m_host = 0;
+    m_if_none_match = NULL;
+    m_if_none_match_len = 0;
+    m_if_modified_since = NULL;
+    m_if_modified_since_len = 0;
+    m_range = NULL;
+    m_range_len = 0;
+    m_if_range = NULL;
+    m_if_range_len = 0;
+    m_range_count = 0;
+    m_read_pinned = false; // 已解析的行属于上一个请求，块可以原地整理
+}
+
+// 把尚未解析的数据移到读缓冲区头部，为后续读取腾出空间
+// 只在两个请求之间进行，此时没有指针指向读缓冲区中已经解析过的行
+void http_conn::compact_read_buf()
+{
+    if (m_check_state != CHECK_STATE_REQUESTLINE || m_start_line == 0)
+    {
+        return;
+    }
+    memmove(m_read_buf, m_read_buf + m_start_line, m_read_idx - m_start_line);
+    m_read_idx -= m_start_line;
+    m_checked_idx -= m_start_line;
     m_start_line = 0;
-    m_checked_idx = 0;
-    m_read_idx = 0;
-    m_write_idx = 0;
-    bzero(m_read_buf, READ_BUFFER_SIZE);
-    bzero(m_write_buf, READ_BUFFER_SIZE);
-    bzero(m_real_file, FILENAME_LEN);
 }
 
 // 循环读取客户数据，直到无数据可读或者对方关闭连接
 bool http_conn::read()
 {
-    if (m_read_idx >= READ_BUFFER_SIZE) // 所读数据超过数组大小
+    if (m_read_idx >= m_read_size) // 所读数据超过当前块的大小，由attach_buffers扩展
     {
         return false;
     }
     int bytes_read = 0; // 已读取到的字节
-    while (true)
+    while (m_read_idx < m_read_size)
     {
-        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是READ_BUFFER_SIZE - m_read_idx
+        // 从m_read_buf + m_read_idx索引出开始保存数据，大小是m_read_size - m_read_idx
         bytes_read = recv(m_sockfd, m_read_buf + m_read_idx,
-                          READ_BUFFER_SIZE - m_read_idx, 0);
+                          m_read_size - m_read_idx, 0);
         if (bytes_read == -1)
         {
             if (errno == EAGAIN || errno == EWOULDBLOCK)
@@ -134,80 +184,85 @@ bool http_conn::read()
         }
         m_read_idx += bytes_read;
     }
+    // 缓冲区满时剩下的数据留在内核中，处理完缓冲区中的流水线请求后重新注册EPOLLIN会再次触发
     return true;
 }
 
 // 解析一行，判断依据\r\n
 http_conn::LINE_STATUS http_conn::parse_line()
 {
-    char temp;
-    for (; m_checked_idx < m_read_idx; ++m_checked_idx)
+    // 向量化地跳过普通字符，直接定位到下一个'\r'或'\n'
+    const char *p = find_line_end(m_read_buf + m_checked_idx, m_read_buf + m_read_idx);
+    m_checked_idx = p - m_read_buf;
+    if (m_checked_idx >= m_read_idx)
     {
-        temp = m_read_buf[m_checked_idx];
-        if (temp == '\r')
+        return LINE_OPEN;
+    }
+    if (*p == '\r')
+    {
+        if ((m_checked_idx + 1) == m_read_idx)
         {
-            if ((m_checked_idx + 1) == m_read_idx)
-            {
-                return LINE_OPEN; // 改变为从状态机
-            }
-            else if (m_read_buf[m_checked_idx + 1] == '\n')
-            {
-                m_read_buf[m_checked_idx++] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+            return LINE_OPEN; // 改变为从状态机
         }
-        else if (temp == '\n')
+        else if (m_read_buf[m_checked_idx + 1] == '\n')
         {
-            if ((m_checked_idx > 1) && (m_read_buf[m_checked_idx - 1] == '\r'))
-            {
-                m_read_buf[m_checked_idx - 1] = '\0';
-                m_read_buf[m_checked_idx++] = '\0';
-                return LINE_OK;
-            }
-            return LINE_BAD;
+            m_read_buf[m_checked_idx++] = '\0';
+            m_read_buf[m_checked_idx++] = '\0';
+            return LINE_OK;
         }
+        return LINE_BAD;
+    }
+    // 遇到'\n'
+    if ((m_checked_idx > 1) && (m_read_buf[m_checked_idx - 1] == '\r'))
+    {
+        m_read_buf[m_checked_idx - 1] = '\0';
+        m_read_buf[m_checked_idx++] = '\0';
+        return LINE_OK;
     }
-    return LINE_OPEN;
+    return LINE_BAD;
 }
 
-// 解析HTTP请求行，获得请求方法，目标URL,以及HTTP版本号
-http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
+// 解析HTTP请求行，获得请求方法，目标URL,以及HTTP版本号，len为不含\r\n的行长度
+http_conn::HTTP_CODE http_conn::parse_request_line(char *text, int len)
 {
     // GET /index.html HTTP/1.1，这是一行数据，要解析它
-    m_url = strpbrk(text, " \t"); // 判断第二个参数中的字符哪个在text中最先出现
-    if (!m_url)                   // 判断是否有值
+    char *end = text + len;
+    m_url = (char *)memchr(text, ' ', len); // 方法和URL之间的空格
+    if (!m_url)                             // 判断是否有值
     {
         return BAD_REQUEST;
     }
     // GET\0/index.html HTTP/1.1
+    int method_len = m_url - text;
     *m_url++ = '\0'; // 置位空字符，字符串结束符
-    char *method = text;
-    if (strcasecmp(method, "GET") == 0)
+    if (method_len == 3 && equal_lower(text, "get", 3))
     { // 忽略大小写比较
         m_method = GET;
     }
+    else if (method_len == 4 && equal_lower(text, "head", 4))
+    {
+        // 与GET走同一条路径，只是不发送响应体
+        m_method = HEAD;
+    }
     else
     {
         return BAD_REQUEST;
     }
     // /index.html HTTP/1.1
-    // 检索字符串 str1 中第一个不在字符串 str2 中出现的字符下标。
-    m_version = strpbrk(m_url, " \t");
+    m_version = (char *)memchr(m_url, ' ', end - m_url);
     if (!m_version)
     {
         return BAD_REQUEST;
     }
     *m_version++ = '\0';
-    if (strcasecmp(m_version, "HTTP/1.1") != 0)
+    if (end - m_version != 8 || !equal_lower(m_version, "http/1.1", 8))
     {
         return BAD_REQUEST;
     }
     /**
      * http://192.168.110.129:10000/index.html
      */
-    if (strncasecmp(m_url, "http://", 7) == 0)
+    if (m_version - m_url > 7 && equal_lower(m_url, "http://", 7))
     {
         m_url += 7;
         // 在参数 str 所指向的字符串中搜索第一次出现字符 c（一个无符号字符）的位置。
@@ -221,59 +276,112 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text)
     return NO_REQUEST;
 }
 
-// 解析HTTP请求的一个头部信息
-http_conn::HTTP_CODE http_conn::parse_headers(char *text)
+// 解析HTTP请求的一个头部信息，len为不含\r\n的行长度
+http_conn::HTTP_CODE http_conn::parse_headers(char *text, int len)
 {
     // 遇到空行，表示头部字段解析完毕
-    if (text[0] == '\0')
+    if (len == 0)
     {
         // 如果HTTP请求有消息体，则还需要读取m_content_length字节的消息体，
         // 状态机转移到CHECK_STATE_CONTENT状态
         if (m_content_length != 0) // 不等于0说明有请求体
         {
             m_check_state = CHECK_STATE_CONTENT;
+            m_body_left = m_content_length;
             return NO_REQUEST;
         }
         // 否则说明我们已经得到了一个完整的HTTP请求
         return GET_REQUEST;
     }
-    else if (strncasecmp(text, "Connection:", 11) == 0)
+
+    // 切分字段名和字段值，按字段名的编号处理，需要的值记录在对应的成员中
+    char *colon = (char *)memchr(text, ':', len);
+    if (!colon)
+    {
+        LOG_DEBUG("oop! unknow header %s", text);
+        return NO_REQUEST;
+    }
+    http_header header;
+    header.name = text;
+    header.name_len = colon - text;
+    // 字段值前后的空白(OWS)都不属于值
+    char *value = colon + 1;
+    value += strspn(value, " \t");
+    char *value_end = text + len;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+    {
+        --value_end;
+    }
+    *value_end = '\0';
+    header.value = value;
+    header.value_len = value_end - value;
+    header.id = lookup_header(text, header.name_len);
+
+    switch (header.id)
     {
+    case HEADER_CONNECTION:
         // 处理Connection 头部字段  Connection: keep-alive
-        text += 11;
-        text += strspn(text, " \t");
-        if (strcasecmp(text, "keep-alive") == 0)
+        if (header.value_len == 10 && equal_lower(value, "keep-alive", 10))
         {
             m_linger = true;
         }
-    }
-    else if (strncasecmp(text, "Content-Length:", 15) == 0)
+        break;
+    case HEADER_CONTENT_LENGTH:
     {
         // 处理Content-Length头部字段
-        text += 15;
-        text += strspn(text, " \t");
-        m_content_length = atol(text);
+        long length = atol(value);
+        if (length < 0)
+        {
+            return BAD_REQUEST;
+        }
+        if (length > m_max_body_size)
+        {
+            return PAYLOAD_TOO_LARGE;
+        }
+        m_content_length = length;
+        break;
     }
-    else if (strncasecmp(text, "Host:", 5) == 0)
-    {
+    case HEADER_HOST:
         // 处理Host头部字段
-        text += 5;
-        text += strspn(text, " \t");
-        m_host = text;
-    }
-    else
-    {
-        printf("oop! unknow header %s\n", text);
+        m_host = value;
+        break;
+    case HEADER_IF_NONE_MATCH:
+        m_if_none_match = value;
+        m_if_none_match_len = header.value_len;
+        break;
+    case HEADER_IF_MODIFIED_SINCE:
+        m_if_modified_since = value;
+        m_if_modified_since_len = header.value_len;
+        break;
+    case HEADER_RANGE:
+        m_range = value;
+        m_range_len = header.value_len;
+        break;
+    case HEADER_IF_RANGE:
+        m_if_range = value;
+        m_if_range_len = header.value_len;
+        break;
+    default:
+        LOG_DEBUG("oop! unknow header %s", text);
+        break;
     }
     return NO_REQUEST;
 }
 
 // 我们没有真正解析HTTP请求的消息体，只是判断它是否被完整的读入了
-http_conn::HTTP_CODE http_conn::parse_content(char *text)
+// 请求体边读边跳过，不需要整个放在缓冲区中；读完后流水线中的下一个请求从请求体之后开始
+http_conn::HTTP_CODE http_conn::parse_content()
 {
-    if (m_read_idx >= (m_content_length + m_checked_idx))
+    int n = m_read_idx - m_checked_idx;
+    if (n > m_body_left)
+    {
+        n = m_body_left;
+    }
+    m_checked_idx += n;
+    m_start_line = m_checked_idx;
+    m_body_left -= n;
+    if (m_body_left == 0)
     {
-        text[m_content_length] = '\0';
         return GET_REQUEST;
     }
     return NO_REQUEST;
@@ -290,14 +398,19 @@ http_conn::HTTP_CODE http_conn::process_read()
         // 解析到了一行完整的数据
         //  获取一行数据
         text = get_line();
+        int len = m_checked_idx - m_start_line - 2; // 去掉行尾的\r\n
         m_start_line = m_checked_idx;
-        printf("got 1 http line: %s\n", text);
+        if (m_check_state != CHECK_STATE_CONTENT)
+        {
+            m_read_pinned = true; // 这一行会被当前请求引用，所在的块要保留到请求处理完
+            LOG_DEBUG("got 1 http line: %s", text);
+        }
 
         switch (m_check_state)
         {
         case CHECK_STATE_REQUESTLINE: // 解析请求行
         {
-            ret = parse_request_line(text);
+            ret = parse_request_line(text, len);
             if (ret == BAD_REQUEST)
             {
                 return BAD_REQUEST;
@@ -306,10 +419,10 @@ http_conn::HTTP_CODE http_conn::process_read()
         }
         case CHECK_STATE_HEADER: // 解析请求头
         {
-            ret = parse_headers(text);
-            if (ret == BAD_REQUEST)
+            ret = parse_headers(text, len);
+            if (ret == BAD_REQUEST || ret == PAYLOAD_TOO_LARGE)
             {
-                return BAD_REQUEST;
+                return ret;
             }
             else if (ret == GET_REQUEST)
             {
@@ -319,7 +432,7 @@ http_conn::HTTP_CODE http_conn::process_read()
         }
         case CHECK_STATE_CONTENT: // 解析请求体
         {
-            ret = parse_content(text);
+            ret = parse_content();
             if (ret == GET_REQUEST)
             {
                 return do_request();
@@ -333,6 +446,11 @@ http_conn::HTTP_CODE http_conn::process_read()
         }
         }
     }
+    if (line_status == LINE_BAD)
+    {
+        // 行尾不是\r\n(如只有\n)，回复400并关闭连接，而不是等到头部超时
+        return BAD_REQUEST;
+    }
     return NO_REQUEST;
 }
 
@@ -341,12 +459,43 @@ http_conn::HTTP_CODE http_conn::process_read()
 // 映射到内存地址m_file_address处，并告诉调用者获取文件成功
 http_conn::HTTP_CODE http_conn::do_request()
 {
+    if (m_metrics_url && strcmp(m_url, m_metrics_url) == 0)
+    {
+        return METRICS_REQUEST;
+    }
     // "/home/nowcoder/webserver/resources"
     strcpy(m_real_file, doc_root);
     int len = strlen(doc_root);
     strncpy(m_real_file + len, m_url, FILENAME_LEN - len - 1);
+    bool have_stat = false;
+    if (m_cache)
+    {
+        // 命中缓存时不需要任何文件系统调用，响应头和文件内容都已经在内存中
+        m_cache_entry = m_cache->get(m_real_file);
+        if (m_cache_entry && m_cache_entry->kind == cached_file::FILE_MISSING)
+        {
+            m_cache_entry.reset();
+            return NO_RESOURCE;
+        }
+        if (m_cache_entry && m_cache_entry->kind == cached_file::FILE_DATA)
+        {
+            m_file_stat = m_cache_entry->st;
+            if (not_modified(m_cache_entry->etag.data(), m_cache_entry->etag.size()))
+            {
+                return NOT_MODIFIED;
+            }
+            return parse_range(m_cache_entry->etag.data(), m_cache_entry->etag.size());
+        }
+        if (m_cache_entry)
+        {
+            // 内容没有缓存(大文件、目录或者没有读权限)，但是stat的结果可以直接使用
+            m_file_stat = m_cache_entry->st;
+            m_cache_entry.reset();
+            have_stat = true;
+        }
+    }
     // 获取m_real_file文件的相关的状态信息，-1失败，0成功
-    if (stat(m_real_file, &m_file_stat) < 0)
+    if (!have_stat && stat(m_real_file, &m_file_stat) < 0)
     {
         return NO_RESOURCE;
     }
@@ -363,72 +512,616 @@ http_conn::HTTP_CODE http_conn::do_request()
         return BAD_REQUEST;
     }
 
+    // 客户端的副本仍然有效，或者只需要响应头时，不需要打开文件
+    char etag[ETAG_MAX];
+    int etag_len = build_etag(etag, m_file_stat);
+    if (not_modified(etag, etag_len))
+    {
+        return NOT_MODIFIED;
+    }
+    if (parse_range(etag, etag_len) == RANGE_NOT_SATISFIABLE)
+    {
+        return RANGE_NOT_SATISFIABLE;
+    }
+    if (m_method == HEAD)
+    {
+        return FILE_REQUEST;
+    }
+
     // 以只读方式打开文件
-    int fd = open(m_real_file, O_RDONLY);
-    // 创建内存映射
-    m_file_address = (char *)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int fd = open(m_real_file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return NO_RESOURCE;
+    }
+    if (m_sendfile && m_range_count <= 1)
+    {
+        // 零拷贝模式：保留文件描述符，由write()通过sendfile直接从页缓存发送，单个区间从它的偏移处开始发送
+        m_file_fd = fd;
+        return FILE_REQUEST;
+    }
+    // 创建内存映射，空文件不需要映射；Range请求只映射从第一个区间所在的页到最后一个区间的结尾，多个区间时sendfile模式也使用映射
+    m_map_start = 0;
+    m_map_len = m_file_stat.st_size;
+    if (m_range_count > 0)
+    {
+        off_t first = m_ranges[0].first;
+        off_t last = m_ranges[0].last;
+        for (int i = 1; i < m_range_count; ++i)
+        {
+            first = std::min(first, m_ranges[i].first);
+            last = std::max(last, m_ranges[i].last);
+        }
+        m_map_start = first & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+        m_map_len = last + 1 - m_map_start;
+    }
+    if (m_map_len > 0)
+    {
+        m_file_address = (char *)mmap(0, m_map_len, PROT_READ, MAP_PRIVATE, fd, m_map_start);
+        if (m_file_address == MAP_FAILED)
+        {
+            m_file_address = 0;
+            close(fd);
+            return INTERNAL_ERROR;
+        }
+    }
     close(fd);
     return FILE_REQUEST;
 }
 
-// 对内存映射区执行munmap操作
+// If-None-Match存在时只比较ETag(弱比较，忽略W/前缀)，否则比较If-Modified-Since与文件的修改时间(秒)
+bool http_conn::not_modified(const char *etag, int etag_len) const
+{
+    if (m_if_none_match)
+    {
+        const char *p = m_if_none_match;
+        const char *end = p + m_if_none_match_len;
+        while (p < end)
+        {
+            // 逗号分隔的列表，每一项前后可能有空白
+            while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            {
+                ++p;
+            }
+            const char *item = p;
+            while (p < end && *p != ',')
+            {
+                ++p;
+            }
+            const char *item_end = p;
+            while (item_end > item && (item_end[-1] == ' ' || item_end[-1] == '\t'))
+            {
+                --item_end;
+            }
+            if (item_end - item == 1 && *item == '*')
+            {
+                return true;
+            }
+            if (item_end - item > 2 && item[0] == 'W' && item[1] == '/')
+            {
+                item += 2;
+            }
+            if (item_end - item == etag_len && memcmp(item, etag, etag_len) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+    if (m_if_modified_since)
+    {
+        time_t since = parse_http_date(m_if_modified_since, m_if_modified_since_len);
+        return since != -1 && m_file_stat.st_mtime <= since;
+    }
+    return false;
+}
+
+// 读取一个十进制数，太大时截断为一个不小于任何文件大小的值，没有数字时返回false
+static bool parse_range_number(const char *&p, const char *end, off_t &value)
+{
+    const char *start = p;
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9')
+    {
+        if (value < ((off_t)1 << 60))
+        {
+            value = value * 10 + (*p - '0');
+        }
+        ++p;
+    }
+    return p != start;
+}
+
+// Range: bytes=0-499, 1000-, -200
+// 语法错误、单位不是bytes、区间太多或者If-Range不匹配时忽略Range，回复整个文件；语法正确但没有一个区间能满足时回复416
+http_conn::HTTP_CODE http_conn::parse_range(const char *etag, int etag_len)
+{
+    m_range_count = 0;
+    if (!m_range || m_method != GET)
+    {
+        return FILE_REQUEST;
+    }
+    if (m_if_range)
+    {
+        // If-Range中的ETag使用强比较，弱ETag永远不匹配；日期必须与文件的修改时间完全相同
+        bool match;
+        if (m_if_range[0] == '"')
+        {
+            match = m_if_range_len == etag_len && memcmp(m_if_range, etag, etag_len) == 0;
+        }
+        else if (m_if_range_len >= 2 && m_if_range[0] == 'W' && m_if_range[1] == '/')
+        {
+            match = false;
+        }
+        else
+        {
+            match = parse_http_date(m_if_range, m_if_range_len) == m_file_stat.st_mtime;
+        }
+        if (!match)
+        {
+            return FILE_REQUEST;
+        }
+    }
+    if (m_range_len < 6 || !equal_lower(m_range, "bytes=", 6))
+    {
+        return FILE_REQUEST;
+    }
+    const char *p = m_range + 6;
+    const char *end = m_range + m_range_len;
+    off_t size = m_file_stat.st_size;
+    int specs = 0;
+    int count = 0;
+    while (p < end)
+    {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        {
+            ++p;
+        }
+        if (p == end)
+        {
+            break;
+        }
+        off_t first, last;
+        bool satisfiable;
+        if (*p == '-')
+        {
+            // 最后n个字节
+            ++p;
+            off_t n;
+            if (!parse_range_number(p, end, n))
+            {
+                return FILE_REQUEST;
+            }
+            satisfiable = n > 0 && size > 0;
+            first = n < size ? size - n : 0;
+            last = size - 1;
+        }
+        else
+        {
+            if (!parse_range_number(p, end, first) || p == end || *p++ != '-')
+            {
+                return FILE_REQUEST;
+            }
+            if (parse_range_number(p, end, last))
+            {
+                if (last < first)
+                {
+                    return FILE_REQUEST;
+                }
+                last = std::min(last, size - 1);
+            }
+            else
+            {
+                last = size - 1;
+            }
+            satisfiable = first < size;
+        }
+        while (p < end && (*p == ' ' || *p == '\t'))
+        {
+            ++p;
+        }
+        if (p < end && *p != ',')
+        {
+            return FILE_REQUEST;
+        }
+        ++specs;
+        if (!satisfiable)
+        {
+            continue;
+        }
+        if (count == MAX_RANGES)
+        {
+            // 区间太多，可能是用大量重叠的小区间放大响应，直接回复整个文件
+            return FILE_REQUEST;
+        }
+        m_ranges[count].first = first;
+        m_ranges[count].last = last;
+        ++count;
+    }
+    if (specs == 0)
+    {
+        return FILE_REQUEST;
+    }
+    if (count == 0)
+    {
+        return RANGE_NOT_SATISFIABLE;
+    }
+    m_range_count = count;
+    return FILE_REQUEST;
+}
+
+// 对内存映射区执行munmap操作，包括已经加入本批响应的映射
 void http_conn::unmap()
 {
     if (m_file_address)
     {
-        munmap(m_file_address, m_file_stat.st_size);
+        munmap(m_file_address, m_map_len);
         m_file_address = 0;
     }
+    for (int i = 0; i < m_map_count; ++i)
+    {
+        munmap(m_maps[i].iov_base, m_maps[i].iov_len);
+    }
+    m_map_count = 0;
+}
+
+// 关闭sendfile模式下打开的目标文件
+void http_conn::close_file()
+{
+    if (m_file_fd != -1)
+    {
+        close(m_file_fd);
+        m_file_fd = -1;
+    }
+}
+
+void http_conn::release_file()
+{
+    unmap();
+    close_file();
+    m_cache_entry.reset();
+    for (int i = 0; i < m_batch_cache_count; ++i)
+    {
+        m_batch_cache[i].reset();
+    }
+    m_batch_cache_count = 0;
+}
+
+// 已经发送了n字节，跳过m_iv中已发送的部分
+void http_conn::consume_iov(int n)
+{
+    while (m_iv_start < m_iv_count && n > 0)
+    {
+        struct iovec &iv = m_iv[m_iv_start];
+        if ((size_t)n >= iv.iov_len)
+        {
+            n -= iv.iov_len;
+            ++m_iv_start;
+        }
+        else
+        {
+            iv.iov_base = (char *)iv.iov_base + n;
+            iv.iov_len -= n;
+            n = 0;
+        }
+    }
+}
+
+// 把一块内存加入本批响应的分散写列表
+void http_conn::add_iov(const void *base, size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    // 与上一块在内存中相邻时合并（连续几个响应头都在m_write_buf中）
+    if (m_iv_count > 0 && (char *)m_iv[m_iv_count - 1].iov_base + m_iv[m_iv_count - 1].iov_len == base)
+    {
+        m_iv[m_iv_count - 1].iov_len += len;
+    }
+    else
+    {
+        m_iv[m_iv_count].iov_base = (void *)base;
+        m_iv[m_iv_count].iov_len = len;
+        ++m_iv_count;
+    }
+    m_bytes_to_send += len;
+}
+
+// 读缓冲区中是否还有已经收到、但没有处理的数据
+bool http_conn::has_pending_request() const
+{
+    return m_bytes_to_send == 0 && m_checked_idx < m_read_idx;
+}
+
+bool http_conn::attach_buffers(buffer_pool *pool)
+{
+    if (!m_write_buf)
+    {
+        m_write_buf = pool->alloc(m_write_buffer_size);
+        if (!m_write_buf)
+        {
+            return false;
+        }
+    }
+    if (!m_read_buf)
+    {
+        m_read_buf = pool->alloc(m_read_buffer_size);
+        m_read_size = m_read_buffer_size;
+        return m_read_buf != NULL;
+    }
+    if (m_check_state == CHECK_STATE_REQUESTLINE)
+    {
+        // 上一个请求已经处理完，链上的块不再被引用
+        release_read_chain(pool);
+    }
+    if (m_read_idx < m_read_size)
+    {
+        return true;
+    }
+    return grow_read_buf(pool);
+}
+
+bool http_conn::grow_read_buf(buffer_pool *pool)
+{
+    int carry = m_read_idx - m_start_line; // 还没有解析完的数据，只有它需要搬动
+    bool pinned = m_read_pinned && m_check_state != CHECK_STATE_REQUESTLINE;
+    if (!pinned && m_start_line > 0)
+    {
+        // 块中没有需要保留的行，原地整理即可
+        memmove(m_read_buf, m_read_buf + m_start_line, carry);
+        m_read_idx = carry;
+        m_checked_idx -= m_start_line;
+        m_start_line = 0;
+        return true;
+    }
+
+    // 一行占满了整个块时换用更大的块
+    int size = m_read_buffer_size;
+    while (size < 2 * carry && size < (int)buffer_pool::MAX_BLOCK)
+    {
+        size <<= 1;
+    }
+    if (carry >= size)
+    {
+        return false; // 一行超过了最大的块
+    }
+    if (m_read_chain_bytes + (pinned ? m_read_size : 0) + size > m_max_header_size)
+    {
+        return false; // 请求行和头部太大
+    }
+    if (pinned && m_read_chain_count == MAX_READ_CHAIN)
+    {
+        return false;
+    }
+    char *buf = pool->alloc(size);
+    if (!buf)
+    {
+        return false;
+    }
+    memcpy(buf, m_read_buf + m_start_line, carry);
+    if (pinned)
+    {
+        // 旧块中已解析的行还在被引用，挂到链上，等请求处理完再归还
+        m_read_chain[m_read_chain_count].iov_base = m_read_buf;
+        m_read_chain[m_read_chain_count].iov_len = m_read_size;
+        ++m_read_chain_count;
+        m_read_chain_bytes += m_read_size;
+    }
+    else
+    {
+        pool->release(m_read_buf, m_read_size);
+    }
+    m_read_buf = buf;
+    m_read_size = size;
+    m_read_idx = carry;
+    m_checked_idx -= m_start_line;
+    m_start_line = 0;
+    m_read_pinned = false;
+    return true;
+}
+
+void http_conn::release_read_chain(buffer_pool *pool)
+{
+    for (int i = 0; i < m_read_chain_count; ++i)
+    {
+        pool->release((char *)m_read_chain[i].iov_base, m_read_chain[i].iov_len);
+    }
+    m_read_chain_count = 0;
+    m_read_chain_bytes = 0;
+}
+
+void http_conn::release_buffers(buffer_pool *pool)
+{
+    // 空闲时缓冲区中没有任何有用的数据，下次取得的缓冲区不需要清零
+    release_read_chain(pool);
+    pool->release(m_read_buf, m_read_size);
+    pool->release(m_write_buf, m_write_buffer_size);
+    m_read_buf = NULL;
+    m_write_buf = NULL;
+    m_read_idx = m_checked_idx = m_start_line = 0;
+    m_write_idx = 0;
+}
+
+bool http_conn::idle() const
+{
+    return m_check_state == CHECK_STATE_REQUESTLINE && m_start_line == m_read_idx && m_bytes_to_send == 0;
 }
 
-// 写HTTP响应
+void http_conn::touch(unsigned long now, bool start)
+{
+    m_last_active = now;
+    if (start)
+    {
+        m_request_start = now;
+        m_request_start_us = monotonic_us();
+    }
+}
+
+long http_conn::timeout_left(unsigned long now) const
+{
+    unsigned long deadline;
+    if (m_bytes_to_send > 0)
+    {
+        // 对方迟迟不接收响应
+        deadline = m_last_active + m_idle_timeout;
+    }
+    else if (m_check_state == CHECK_STATE_CONTENT)
+    {
+        deadline = m_last_active + m_body_timeout;
+    }
+    else if (idle())
+    {
+        deadline = m_last_active + m_idle_timeout;
+    }
+    else
+    {
+        // 请求行和头部的超时从请求开始计算，不因为每次收到少量数据而延长，防止慢速发送头部的连接一直占用资源
+        deadline = m_request_start + m_header_timeout;
+    }
+    return (long)(deadline - now);
+}
+
+void http_conn::rearm(int ev)
+{
+    if (m_epollfd >= 0)
+    {
+        modfd(m_epollfd, m_sockfd, ev);
+    }
+}
+
+int http_conn::feed(const char *data, int len)
+{
+    int n = m_read_size - m_read_idx;
+    if (n > len)
+    {
+        n = len;
+    }
+    memcpy(m_read_buf + m_read_idx, data, n);
+    m_read_idx += n;
+    return n;
+}
+
+int http_conn::pending_iov(struct iovec **iov)
+{
+    if (m_bytes_to_send - m_file_left <= 0)
+    {
+        return 0;
+    }
+    *iov = m_iv + m_iv_start;
+    return m_iv_count - m_iv_start;
+}
+
+off_t http_conn::pending_file(int *fd, off_t *offset) const
+{
+    *fd = m_file_fd;
+    *offset = m_file_offset;
+    return m_file_left;
+}
+
+bool http_conn::sent(int n)
+{
+    if (m_bytes_to_send - m_file_left > 0)
+    {
+        // 文件之前的内存部分（所有响应头、缓存或mmap的文件内容）
+        consume_iov(n);
+    }
+    else
+    {
+        m_file_offset += n;
+        m_file_left -= n;
+    }
+    m_bytes_to_send -= n;
+    local_metrics()->bytes_sent.add(n);
+    return m_bytes_to_send <= 0;
+}
+
+bool http_conn::finish_batch()
+{
+    unsigned long ttlb = 0;
+    if (m_request_start_us)
+    {
+        ttlb = monotonic_us() - m_request_start_us;
+        local_metrics()->ttlb.record(ttlb);
+    }
+    if (m_access_count > 0)
+    {
+        write_access_log(ttlb);
+    }
+    m_dynamic.clear();
+    release_file();
+    m_bytes_to_send = 0;
+    m_iv_count = 0;
+    m_iv_start = 0;
+    m_write_idx = 0;
+    m_response_count = 0;
+    return m_batch_linger;
+}
+
+// 写HTTP响应，一次把本批所有流水线请求的响应发送出去
 bool http_conn::write()
 {
-    int temp = 0;
-    int bytes_have_send = 0;         // 已经发送的字节
-    int bytes_to_send = m_write_idx; // 将要发送的字节 （m_write_idx）写缓冲区中待发送的字节数
+    ssize_t temp = 0;
 
-    if (bytes_to_send == 0)
+    if (m_bytes_to_send == 0)
     {
         // 将要发送的字节为0，这一次响应结束。
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
-        init();
+        rearm(EPOLLIN);
         return true;
     }
 
     while (1)
     {
-        // 分散写
-        temp = writev(m_sockfd, m_iv, m_iv_count);
+        struct iovec *iov;
+        int iov_count = pending_iov(&iov);
+        if (iov_count > 0)
+        {
+            // 分散写，后面还要sendfile时带上MSG_MORE，让内核把响应头和文件内容合并成满的TCP报文段
+            struct msghdr msg;
+            bzero(&msg, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iov_count;
+            temp = sendmsg(m_sockfd, &msg, m_file_left > 0 ? MSG_MORE : 0);
+        }
+        else
+        {
+            // 零拷贝发送文件内容，偏移由sent()推进
+            off_t offset = m_file_offset;
+            temp = sendfile(m_sockfd, m_file_fd, &offset, m_file_left);
+        }
         if (temp <= -1)
         {
             // 如果TCP写缓冲没有空间，则等待下一轮EPOLLOUT事件，虽然在此期间，
             // 服务器无法立即接收到同一客户的下一个请求，但可以保证连接的完整性。
             if (errno == EAGAIN)
             {
-                modfd(m_epollfd, m_sockfd, EPOLLOUT);
+                rearm(EPOLLOUT);
                 return true;
             }
-            unmap();
+            release_file();
+            return false;
+        }
+        if (temp == 0 && iov_count == 0)
+        {
+            // 文件在发送过程中被截断，无法再发出承诺的长度
+            release_file();
             return false;
         }
-        bytes_to_send -= temp;
-        bytes_have_send += temp;
-        if (bytes_to_send <= bytes_have_send)
+        if (sent(temp))
         {
-            // 发送HTTP响应成功，根据HTTP请求中的Connection字段决定是否立即关闭连接
-            unmap();
-            if (m_linger)
+            // 发送HTTP响应成功，根据最后一个请求的Connection字段决定是否立即关闭连接
+            if (!finish_batch())
             {
-                init();
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
-                return true;
+                rearm(EPOLLIN);
+                return false;
             }
-            else
+            // 读缓冲区中还有后续请求时不重新注册EPOLLIN，由调用者根据has_pending_request()继续处理，
+            // 否则数据已经在缓冲区中，EPOLLIN不会再触发
+            if (!has_pending_request())
             {
-                modfd(m_epollfd, m_sockfd, EPOLLIN);
-                return false;
+                rearm(EPOLLIN);
             }
+            return true;
         }
     }
 }
@@ -436,14 +1129,14 @@ bool http_conn::write()
 // 往写缓冲中写入待发送的数据
 bool http_conn::add_response(const char *format, ...)
 {
-    if (m_write_idx >= WRITE_BUFFER_SIZE)
+    if (m_write_idx >= m_write_buffer_size)
     {
         return false;
     }
     va_list arg_list;
     va_start(arg_list, format);
-    int len = vsnprintf(m_write_buf + m_write_idx, WRITE_BUFFER_SIZE - 1 - m_write_idx, format, arg_list);
-    if (len >= (WRITE_BUFFER_SIZE - 1 - m_write_idx))
+    int len = vsnprintf(m_write_buf + m_write_idx, m_write_buffer_size - 1 - m_write_idx, format, arg_list);
+    if (len >= (m_write_buffer_size - 1 - m_write_idx))
     {
         return false;
     }
@@ -452,116 +1145,332 @@ bool http_conn::add_response(const char *format, ...)
     return true;
 }
 
-bool http_conn::add_status_line(int status, const char *title)
-{
-    return add_response("%s %d %s\r\n", "HTTP/1.1", status, title);
-}
-
-bool http_conn::add_headers(int content_len)
-{
-    add_content_length(content_len);
-    add_content_type();
-    add_linger();
-    add_blank_line();
-}
-
-bool http_conn::add_content_length(int content_len)
-{
-    return add_response("Content-Length: %d\r\n", content_len);
-}
-
-bool http_conn::add_linger() // 追加头
-{
-    return add_response("Connection: %s\r\n", (m_linger == true) ? "keep-alive" : "close");
-}
-
-bool http_conn::add_blank_line()
-{
-    return add_response("%s", "\r\n");
-}
-
 bool http_conn::add_content(const char *content)
 {
     return add_response("%s", content);
 }
 
-bool http_conn::add_content_type()
-{
-    return add_response("Content-Type:%s\r\n", "text/html");
-}
-
-// 根据服务器处理HTTP请求的结果，决定返回给客户端的内容
+// 根据服务器处理HTTP请求的结果，决定返回给客户端的内容，响应追加到本批的分散写列表中
 bool http_conn::process_write(HTTP_CODE ret)
 {
+    if (m_draining.load(std::memory_order_relaxed))
+    {
+        // 让客户端把后面的请求发到新的连接上(热升级时就是新进程)
+        m_linger = false;
+    }
+    int status;
     switch (ret)
     {
     case INTERNAL_ERROR:
-        add_status_line(500, error_500_title);
-        add_headers(strlen(error_500_form));
-        if (!add_content(error_500_form))
-        {
-            return false;
-        }
+        status = 500;
         break;
     case BAD_REQUEST:
-        add_status_line(400, error_400_title);
-        add_headers(strlen(error_400_form));
-        if (!add_content(error_400_form))
-        {
-            return false;
-        }
+        // 请求语法错误后无法确定下一个请求从哪里开始，发送完响应后关闭连接
+        m_linger = false;
+        status = 400;
+        local_metrics()->parse_errors.add();
+        break;
+    case PAYLOAD_TOO_LARGE:
+        // 请求体没有被读取，同样无法继续处理后面的请求
+        m_linger = false;
+        status = 413;
+        break;
+    case SERVICE_UNAVAILABLE:
+        // 请求没有解析，关闭连接，客户端按Retry-After稍后重试
+        m_linger = false;
+        status = 503;
         break;
     case NO_RESOURCE:
-        add_status_line(404, error_404_title);
-        add_headers(strlen(error_404_form));
-        if (!add_content(error_404_form))
-        {
-            return false;
-        }
+        status = 404;
         break;
     case FORBIDDEN_REQUEST:
-        add_status_line(403, error_403_title);
-        add_headers(strlen(error_403_form));
-        if (!add_content(error_403_form))
+        status = 403;
+        break;
+    case METRICS_REQUEST:
+    {
+        // 响应体在m_dynamic中，直到本批发送完毕
+        render_metrics(m_dynamic);
+        int header_len = build_text_header(m_write_buf + m_write_idx, m_dynamic.size(), "text/plain; version=0.0.4", m_linger);
+        add_iov(m_write_buf + m_write_idx, header_len);
+        m_write_idx += header_len;
+        if (m_method != HEAD)
         {
-            return false;
+            add_iov(m_dynamic.data(), m_dynamic.size());
         }
-        break;
+        local_metrics()->responses[thread_metrics::S_200].add();
+        m_status = 200;
+        return true;
+    }
     case FILE_REQUEST:
-        add_status_line(200, ok_200_title);
-        add_headers(m_file_stat.st_size);
-        m_iv[0].iov_base = m_write_buf;
-        m_iv[0].iov_len = m_write_idx;
-        m_iv[1].iov_base = m_file_address;
-        m_iv[1].iov_len = m_file_stat.st_size;
-        m_iv_count = 2;
+    {
+        m_status = m_range_count > 0 ? 206 : 200;
+        local_metrics()->responses[thread_metrics::status_index(m_status)].add();
+        if (m_range_count > 1)
+        {
+            add_multipart();
+            return true;
+        }
+        // 单个区间只发送[first, first + length)，其余与整个文件的响应相同
+        off_t first = 0;
+        off_t length = m_file_stat.st_size;
+        if (m_range_count == 1)
+        {
+            first = m_ranges[0].first;
+            length = m_ranges[0].last - first + 1;
+        }
+        if (m_cache_entry)
+        {
+            // 缓存的文件：200响应头是预先生成好的，不需要格式化
+            if (m_range_count == 1)
+            {
+                int header_len = build_range_header(m_write_buf + m_write_idx, m_file_stat, first, m_ranges[0].last, m_linger);
+                add_iov(m_write_buf + m_write_idx, header_len);
+                m_write_idx += header_len;
+            }
+            else
+            {
+                const std::string &header = m_cache_entry->header[m_linger ? 1 : 0];
+                add_iov(header.data(), header.size());
+            }
+            if (m_method != HEAD)
+            {
+                add_iov(m_cache_entry->data.data() + first, length);
+            }
+            // 持有缓存项直到本批响应发送完毕
+            m_batch_cache[m_batch_cache_count++] = m_cache_entry;
+            m_cache_entry.reset();
+            return true;
+        }
+        // 只有Content-Length和验证字段是变化的，用整数转字符串拼接响应头；HEAD请求没有打开文件，只发送响应头
+        int header_len;
+        if (m_range_count == 1)
+        {
+            header_len = build_range_header(m_write_buf + m_write_idx, m_file_stat, first, m_ranges[0].last, m_linger);
+        }
+        else
+        {
+            header_len = build_file_header(m_write_buf + m_write_idx, m_file_stat, m_linger);
+        }
+        add_iov(m_write_buf + m_write_idx, header_len);
+        m_write_idx += header_len;
+        if (m_file_fd != -1)
+        {
+            // sendfile模式：文件内容由write()从文件偏移处直接发送，它必须是本批的最后一个响应
+            m_file_offset = first;
+            m_file_left = length;
+            m_bytes_to_send += m_file_left;
+            return true;
+        }
+        if (m_file_address)
+        {
+            add_iov(m_file_address + (first - m_map_start), length);
+            m_maps[m_map_count].iov_base = m_file_address;
+            m_maps[m_map_count].iov_len = m_map_len;
+            ++m_map_count;
+            m_file_address = 0;
+        }
+        return true;
+    }
+    case RANGE_NOT_SATISFIABLE:
+    {
+        local_metrics()->responses[thread_metrics::S_416].add();
+        m_status = 416;
+        m_cache_entry.reset();
+        int header_len = build_range_error_header(m_write_buf + m_write_idx, m_file_stat.st_size, m_linger);
+        add_iov(m_write_buf + m_write_idx, header_len);
+        m_write_idx += header_len;
+        return true;
+    }
+    case NOT_MODIFIED:
+    {
+        local_metrics()->responses[thread_metrics::S_304].add();
+        m_status = 304;
+        if (m_cache_entry)
+        {
+            const std::string &header = m_cache_entry->not_modified[m_linger ? 1 : 0];
+            add_iov(header.data(), header.size());
+            m_batch_cache[m_batch_cache_count++] = m_cache_entry;
+            m_cache_entry.reset();
+            return true;
+        }
+        int header_len = build_not_modified_header(m_write_buf + m_write_idx, m_file_stat, m_linger);
+        add_iov(m_write_buf + m_write_idx, header_len);
+        m_write_idx += header_len;
         return true;
+    }
     default:
         return false;
     }
 
-    m_iv[0].iov_base = m_write_buf;
-    m_iv[0].iov_len = m_write_idx;
-    m_iv_count = 1;
+    local_metrics()->responses[thread_metrics::status_index(status)].add();
+    m_status = status;
+    // 错误响应是固定的，直接引用预先生成好的状态行、响应头和响应体
+    const std::string *response = fixed_response(status, m_linger);
+    size_t len = response->size();
+    if (m_method == HEAD)
+    {
+        // HEAD请求的错误响应也不带响应体，Content-Length仍然是GET时的长度
+        len = response->find("\r\n\r\n") + 4;
+    }
+    add_iov(response->data(), len);
     return true;
 }
 
+// 各区间之前的分隔行和头部依次生成在m_dynamic中，区间的内容直接引用缓存或者映射的文件，不拷贝
+void http_conn::add_multipart()
+{
+    unsigned long size = m_file_stat.st_size;
+    size_t parts[MAX_RANGES + 1]; // 每个区间的头部在m_dynamic中的起始位置，最后一个是结尾的分隔行
+    unsigned long content_length = 0;
+    for (int i = 0; i < m_range_count; ++i)
+    {
+        parts[i] = m_dynamic.size();
+        append_multipart_part(m_dynamic, m_ranges[i].first, m_ranges[i].last, size);
+        content_length += m_ranges[i].last - m_ranges[i].first + 1;
+    }
+    parts[m_range_count] = m_dynamic.size();
+    append_multipart_end(m_dynamic);
+    content_length += m_dynamic.size();
+
+    int header_len = build_multipart_header(m_write_buf + m_write_idx, m_file_stat, content_length, m_linger);
+    add_iov(m_write_buf + m_write_idx, header_len);
+    m_write_idx += header_len;
+    // m_dynamic已经生成完，之后不再修改，可以引用其中的内容
+    for (int i = 0; i < m_range_count; ++i)
+    {
+        add_iov(m_dynamic.data() + parts[i], parts[i + 1] - parts[i]);
+        const char *data;
+        if (m_cache_entry)
+        {
+            data = m_cache_entry->data.data() + m_ranges[i].first;
+        }
+        else
+        {
+            data = m_file_address + (m_ranges[i].first - m_map_start);
+        }
+        add_iov(data, m_ranges[i].last - m_ranges[i].first + 1);
+    }
+    add_iov(m_dynamic.data() + parts[m_range_count], m_dynamic.size() - parts[m_range_count]);
+
+    if (m_cache_entry)
+    {
+        m_batch_cache[m_batch_cache_count++] = m_cache_entry;
+        m_cache_entry.reset();
+    }
+    else if (m_file_address)
+    {
+        m_maps[m_map_count].iov_base = m_file_address;
+        m_maps[m_map_count].iov_len = m_map_len;
+        ++m_map_count;
+        m_file_address = 0;
+    }
+}
+
 // 由线程池中的工作线程调用，这是处理HTTP请求的入口函数
-void http_conn::process()
+// 读缓冲区中可能有多个流水线请求，依次解析并把响应合并成一批，由write()一次writev发出，响应顺序与请求顺序一致
+bool http_conn::process()
 {
-    // 解析HTTP请求
-    HTTP_CODE read_ret = process_read();
-    if (read_ret == NO_REQUEST) // 请求不完整
+    // 从线程池队列中取出的请求先做准入检查，排队太久说明已经过载，直接回复503，不再解析
+    unsigned long enqueue_us = m_enqueue_us;
+    m_enqueue_us = 0;
+    unsigned long start = monotonic_us();
+    if (enqueue_us)
+    {
+        m_queue_wait_us = start - enqueue_us;
+        local_metrics()->queue_wait.record(m_queue_wait_us);
+    }
+    if (enqueue_us && m_admission && !m_admission->admit(enqueue_us, start))
+    {
+        off_t bytes = m_bytes_to_send;
+        process_write(SERVICE_UNAVAILABLE);
+        record_access(m_bytes_to_send - bytes, 0);
+        ++m_response_count;
+        m_batch_linger = false;
+        rearm(EPOLLOUT);
+        clear_busy();
+        return true;
+    }
+
+    while (m_response_count < MAX_PIPELINE)
+    {
+        // 解析HTTP请求
+        HTTP_CODE read_ret = process_read();
+        if (read_ret == NO_REQUEST) // 请求不完整，已收到的部分留在读缓冲区中
+        {
+            break;
+        }
+
+        // 生成响应
+        off_t bytes = m_bytes_to_send;
+        if (!process_write(read_ret))
+        {
+            // 连接由事件循环线程关闭，这里只关闭socket的读写，循环随后会收到EPOLLHUP
+            shutdown(m_sockfd, SHUT_RDWR);
+            rearm(EPOLLIN);
+            clear_busy();
+            return false;
+        }
+        unsigned long now = monotonic_us();
+        record_access(m_bytes_to_send - bytes, now - start);
+        ++m_response_count;
+        m_batch_linger = m_linger;
+        init_request();
+        local_metrics()->parse.record(now - start);
+        start = now;
+
+        // 要关闭的连接不再处理后面的请求；sendfile的文件内容不能和后面的响应合并；写缓冲区放不下下一个响应头时留到下一批；
+        // 动态生成的响应体一批只能有一个
+        if (!m_batch_linger || m_file_fd != -1 || m_write_buffer_size - m_write_idx < FILE_HEADER_MAX || !m_dynamic.empty())
+        {
+            break;
+        }
+    }
+    compact_read_buf();
+
+    // 先重新注册事件再结束busy状态，此后连接可能被事件循环关闭
+    if (m_response_count == 0)
+    {
+        rearm(EPOLLIN);
+        clear_busy();
+        return false;
+    }
+    rearm(EPOLLOUT);
+    clear_busy();
+    return true;
+}
+
+void http_conn::record_access(off_t bytes, unsigned long parse_us)
+{
+    if (!async_log::access_enabled())
     {
-        modfd(m_epollfd, m_sockfd, EPOLLIN);
         return;
     }
+    // URL指向读缓冲区，init_request之后就失效了，先拷贝下来
+    access_entry &entry = m_access[m_access_count++];
+    entry.status = m_status;
+    entry.bytes = bytes;
+    entry.parse_us = parse_us;
+    if (m_status == 400 || !m_url)
+    {
+        strcpy(entry.request, "-");
+    }
+    else
+    {
+        snprintf(entry.request, sizeof(entry.request), "%s %s", m_method == HEAD ? "HEAD" : "GET", m_url);
+    }
+}
 
-    // 生成响应
-    bool write_ret = process_write(read_ret);
-    if (!write_ret)
+// 格式：客户端地址 "方法 URL" 状态码 字节数 queue=排队 parse=解析 ttlb=整批发送完的时间，时间单位为微秒
+void http_conn::write_access_log(unsigned long ttlb_us)
+{
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &m_address.sin_addr, ip, sizeof(ip));
+    for (int i = 0; i < m_access_count; ++i)
     {
-        close_conn();
+        const access_entry &entry = m_access[i];
+        async_log::access("%s \"%s\" %d %ld queue=%lu parse=%u ttlb=%lu", ip, entry.request, entry.status, (long)entry.bytes,
+                          m_queue_wait_us, entry.parse_us, ttlb_us);
     }
-    modfd(m_epollfd, m_sockfd, EPOLLOUT);
-}
\ No newline at end of file
+    m_access_count = 0;
+    m_queue_wait_us = 0;
+}
@@ -19,17 +19,27 @@
 #include <stdarg.h>
 #include <errno.h>
 #include "locker.h"
+#include "file_cache.h"
+#include "http_scan.h"
+#include "time_wheel.h"
+#include "slab.h"
+#include "admission.h"
+#include "metrics.h"
+#include "log.h"
+#include <string>
 #include <sys/uio.h>
+#include <atomic>
 
 // 任务类
 class http_conn
 {
 public:
     static const int FILENAME_LEN = 200;       // 文件名的最大长度
-    static const int READ_BUFFER_SIZE = 2048;  // 读缓冲区的大小
-    static const int WRITE_BUFFER_SIZE = 1024; // 写缓冲区的大小
+    static const int MAX_PIPELINE = 16;        // 一批最多合并发送的流水线响应数
+    static const int MAX_READ_CHAIN = 32;      // 一个请求最多占用的已满读缓冲区块数
+    static const int MAX_RANGES = 8;           // 一个Range请求最多处理的区间数，超过时忽略Range回复整个文件
 
-    // HTTP请求方法，这里只支持GET
+    // HTTP请求方法，这里只支持GET和HEAD
     enum METHOD
     {
         GET = 0,
@@ -64,6 +74,11 @@ public:
         FORBIDDEN_REQUEST   :   表示客户对资源没有足够的访问权限
         FILE_REQUEST        :   文件请求,获取文件成功
         INTERNAL_ERROR      :   表示服务器内部错误
+        PAYLOAD_TOO_LARGE   :   表示请求体超过了允许的大小
+        SERVICE_UNAVAILABLE :   表示服务器过载，请求在队列中等待太久被拒绝
+        METRICS_REQUEST     :   表示请求的是监控指标
+        NOT_MODIFIED        :   表示条件请求的文件没有变化，回复不带响应体的304
+        RANGE_NOT_SATISFIABLE : 表示Range中的区间都超出了文件的范围，回复416
         CLOSED_CONNECTION   :   表示客户端已经关闭连接了
     */
     enum HTTP_CODE
@@ -75,6 +90,11 @@ public:
         FORBIDDEN_REQUEST,
         FILE_REQUEST,
         INTERNAL_ERROR,
+        PAYLOAD_TOO_LARGE,
+        SERVICE_UNAVAILABLE,
+        METRICS_REQUEST,
+        NOT_MODIFIED,
+        RANGE_NOT_SATISFIABLE,
         CLOSED_CONNECTION
     };
 
@@ -88,51 +108,107 @@ public:
     };
 
 public:
-    http_conn() {}
+    http_conn() : m_sockfd(-1), m_read_buf(NULL), m_read_chain_count(0), m_read_chain_bytes(0), m_write_buf(NULL) {}
     ~http_conn() {}
 
 public:
-    void init(int sockfd, const sockaddr_in &addr); // 初始化新接受的连接
-    void close_conn();                              // 关闭连接
-    void process();                                 // 处理客户端请求
-    bool read();                                    // 非阻塞读
-    bool write();                                   // 非阻塞写
+    void init(int sockfd, const sockaddr_in &addr, int epollfd); // 初始化新接受的连接，epollfd为负责该连接的事件循环
+    void close_conn();                                           // 关闭连接
+    bool process();                                              // 处理客户端请求，返回是否生成了待发送的响应
+    bool read();                                                 // 非阻塞读
+    bool write();                                                // 非阻塞写
+    bool has_pending_request() const;                            // 响应发送完后读缓冲区中是否还有待处理的流水线请求
+    int sockfd() const { return m_sockfd; }
+
+    // 读写缓冲区只在有请求需要处理时从事件循环的缓冲区池中取得，空闲或关闭时归还
+    bool attach_buffers(buffer_pool *pool); // 读之前调用，读缓冲区满时扩展，失败(内存不足或者请求头超过上限)返回false
+    void release_buffers(buffer_pool *pool); // 只能在idle()或者连接关闭后调用
+
+    // 不经过epoll的I/O后端(io_uring)使用的接口：数据的收发由后端完成，连接只负责缓冲、解析和记账
+    int feed(const char *data, int len);             // 把收到的数据拷入读缓冲区，返回拷入的字节数，调用前需要attach_buffers
+    int pending_iov(struct iovec **iov);             // 本批响应内存部分还没发送的块，返回块数，0表示内存部分已经发完
+    off_t pending_file(int *fd, off_t *offset) const; // 文件部分还没发送的字节数，以及文件和发送偏移
+    bool sent(int n);                                // 记录发送了n字节，先内存部分再文件部分，返回本批是否已经全部发送
+    bool finish_batch();                             // 本批发送完后释放资源、重置发送状态，返回是否保持连接
+
+    // 超时管理，除busy相关的函数外只在连接所属的事件循环线程中调用
+    tw_timer<http_conn> *timer() { return &m_timer; }
+    bool idle() const;                            // 是否在等待下一个请求：没有未解析的数据，也没有待发送的响应
+    void touch(unsigned long now, bool start);    // 记录读写有进展的时间(毫秒)，start表示一个新请求的第一批数据到达
+    long timeout_left(unsigned long now) const;   // 按连接当前所处的阶段计算距离超时还剩多少毫秒
+    void set_busy() { m_busy.fetch_add(1, std::memory_order_relaxed); }   // 连接交给process()处理之前调用
+    void clear_busy() { m_busy.fetch_sub(1, std::memory_order_release); } // process()处理完时调用
+    bool busy() const { return m_busy.load(std::memory_order_acquire) != 0; } // 是否正在被工作线程处理
+    void set_enqueue_time(unsigned long us) { m_enqueue_us = us; } // 交给线程池时记录入队时间，供准入控制计算排队时间
+
 private:
+    friend class http_bench; // test_presure/http_bench.cpp 在进程内逐个阶段驱动解析和生成响应
+
     void init();                       // 初始化连接
+    void rearm(int ev);                // 重新注册epoll事件，不使用epoll的后端中什么也不做
+    void init_request();               // 为下一个请求重置解析状态，保留读缓冲区中的数据
+    void compact_read_buf();           // 把未解析的数据移到读缓冲区头部
+    bool grow_read_buf(buffer_pool *pool);     // 读缓冲区已满时腾出空间，必要时换一个新块
+    void release_read_chain(buffer_pool *pool); // 归还当前请求之前占用的已满的块
     HTTP_CODE process_read();          // 解析HTTP请求
     bool process_write(HTTP_CODE ret); // 填充HTTP应答
 
     // 下面这一组函数被process_read调用以分析HTTP请求
-    HTTP_CODE parse_request_line(char *text); // 解析请求头
-    HTTP_CODE parse_headers(char *text);      // 解析请求体
-    HTTP_CODE parse_content(char *text);
+    HTTP_CODE parse_request_line(char *text, int len); // 解析请求行
+    HTTP_CODE parse_headers(char *text, int len);      // 解析请求头
+    HTTP_CODE parse_content();
     HTTP_CODE do_request();
+    bool not_modified(const char *etag, int etag_len) const; // 按If-None-Match和If-Modified-Since判断客户端的副本是否仍然有效
+    HTTP_CODE parse_range(const char *etag, int etag_len);   // 按Range和If-Range得到要发送的区间，返回FILE_REQUEST或RANGE_NOT_SATISFIABLE
     char *get_line() { return m_read_buf + m_start_line; }
     LINE_STATUS parse_line();
 
     // 这一组函数被process_write调用以填充HTTP应答。
     void unmap();
+    void close_file();
+    void release_file(); // 释放本次响应占用的文件资源：内存映射、文件描述符或缓存项
+    void consume_iov(int n);
+    void add_multipart(); // 多区间的206响应
+    void add_iov(const void *base, size_t len);
     bool add_response(const char *format, ...);
     bool add_content(const char *content);
-    bool add_content_type();
-    bool add_status_line(int status, const char *title);
-    bool add_headers(int content_length);
-    bool add_content_length(int content_length);
-    bool add_linger();
-    bool add_blank_line();
+    void record_access(off_t bytes, unsigned long parse_us); // 访问日志打开时记下刚生成的响应
+    void write_access_log(unsigned long ttlb_us);          // 本批发送完后写出访问日志
 
 public:
-    static int m_epollfd;    // 所有socket上的事件都被注册到同一个epoll内核事件中，所以设置成静态的
-    static int m_user_count; // 统计用户的数量
+    static std::atomic<int> m_user_count; // 统计用户的数量，多Reactor模式下会被多个线程修改
+    static bool m_sendfile;               // 为true时用sendfile零拷贝发送文件，否则mmap + writev
+    static file_cache *m_cache;           // 静态文件缓存，为NULL时不使用缓存
+    static admission *m_admission;        // 线程池模式下的准入控制，为NULL时不拒绝请求
+    static const char *m_metrics_url;     // 输出监控指标的URL，为NULL时不提供
+    static int m_idle_timeout;            // 保持连接等待下一个请求、以及发送响应时没有进展的超时时间(毫秒)
+    static int m_header_timeout;          // 从请求的第一个字节到达起，必须在这个时间内收完请求行和头部(毫秒)
+    static int m_body_timeout;            // 读取请求体时两次读之间的超时时间(毫秒)
+    static int m_max_header_size;         // 请求行和头部最多占用的读缓冲区字节数，超过时关闭连接
+    static int m_max_body_size;           // 允许的最大请求体，超过时返回413
+    static int m_read_buffer_size;        // 读缓冲区块的默认大小，一行放不下时换用更大的块
+    static int m_write_buffer_size;       // 写缓冲区的大小
+    static std::atomic<bool> m_draining;  // 服务器正在退出，之后的响应都带Connection: close，发送完即关闭连接
 
 private:
+    int m_epollfd;         // 该连接注册到的epoll实例，多Reactor模式下每个事件循环各有一个，io_uring后端中为-1
     int m_sockfd;          // 该HTTP连接的socket和对方的socket地址
     sockaddr_in m_address; // 通信Socket地址
 
-    char m_read_buf[READ_BUFFER_SIZE]; // 读缓冲区
-    int m_read_idx;                    // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
-    int m_checked_idx;                 // 当前正在分析的字符在读缓冲区中的位置
-    int m_start_line;                  // 当前正在解析的行的起始位置
+    /*
+        读缓冲区是一串块：m_read_buf是正在读入的块，之前已满的块挂在m_read_chain上。
+        已解析的行（请求行、头部）留在原来的块中，URL、Host等指针一直有效；块满时只把还没解析完的那一行拷到新块，
+        请求体边读边跳过，不需要保存。当前请求处理完后，链上的块由事件循环线程归还
+    */
+    char *m_read_buf;                        // 当前的读缓冲区块，空闲时为NULL
+    int m_read_size;                         // 当前块的大小
+    int m_read_idx;                          // 标识读缓冲区中已经读入的客户端数据的最后一个字节的下一个位置
+    int m_checked_idx;                       // 当前正在分析的字符在读缓冲区中的位置
+    int m_start_line;                        // 当前正在解析的行的起始位置
+    bool m_read_pinned;                      // 当前块中是否有当前请求已经解析过的行，有则不能原地整理
+    struct iovec m_read_chain[MAX_READ_CHAIN]; // 当前请求占用的已满的块
+    int m_read_chain_count;
+    int m_read_chain_bytes;                  // 链上的块的总大小
 
     CHECK_STATE m_check_state; // 主状态机当前所处的状态
     METHOD m_method;           // 请求方法
@@ -142,14 +218,71 @@ private:
     char *m_version;                // HTTP协议版本号，我们仅支持HTTP1.1
     char *m_host;                   // 主机名
     int m_content_length;           // HTTP请求的消息总长度
+    int m_body_left;                // 请求体还没有读到的字节数
     bool m_linger;                  // HTTP请求是否要求保持连接
+    const char *m_if_none_match;    // If-None-Match的值，没有时为NULL
+    int m_if_none_match_len;
+    const char *m_if_modified_since; // If-Modified-Since的值，没有时为NULL
+    int m_if_modified_since_len;
+    const char *m_range;            // Range的值，没有时为NULL
+    int m_range_len;
+    const char *m_if_range;         // If-Range的值，没有时为NULL
+    int m_if_range_len;
+
 
-    char m_write_buf[WRITE_BUFFER_SIZE]; // 写缓冲区
+    char *m_write_buf;                   // 写缓冲区，大小为m_write_buffer_size，空闲时为NULL
     int m_write_idx;                     // 写缓冲区中待发送的字节数
     char *m_file_address;                // 客户请求的目标文件被mmap到内存中的起始位置
+    off_t m_map_start;                   // 映射的部分在文件中的偏移，Range请求只映射区间所在的页
+    size_t m_map_len;                    // 映射的长度
     struct stat m_file_stat;             // 目标文件的状态。通过它我们可以判断文件是否存在、是否为目录、是否可读，并获取文件大小等信息
-    struct iovec m_iv[2];                // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
+    struct byte_range
+    {
+        off_t first; // 区间的第一个和最后一个字节
+        off_t last;
+    };
+    byte_range m_ranges[MAX_RANGES];     // Range请求要发送的区间，按请求中的顺序
+    int m_range_count;                   // 0表示发送整个文件
+    // 我们将采用writev来执行写操作，所以定义下面两个成员，其中m_iv_count表示被写内存块的数量。
+    // 多区间的响应占用2 * MAX_RANGES + 2块，它总是一批中的最后一个响应
+    struct iovec m_iv[2 * MAX_PIPELINE + 2 * MAX_RANGES];
     int m_iv_count;
+    int m_iv_start;                      // m_iv中第一个还没有发送完的内存块
+    off_t m_bytes_to_send;               // 本次响应还未发送的总字节数，sendfile发送的文件可以超过2GB
+    int m_file_fd;                       // sendfile模式下打开的目标文件，-1表示没有
+    off_t m_file_offset;                 // sendfile模式下文件的发送偏移
+    off_t m_file_left;                   // sendfile模式下文件还未发送的字节数
+    std::shared_ptr<const cached_file> m_cache_entry; // 命中缓存时的文件，响应直接引用其中的响应头和内容
+    std::string m_dynamic;               // 动态生成的响应体(监控指标)，一批最多一个，发送完后清空
+
+    // 流水线：一批响应在全部发送完之前需要持有的资源
+    int m_response_count;                                          // 本批已生成的响应数
+    bool m_batch_linger;                                           // 本批最后一个请求是否要求保持连接
+    struct iovec m_maps[MAX_PIPELINE];                             // 本批响应的mmap映射
+    int m_map_count;
+    std::shared_ptr<const cached_file> m_batch_cache[MAX_PIPELINE]; // 本批响应引用的缓存项
+    int m_batch_cache_count;
+
+    // 访问日志：本批每个响应一条记录，发送完后写出，请求行只保留开头的一段
+    struct access_entry
+    {
+        short status;
+        char request[46]; // 方法和URL，请求行无法解析时为"-"
+        off_t bytes; // 大文件和它的区间可以超过2GB
+        unsigned int parse_us;
+    };
+    int m_status;                         // process_write最近生成的响应的状态码
+    access_entry m_access[MAX_PIPELINE];
+    int m_access_count;
+    unsigned long m_queue_wait_us;        // 本批在线程池队列中等待的时间(微秒)
+
+    // 超时
+    tw_timer<http_conn> m_timer;  // 嵌入的定时器，挂在所属事件循环的时间轮上
+    unsigned long m_last_active;  // 最近一次读写有进展的时间
+    unsigned long m_request_start; // 当前请求的第一批数据到达的时间
+    unsigned long m_request_start_us; // 同上，单位微秒，用于统计time to last byte
+    std::atomic<int> m_busy;      // 正在进行的process()调用数，不为0时超时处理跳过该连接
+    unsigned long m_enqueue_us;   // 交给线程池的时间(微秒)，0表示不是从线程池队列中取出的
 };
 
 #endif
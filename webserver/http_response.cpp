@@ -0,0 +1,403 @@
+#include "http_response.h"
+#include <string.h>
+#include <unistd.h>
+
+// 定义HTTP响应的一些状态信息
+const char *error_400_title = "Bad Request";
+const char *error_400_form = "Your request has bad syntax or is inherently impossible to satisfy.\n";
+const char *error_403_title = "Forbidden";
+const char *error_403_form = "You do not have permission to get file from this server.\n";
+const char *error_404_title = "Not Found";
+const char *error_404_form = "The requested file was not found on this server.\n";
+const char *error_413_title = "Payload Too Large";
+const char *error_413_form = "The request body is larger than the server is willing to process.\n";
+const char *error_500_title = "Internal Error";
+const char *error_500_form = "There was an unusual problem serving the requested file.\n";
+const char *error_503_title = "Service Unavailable";
+const char *error_503_form = "The server is overloaded, please retry later.\n";
+
+// 00 ~ 99 的两位数字表
+static const char digits_lut[201] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+int u64toa(unsigned long value, char *buf)
+{
+    // 先从低位倒着写到临时缓冲区，再一次拷贝出去
+    char temp[20];
+    char *p = temp + sizeof(temp);
+    while (value >= 100)
+    {
+        unsigned int i = (value % 100) * 2;
+        value /= 100;
+        *--p = digits_lut[i + 1];
+        *--p = digits_lut[i];
+    }
+    if (value >= 10)
+    {
+        unsigned int i = value * 2;
+        *--p = digits_lut[i + 1];
+        *--p = digits_lut[i];
+    }
+    else
+    {
+        *--p = (char)('0' + value);
+    }
+    int len = temp + sizeof(temp) - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+// 把字面量追加到p处，返回新的末尾
+static inline char *append(char *p, const char *s, size_t len)
+{
+    memcpy(p, s, len);
+    return p + len;
+}
+
+#define APPEND_LITERAL(p, s) append(p, s, sizeof(s) - 1)
+
+// 无符号整数转小写十六进制字符串，返回写入的字节数
+static int u64tohex(unsigned long value, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    char temp[16];
+    char *p = temp + sizeof(temp);
+    do
+    {
+        *--p = hex[value & 0xf];
+        value >>= 4;
+    } while (value);
+    int len = temp + sizeof(temp) - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+int build_etag(char *buf, const struct stat &st)
+{
+    // 修改时间精确到纳秒，同一秒内的两次修改也会得到不同的ETag
+    unsigned long mtime_ns = (unsigned long)st.st_mtim.tv_sec * 1000000000UL + st.st_mtim.tv_nsec;
+    char *p = buf;
+    *p++ = '"';
+    p += u64tohex(st.st_ino, p);
+    *p++ = '-';
+    p += u64tohex(st.st_size, p);
+    *p++ = '-';
+    p += u64tohex(mtime_ns, p);
+    *p++ = '"';
+    return p - buf;
+}
+
+static const char week_names[7][4] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char month_names[12][4] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+// 写两位数字
+static inline char *put2(char *p, int value)
+{
+    memcpy(p, digits_lut + value * 2, 2);
+    return p + 2;
+}
+
+void format_http_date(time_t t, char *buf)
+{
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char *p = buf;
+    p = append(p, week_names[tm.tm_wday], 3);
+    p = APPEND_LITERAL(p, ", ");
+    p = put2(p, tm.tm_mday);
+    *p++ = ' ';
+    p = append(p, month_names[tm.tm_mon], 3);
+    *p++ = ' ';
+    int year = tm.tm_year + 1900;
+    p = put2(p, year / 100 % 100);
+    p = put2(p, year % 100);
+    *p++ = ' ';
+    p = put2(p, tm.tm_hour);
+    *p++ = ':';
+    p = put2(p, tm.tm_min);
+    *p++ = ':';
+    p = put2(p, tm.tm_sec);
+    p = APPEND_LITERAL(p, " GMT");
+}
+
+// 读取n位数字，不是数字时返回-1
+static int parse_digits(const char *s, int n)
+{
+    int value = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        if (s[i] < '0' || s[i] > '9')
+        {
+            return -1;
+        }
+        value = value * 10 + (s[i] - '0');
+    }
+    return value;
+}
+
+time_t parse_http_date(const char *s, int len)
+{
+    // Sun, 06 Nov 1994 08:49:37 GMT，只接受这一种格式，另外两种已经废弃的格式当作无效的日期，结果只是回复完整的200
+    if (len != HTTP_DATE_LEN || s[3] != ',' || s[4] != ' ' || s[7] != ' ' || s[11] != ' ' || s[16] != ' ' ||
+        s[19] != ':' || s[22] != ':' || memcmp(s + 25, " GMT", 4) != 0)
+    {
+        return -1;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_mon = -1;
+    for (int i = 0; i < 12; ++i)
+    {
+        if (memcmp(s + 8, month_names[i], 3) == 0)
+        {
+            tm.tm_mon = i;
+            break;
+        }
+    }
+    tm.tm_mday = parse_digits(s + 5, 2);
+    int year = parse_digits(s + 12, 4);
+    tm.tm_hour = parse_digits(s + 17, 2);
+    tm.tm_min = parse_digits(s + 20, 2);
+    tm.tm_sec = parse_digits(s + 23, 2);
+    if (tm.tm_mon < 0 || tm.tm_mday < 1 || tm.tm_mday > 31 || year < 1970 || tm.tm_hour < 0 || tm.tm_hour > 23 ||
+        tm.tm_min < 0 || tm.tm_min > 59 || tm.tm_sec < 0 || tm.tm_sec > 60)
+    {
+        return -1;
+    }
+    tm.tm_year = year - 1900;
+    return timegm(&tm);
+}
+
+// ETag和Last-Modified两行
+static char *append_validators(char *p, const struct stat &st)
+{
+    p = APPEND_LITERAL(p, "ETag: ");
+    p += build_etag(p, st);
+    p = APPEND_LITERAL(p, "\r\nLast-Modified: ");
+    format_http_date(st.st_mtime, p);
+    p += HTTP_DATE_LEN;
+    return APPEND_LITERAL(p, "\r\n");
+}
+
+static char *append_connection(char *p, bool linger)
+{
+    if (linger)
+    {
+        return APPEND_LITERAL(p, "Connection: keep-alive\r\n\r\n");
+    }
+    return APPEND_LITERAL(p, "Connection: close\r\n\r\n");
+}
+
+int build_file_header(char *buf, const struct stat &st, bool linger)
+{
+    char *p = buf;
+    p = APPEND_LITERAL(p, "HTTP/1.1 200 OK\r\nContent-Length: ");
+    p += u64toa(st.st_size, p);
+    // 告诉客户端可以用Range请求文件的一部分
+    p = APPEND_LITERAL(p, "\r\nContent-Type:text/html\r\nAccept-Ranges: bytes\r\n");
+    p = append_validators(p, st);
+    p = append_connection(p, linger);
+    return p - buf;
+}
+
+// Content-Range的值bytes first-last/size
+static char *append_content_range(char *p, unsigned long first, unsigned long last, unsigned long size)
+{
+    p = APPEND_LITERAL(p, "Content-Range: bytes ");
+    p += u64toa(first, p);
+    *p++ = '-';
+    p += u64toa(last, p);
+    *p++ = '/';
+    p += u64toa(size, p);
+    return APPEND_LITERAL(p, "\r\n");
+}
+
+int build_range_header(char *buf, const struct stat &st, unsigned long first, unsigned long last, bool linger)
+{
+    char *p = buf;
+    p = APPEND_LITERAL(p, "HTTP/1.1 206 Partial Content\r\nContent-Length: ");
+    p += u64toa(last - first + 1, p);
+    p = APPEND_LITERAL(p, "\r\nContent-Type:text/html\r\n");
+    p = append_content_range(p, first, last, st.st_size);
+    p = append_validators(p, st);
+    p = append_connection(p, linger);
+    return p - buf;
+}
+
+// 分隔各个区间的boundary，每个进程启动时随机生成一次，文件内容中恰好出现它的可能性可以忽略
+static const char *multipart_boundary()
+{
+    struct boundary
+    {
+        char text[17];
+        boundary()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            unsigned long seed = (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+            seed ^= (unsigned long)getpid() << 32;
+            // splitmix64
+            seed += 0x9e3779b97f4a7c15UL;
+            seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9UL;
+            seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebUL;
+            seed ^= seed >> 31;
+            int len = u64tohex(seed, text);
+            memset(text + len, '0', 16 - len);
+            text[16] = '\0';
+        }
+    };
+    static const boundary b;
+    return b.text;
+}
+
+int build_multipart_header(char *buf, const struct stat &st, unsigned long content_length, bool linger)
+{
+    char *p = buf;
+    p = APPEND_LITERAL(p, "HTTP/1.1 206 Partial Content\r\nContent-Length: ");
+    p += u64toa(content_length, p);
+    p = APPEND_LITERAL(p, "\r\nContent-Type: multipart/byteranges; boundary=");
+    p = append(p, multipart_boundary(), 16);
+    p = APPEND_LITERAL(p, "\r\n");
+    p = append_validators(p, st);
+    p = append_connection(p, linger);
+    return p - buf;
+}
+
+void append_multipart_part(std::string &out, unsigned long first, unsigned long last, unsigned long size)
+{
+    char part[160];
+    char *p = part;
+    p = APPEND_LITERAL(p, "\r\n--");
+    p = append(p, multipart_boundary(), 16);
+    p = APPEND_LITERAL(p, "\r\nContent-Type:text/html\r\n");
+    p = append_content_range(p, first, last, size);
+    p = APPEND_LITERAL(p, "\r\n");
+    out.append(part, p - part);
+}
+
+void append_multipart_end(std::string &out)
+{
+    out += "\r\n--";
+    out.append(multipart_boundary(), 16);
+    out += "--\r\n";
+}
+
+int build_range_error_header(char *buf, unsigned long size, bool linger)
+{
+    char *p = buf;
+    p = APPEND_LITERAL(p, "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */");
+    p += u64toa(size, p);
+    p = APPEND_LITERAL(p, "\r\nContent-Length: 0\r\n");
+    p = append_connection(p, linger);
+    return p - buf;
+}
+
+int build_not_modified_header(char *buf, const struct stat &st, bool linger)
+{
+    char *p = buf;
+    p = APPEND_LITERAL(p, "HTTP/1.1 304 Not Modified\r\n");
+    p = append_validators(p, st);
+    p = append_connection(p, linger);
+    return p - buf;
+}
+
+int build_text_header(char *buf, unsigned long content_length, const char *content_type, bool linger)
+{
+    char *p = buf;
+    p = APPEND_LITERAL(p, "HTTP/1.1 200 OK\r\nContent-Length: ");
+    p += u64toa(content_length, p);
+    p = APPEND_LITERAL(p, "\r\nContent-Type: ");
+    p = append(p, content_type, strlen(content_type));
+    if (linger)
+    {
+        p = APPEND_LITERAL(p, "\r\nConnection: keep-alive\r\n\r\n");
+    }
+    else
+    {
+        p = APPEND_LITERAL(p, "\r\nConnection: close\r\n\r\n");
+    }
+    return p - buf;
+}
+
+// 所有固定响应，第一次使用时生成
+struct fixed_response_table
+{
+    enum
+    {
+        FIXED_400 = 0,
+        FIXED_403,
+        FIXED_404,
+        FIXED_413,
+        FIXED_500,
+        FIXED_503,
+        FIXED_COUNT
+    };
+    std::string responses[FIXED_COUNT][2];
+
+    fixed_response_table()
+    {
+        build(FIXED_400, 400, error_400_title, error_400_form);
+        build(FIXED_403, 403, error_403_title, error_403_form);
+        build(FIXED_404, 404, error_404_title, error_404_form);
+        build(FIXED_413, 413, error_413_title, error_413_form);
+        build(FIXED_500, 500, error_500_title, error_500_form);
+        // 过载时的响应，告诉客户端1秒后重试
+        build(FIXED_503, 503, error_503_title, error_503_form, "Retry-After: 1\r\n");
+    }
+
+    void build(int index, int status, const char *title, const char *form, const char *extra = "")
+    {
+        char number[20];
+        for (int linger = 0; linger < 2; ++linger)
+        {
+            std::string &r = responses[index][linger];
+            r = "HTTP/1.1 ";
+            r.append(number, u64toa(status, number));
+            r += " ";
+            r += title;
+            r += "\r\nContent-Length: ";
+            r.append(number, u64toa(strlen(form), number));
+            r += "\r\nContent-Type:text/html\r\n";
+            r += extra;
+            r += "Connection: ";
+            r += linger ? "keep-alive" : "close";
+            r += "\r\n\r\n";
+            r += form;
+        }
+    }
+};
+
+const std::string *fixed_response(int status, bool linger)
+{
+    // C++11保证局部静态变量的初始化是线程安全的
+    static const fixed_response_table table;
+    int index;
+    switch (status)
+    {
+    case 400:
+        index = fixed_response_table::FIXED_400;
+        break;
+    case 403:
+        index = fixed_response_table::FIXED_403;
+        break;
+    case 404:
+        index = fixed_response_table::FIXED_404;
+        break;
+    case 413:
+        index = fixed_response_table::FIXED_413;
+        break;
+    case 500:
+        index = fixed_response_table::FIXED_500;
+        break;
+    case 503:
+        index = fixed_response_table::FIXED_503;
+        break;
+    default:
+        return NULL;
+    }
+    return &table.responses[index][linger ? 1 : 0];
+}
@@ -0,0 +1,56 @@
+#ifndef HTTP_RESPONSE_H
+#define HTTP_RESPONSE_H
+
+#include <string>
+#include <sys/stat.h>
+#include <time.h>
+
+/*
+    响应头的快速生成
+    固定的错误响应（状态行 + 响应头 + 响应体）在第一次使用时生成一次，之后被m_iv直接引用；
+    文件响应头由字面量拼接和整数转字符串组成，不经过vsnprintf；
+    文件响应带有强ETag(由inode、大小和纳秒级的修改时间生成)和Last-Modified，条件请求命中时回复不带响应体的304；
+    Range请求回复206，单个区间带Content-Range，多个区间为multipart/byteranges，区间都无法满足时回复416
+*/
+
+// 预先生成的固定响应，status为400、403、404、413、500或503(带Retry-After)，linger选择Connection: keep-alive或close；不支持的状态码返回NULL
+const std::string *fixed_response(int status, bool linger);
+
+// 生成200文件响应头(含Accept-Ranges、ETag和Last-Modified)，返回写入的字节数，buf至少需要FILE_HEADER_MAX字节
+// 这也是下面所有文件响应头的上限，最长的是带Content-Range的206响应头
+const int FILE_HEADER_MAX = 384;
+int build_file_header(char *buf, const struct stat &st, bool linger);
+
+// 生成304响应头，只带验证字段，没有响应体，buf至少需要FILE_HEADER_MAX字节
+int build_not_modified_header(char *buf, const struct stat &st, bool linger);
+
+// 生成单个区间[first, last]的206响应头
+int build_range_header(char *buf, const struct stat &st, unsigned long first, unsigned long last, bool linger);
+
+// 生成多个区间的206响应头，content_length为整个multipart响应体的长度
+int build_multipart_header(char *buf, const struct stat &st, unsigned long content_length, bool linger);
+
+// multipart/byteranges中一个区间之前的分隔行和头部，最后调用append_multipart_end；追加到out
+void append_multipart_part(std::string &out, unsigned long first, unsigned long last, unsigned long size);
+void append_multipart_end(std::string &out);
+
+// 生成416响应头，Content-Range为bytes */size，没有响应体
+int build_range_error_header(char *buf, unsigned long size, bool linger);
+
+// 生成带引号的ETag，如"1a2b-400-17f3c2a1b5e8d000"，返回写入的字节数，buf至少需要ETAG_MAX字节
+const int ETAG_MAX = 56;
+int build_etag(char *buf, const struct stat &st);
+
+// 按IMF-fixdate格式(Sun, 06 Nov 1994 08:49:37 GMT)输出时间，固定29字节，不依赖locale
+const int HTTP_DATE_LEN = 29;
+void format_http_date(time_t t, char *buf);
+// 解析IMF-fixdate，格式不对时返回-1，调用者应当忽略该字段
+time_t parse_http_date(const char *s, int len);
+
+// 生成200响应头，Content-Type由调用者指定，用于动态生成的响应，buf至少需要FILE_HEADER_MAX + strlen(content_type)字节
+int build_text_header(char *buf, unsigned long content_length, const char *content_type, bool linger);
+
+// 无符号整数转十进制字符串，每次处理两位数字，返回写入的字节数（不写入'\0'），buf至少需要20字节
+int u64toa(unsigned long value, char *buf);
+
+#endif
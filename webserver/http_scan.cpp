@@ -0,0 +1,158 @@
+#include "http_scan.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+typedef const char *(*scan_func)(const char *, const char *);
+
+static const char *scan_scalar(const char *p, const char *end)
+{
+    for (; p < end; ++p)
+    {
+        if (*p == '\r' || *p == '\n')
+        {
+            return p;
+        }
+    }
+    return end;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2"))) static const char *scan_sse2(const char *p, const char *end)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        if (mask)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+    return scan_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static const char *scan_avx2(const char *p, const char *end)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        if (mask)
+        {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+    return scan_sse2(p, end);
+}
+#endif
+
+// 启动时选择一次，之后每次调用只是一次间接跳转
+static scan_func choose_scan(const char **name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        *name = "avx2";
+        return scan_avx2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        *name = "sse2";
+        return scan_sse2;
+    }
+#endif
+    *name = "scalar";
+    return scan_scalar;
+}
+
+static const char *scan_name = "scalar";
+static const scan_func scan_impl = choose_scan(&scan_name);
+
+const char *find_line_end(const char *begin, const char *end)
+{
+    return scan_impl(begin, end);
+}
+
+const char *scan_impl_name()
+{
+    return scan_name;
+}
+
+bool equal_lower(const char *s, const char *lower, int len)
+{
+    for (int i = 0; i < len; ++i)
+    {
+        // 对字母而言，或上0x20就是小写；lower中的非字母字符也必须与s完全一致
+        char c = s[i];
+        if (c >= 'A' && c <= 'Z')
+        {
+            c |= 0x20;
+        }
+        if (c != lower[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+HEADER_ID lookup_header(const char *name, int len)
+{
+    // 先按长度分流，每个长度最多只需要一次完整比较
+    switch (len)
+    {
+    case 4:
+        if (equal_lower(name, "host", 4))
+        {
+            return HEADER_HOST;
+        }
+        break;
+    case 5:
+        if (equal_lower(name, "range", 5))
+        {
+            return HEADER_RANGE;
+        }
+        break;
+    case 8:
+        if (equal_lower(name, "if-range", 8))
+        {
+            return HEADER_IF_RANGE;
+        }
+        break;
+    case 10:
+        if (equal_lower(name, "connection", 10))
+        {
+            return HEADER_CONNECTION;
+        }
+        break;
+    case 13:
+        if (equal_lower(name, "if-none-match", 13))
+        {
+            return HEADER_IF_NONE_MATCH;
+        }
+        break;
+    case 14:
+        if (equal_lower(name, "content-length", 14))
+        {
+            return HEADER_CONTENT_LENGTH;
+        }
+        break;
+    case 17:
+        if (equal_lower(name, "if-modified-since", 17))
+        {
+            return HEADER_IF_MODIFIED_SINCE;
+        }
+        break;
+    default:
+        break;
+    }
+    return HEADER_UNKNOWN;
+}
@@ -0,0 +1,46 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+/*
+    HTTP请求的向量化扫描
+    find_line_end 一次比较16/32个字节来寻找行尾的'\r'或'\n'，启动时根据CPU支持的指令集选择
+    AVX2、SSE2或逐字节的实现；lookup_header 按长度和首字母把头部字段名映射为编号，
+    解析头部时只需要一次比较，而不是对每个已知字段逐个strncasecmp
+*/
+
+// 已知的头部字段
+enum HEADER_ID
+{
+    HEADER_UNKNOWN = 0,
+    HEADER_CONNECTION,
+    HEADER_CONTENT_LENGTH,
+    HEADER_HOST,
+    HEADER_IF_NONE_MATCH,
+    HEADER_IF_MODIFIED_SINCE,
+    HEADER_RANGE,
+    HEADER_IF_RANGE
+};
+
+// 解析出的一个头部字段，指针指向读缓冲区
+struct http_header
+{
+    const char *name;
+    const char *value;
+    int name_len;
+    int value_len;
+    HEADER_ID id;
+};
+
+// 返回[begin, end)中第一个'\r'或'\n'的位置，没有时返回end
+const char *find_line_end(const char *begin, const char *end);
+
+// 当前使用的扫描实现的名字："avx2"、"sse2"或"scalar"
+const char *scan_impl_name();
+
+// 不区分大小写地识别头部字段名
+HEADER_ID lookup_header(const char *name, int len);
+
+// 不区分大小写地比较长度为len的两个字符串，lower必须是小写
+bool equal_lower(const char *s, const char *lower, int len);
+
+#endif
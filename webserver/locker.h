@@ -29,6 +29,11 @@ public:
     {
         return pthread_mutex_lock(&m_mutex) == 0;
     }
+    // 尝试上锁，锁已被占用时立即返回false
+    bool trylock()
+    {
+        return pthread_mutex_trylock(&m_mutex) == 0;
+    }
     // 解锁
     bool unlock()
     {
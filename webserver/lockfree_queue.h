@@ -0,0 +1,157 @@
+#ifndef LOCKFREE_QUEUE_H
+#define LOCKFREE_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+
+#define CACHELINE_SIZE 64 // 缓存行大小，用于填充，避免伪共享
+
+// 自旋等待时让出流水线，降低功耗并让超线程的另一个逻辑核继续运行
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#endif
+}
+
+/*
+    有界的多生产者多消费者无锁队列（Dmitry Vyukov 的环形缓冲区算法）
+    每个槽位带一个序号，生产者和消费者各自用CAS推进自己的位置，
+    槽位序号告诉对方该槽位是否已经可写/可读，整个过程没有锁，也没有每个元素一次的内存分配
+*/
+template <typename T>
+class mpmc_queue
+{
+public:
+    // 容量向上取整为2的幂，方便用掩码代替取模
+    explicit mpmc_queue(size_t capacity);
+    ~mpmc_queue();
+
+    bool push(const T &data); // 队列满时返回false
+    bool pop(T &data);        // 队列空时返回false
+    size_t size() const;      // 近似的元素个数，仅供参考
+
+private:
+    struct cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    char m_pad0[CACHELINE_SIZE];
+    cell *m_buffer;
+    size_t m_mask;
+    char m_pad1[CACHELINE_SIZE];
+    std::atomic<size_t> m_enqueue_pos; // 生产者的位置，独占一个缓存行
+    char m_pad2[CACHELINE_SIZE];
+    std::atomic<size_t> m_dequeue_pos; // 消费者的位置，独占一个缓存行
+    char m_pad3[CACHELINE_SIZE];
+};
+
+template <typename T>
+mpmc_queue<T>::mpmc_queue(size_t capacity) : m_buffer(NULL), m_mask(0)
+{
+    if (capacity < 2)
+    {
+        capacity = 2;
+    }
+    size_t size = 1;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+    m_buffer = new cell[size];
+    m_mask = size - 1;
+    for (size_t i = 0; i < size; ++i)
+    {
+        m_buffer[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    m_enqueue_pos.store(0, std::memory_order_relaxed);
+    m_dequeue_pos.store(0, std::memory_order_relaxed);
+}
+
+template <typename T>
+mpmc_queue<T>::~mpmc_queue()
+{
+    delete[] m_buffer;
+}
+
+template <typename T>
+bool mpmc_queue<T>::push(const T &data)
+{
+    cell *c;
+    size_t pos = m_enqueue_pos.load(std::memory_order_relaxed);
+    while (true)
+    {
+        c = &m_buffer[pos & m_mask];
+        size_t seq = c->sequence.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0)
+        {
+            // 槽位空闲，尝试占用
+            if (m_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            // 槽位还没有被消费者取走，队列已满
+            return false;
+        }
+        else
+        {
+            // 被其他生产者抢先，重新读取位置
+            pos = m_enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    c->data = data;
+    c->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+bool mpmc_queue<T>::pop(T &data)
+{
+    cell *c;
+    size_t pos = m_dequeue_pos.load(std::memory_order_relaxed);
+    while (true)
+    {
+        c = &m_buffer[pos & m_mask];
+        size_t seq = c->sequence.load(std::memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0)
+        {
+            if (m_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (dif < 0)
+        {
+            // 槽位还没有被写入，队列为空
+            return false;
+        }
+        else
+        {
+            pos = m_dequeue_pos.load(std::memory_order_relaxed);
+        }
+    }
+    data = c->data;
+    // 序号加上容量，表示该槽位在下一圈可以再次被写入
+    c->sequence.store(pos + m_mask + 1, std::memory_order_release);
+    return true;
+}
+
+template <typename T>
+size_t mpmc_queue<T>::size() const
+{
+    size_t enq = m_enqueue_pos.load(std::memory_order_relaxed);
+    size_t deq = m_dequeue_pos.load(std::memory_order_relaxed);
+    return enq > deq ? enq - deq : 0;
+}
+
+#endif
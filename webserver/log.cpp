@@ -0,0 +1,264 @@
+#include "log.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <new>
+
+std::atomic<async_log::ring *> async_log::m_rings(NULL);
+std::atomic<bool> async_log::m_running(false);
+std::atomic<unsigned long> async_log::m_dropped(0);
+int async_log::m_log_fd = STDERR_FILENO;
+int async_log::m_access_fd = -1;
+
+thread_local async_log::ring *async_log::m_local = NULL;
+
+static pthread_t g_flusher;
+// 每个线程缓存格式化好的秒级时间，同一秒内的日志不再调用localtime_r
+static thread_local time_t t_stamp_sec = 0;
+static thread_local char t_stamp[24];
+
+static const char *level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static int open_log(const char *path)
+{
+    return open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+bool async_log::start(const char *log_file, const char *access_file)
+{
+    tzset();
+    if (log_file)
+    {
+        m_log_fd = open_log(log_file);
+        if (m_log_fd < 0)
+        {
+            m_log_fd = STDERR_FILENO;
+            return false;
+        }
+    }
+    if (access_file)
+    {
+        m_access_fd = open_log(access_file);
+        if (m_access_fd < 0)
+        {
+            return false;
+        }
+    }
+    m_running.store(true);
+    if (pthread_create(&g_flusher, NULL, flusher, NULL) != 0)
+    {
+        m_running.store(false);
+        return false;
+    }
+    return true;
+}
+
+void async_log::stop()
+{
+    if (!m_running.exchange(false))
+    {
+        return;
+    }
+    pthread_join(g_flusher, NULL);
+    drain();
+}
+
+async_log::ring *async_log::local_ring()
+{
+    if (!m_local)
+    {
+        void *mem = NULL;
+        if (posix_memalign(&mem, CACHELINE_SIZE, sizeof(ring)) != 0)
+        {
+            return NULL;
+        }
+        ring *r = new (mem) ring;
+        r->head.store(0, std::memory_order_relaxed);
+        r->tail.store(0, std::memory_order_relaxed);
+        // 头插到链表中，后台线程从m_rings开始遍历
+        ring *first = m_rings.load(std::memory_order_relaxed);
+        do
+        {
+            r->next = first;
+        } while (!m_rings.compare_exchange_weak(first, r, std::memory_order_release, std::memory_order_relaxed));
+        m_local = r;
+    }
+    return m_local;
+}
+
+async_log::record *async_log::reserve()
+{
+    ring *r = local_ring();
+    if (!r)
+    {
+        return NULL;
+    }
+    unsigned head = r->head.load(std::memory_order_relaxed);
+    if (head - r->tail.load(std::memory_order_acquire) >= (unsigned)RING_RECORDS)
+    {
+        m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return NULL;
+    }
+    return &r->records[head & (RING_RECORDS - 1)];
+}
+
+void async_log::commit()
+{
+    ring *r = m_local;
+    r->head.store(r->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+int async_log::format_prefix(char *buf, int size, const char *level)
+{
+    // clock_gettime走vDSO，不进入内核
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (ts.tv_sec != t_stamp_sec)
+    {
+        struct tm tm;
+        localtime_r(&ts.tv_sec, &tm);
+        strftime(t_stamp, sizeof(t_stamp), "%Y-%m-%d %H:%M:%S", &tm);
+        t_stamp_sec = ts.tv_sec;
+    }
+    if (level)
+    {
+        return snprintf(buf, size, "%s.%06ld [%s] ", t_stamp, ts.tv_nsec / 1000, level);
+    }
+    return snprintf(buf, size, "%s.%06ld ", t_stamp, ts.tv_nsec / 1000);
+}
+
+// 把格式化的结果补上换行，截断时也保证以换行结尾
+static int finish_line(char *text, int len, int size)
+{
+    if (len >= size - 1)
+    {
+        len = size - 2;
+    }
+    text[len++] = '\n';
+    return len;
+}
+
+void async_log::write(int level, const char *format, ...)
+{
+    const char *name = level_names[level < 0 ? 0 : (level > LOG_LEVEL_ERROR ? LOG_LEVEL_ERROR : level)];
+    va_list arg_list;
+    va_start(arg_list, format);
+    if (!m_running.load(std::memory_order_relaxed))
+    {
+        // 后台线程还没有启动(或已经结束)，直接写出
+        char text[RECORD_SIZE];
+        int len = format_prefix(text, sizeof(text), name);
+        len += vsnprintf(text + len, sizeof(text) - len, format, arg_list);
+        len = finish_line(text, len, sizeof(text));
+        ::write(m_log_fd, text, len);
+        va_end(arg_list);
+        return;
+    }
+    record *rec = reserve();
+    if (rec)
+    {
+        int len = format_prefix(rec->text, sizeof(rec->text), name);
+        len += vsnprintf(rec->text + len, sizeof(rec->text) - len, format, arg_list);
+        rec->len = finish_line(rec->text, len, sizeof(rec->text));
+        rec->access = 0;
+        commit();
+    }
+    va_end(arg_list);
+}
+
+void async_log::access(const char *format, ...)
+{
+    record *rec = reserve();
+    if (!rec)
+    {
+        return;
+    }
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = format_prefix(rec->text, sizeof(rec->text), NULL);
+    len += vsnprintf(rec->text + len, sizeof(rec->text) - len, format, arg_list);
+    va_end(arg_list);
+    rec->len = finish_line(rec->text, len, sizeof(rec->text));
+    rec->access = 1;
+    commit();
+}
+
+// 成批写入的缓冲区
+struct log_batch
+{
+    int fd;
+    int len;
+    char buf[64 * 1024];
+
+    void append(const char *text, int n)
+    {
+        if (len + n > (int)sizeof(buf))
+        {
+            flush();
+        }
+        memcpy(buf + len, text, n);
+        len += n;
+    }
+    void flush()
+    {
+        int off = 0;
+        while (off < len)
+        {
+            ssize_t ret = ::write(fd, buf + off, len - off);
+            if (ret <= 0)
+            {
+                break;
+            }
+            off += ret;
+        }
+        len = 0;
+    }
+};
+
+bool async_log::drain()
+{
+    static log_batch logs, accesses;
+    logs.fd = m_log_fd;
+    accesses.fd = m_access_fd;
+    bool busy = false;
+    for (ring *r = m_rings.load(std::memory_order_acquire); r; r = r->next)
+    {
+        unsigned tail = r->tail.load(std::memory_order_relaxed);
+        unsigned head = r->head.load(std::memory_order_acquire);
+        busy = busy || head - tail >= (unsigned)RING_RECORDS / 2;
+        for (; tail != head; ++tail)
+        {
+            const record &rec = r->records[tail & (RING_RECORDS - 1)];
+            (rec.access ? accesses : logs).append(rec.text, rec.len);
+        }
+        // 拷贝完成后才把槽还给生产者
+        r->tail.store(tail, std::memory_order_release);
+    }
+    logs.flush();
+    if (accesses.fd >= 0)
+    {
+        accesses.flush();
+    }
+    accesses.len = 0;
+    return busy;
+}
+
+void *async_log::flusher(void *)
+{
+    struct timespec interval;
+    interval.tv_sec = 0;
+    interval.tv_nsec = FLUSH_INTERVAL_MS * 1000000L;
+    while (m_running.load(std::memory_order_relaxed))
+    {
+        if (!drain())
+        {
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,94 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <atomic>
+#include "lockfree_queue.h"
+
+/*
+    异步日志
+    每个线程第一次写日志时分配一个自己的环形缓冲区(单生产者单消费者，无锁)，写日志只是在本线程中格式化到环中的一个槽里，
+    不加锁，也没有系统调用；后台线程定期把所有环中的记录成批写入文件。环满时丢弃新记录并计数，从不阻塞调用者
+    日志级别低于编译期的LOG_MIN_LEVEL时，LOG_xxx宏连同参数的求值一起被编译器去掉：
+        g++ -DLOG_MIN_LEVEL=0 ...   打开DEBUG日志
+    访问日志每个响应一行，与普通日志写入不同的文件
+*/
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_AT(level, format, ...)                               \
+    do                                                           \
+    {                                                            \
+        if (level >= LOG_MIN_LEVEL)                              \
+        {                                                        \
+            async_log::write(level, format, ##__VA_ARGS__);      \
+        }                                                        \
+    } while (0)
+
+#define LOG_DEBUG(format, ...) LOG_AT(LOG_LEVEL_DEBUG, format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...) LOG_AT(LOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...) LOG_AT(LOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#define LOG_ERROR(format, ...) LOG_AT(LOG_LEVEL_ERROR, format, ##__VA_ARGS__)
+
+class async_log
+{
+public:
+    static const int RECORD_SIZE = 256;  // 每条记录最多的字节数，超过的部分被截断
+    static const int RING_RECORDS = 1024; // 每个线程的环中的记录数，必须是2的幂
+    static const int FLUSH_INTERVAL_MS = 20; // 后台线程两次写入之间的间隔
+
+    // 启动后台线程，log_file为NULL时写到标准错误，access_file为NULL时不记录访问日志，打开文件失败返回false
+    static bool start(const char *log_file, const char *access_file);
+    // 写出所有还在环中的记录，结束后台线程
+    static void stop();
+
+    // 写一条普通日志，启动之前直接写到标准错误
+    static void write(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+    // 写一条访问日志，只应在access_enabled()时调用
+    static void access(const char *format, ...) __attribute__((format(printf, 1, 2)));
+    static bool access_enabled() { return m_access_fd >= 0; }
+
+    static unsigned long dropped() { return m_dropped.load(std::memory_order_relaxed); } // 因为环满丢弃的记录数
+
+private:
+    struct record
+    {
+        unsigned short len;
+        char access; // 1表示访问日志
+        char text[RECORD_SIZE - 3];
+    };
+
+    // 一个线程的环，生产者和消费者的位置各占一个缓存行
+    struct ring
+    {
+        record records[RING_RECORDS];
+        char pad0[CACHELINE_SIZE];
+        std::atomic<unsigned> head; // 生产者写入的下一个位置
+        char pad1[CACHELINE_SIZE];
+        std::atomic<unsigned> tail; // 消费者读取的下一个位置
+        char pad2[CACHELINE_SIZE];
+        ring *next;                 // 所有线程的环串成链表，只增不减
+    };
+
+    static ring *local_ring();
+    static record *reserve(); // 取得本线程环中的一个空槽，环满时返回NULL
+    static void commit();     // 发布reserve取得的槽
+    static int format_prefix(char *buf, int size, const char *level); // 时间和级别
+    static void *flusher(void *arg);
+    static bool drain(); // 把所有环中的记录写入文件，返回是否有环已经超过半满，需要马上再写一次
+
+    static thread_local ring *m_local; // 本线程的环
+    static std::atomic<ring *> m_rings;
+    static std::atomic<bool> m_running;
+    static std::atomic<unsigned long> m_dropped;
+    static int m_log_fd;
+    static int m_access_fd;
+};
+
+#endif
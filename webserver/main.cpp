@@ -11,14 +11,13 @@
 #include "locker.h"
 #include "threadpool.h"
 #include "http_conn.h"
+#include "eventloop.h"
+#include "uring_loop.h"
+#include "config.h"
+#include "control.h"
 
-#define MAX_FD 65536           // 最大的文件描述符个数
-#define MAX_EVENT_NUMBER 10000 // 监听的最大的事件数量
-
-// 添加epoll文件描述符函数
-extern void addfd(int epollfd, int fd, bool one_shot);
-// 删除epoll文件描述符
-extern void removefd(int epollfd, int fd);
+// 网站的根目录，由配置设置
+extern const char *doc_root;
 
 void addsig(int sig, void(handler)(int))
 {
@@ -29,126 +28,253 @@ void addsig(int sig, void(handler)(int))
     assert(sigaction(sig, &sa, NULL) != -1);
 }
 
-int main(int argc, char *argv[])
+// 监控指标中读取时计算的值
+static long active_connections(void *)
 {
+    return http_conn::m_user_count.load(std::memory_order_relaxed);
+}
 
-    if (argc <= 1)
+// arg是以NULL结尾的线程池数组，按NUMA节点放置时每个节点一个线程池
+static long queue_depth(void *arg)
+{
+    long depth = 0;
+    for (threadpool<http_conn> **pool = (threadpool<http_conn> **)arg; *pool; ++pool)
     {
-        printf("usage: %s port_number\n", basename(argv[0]));
-        return 1;
+        depth += (*pool)->queue_depth();
     }
+    return depth;
+}
 
-    // 获取端口号
-    int port = atoi(argv[1]); // 转换成整数
-    // 对SIGPIPE做信号处理
-    addsig(SIGPIPE, SIG_IGN);
-    // 创建线程池，初始化线程池，http_con为任务类
-    threadpool<http_conn> *pool = NULL;
-    try
+static long overloaded(void *)
+{
+    return http_conn::m_admission->overloaded() ? 1 : 0;
+}
+
+static long log_dropped(void *)
+{
+    return async_log::dropped();
+}
+
+// 第0个循环运行在主线程，其余的各自创建线程，全部结束后返回
+template <typename LOOP>
+int run_loops(LOOP **loops, int nloops)
+{
+    for (int i = 1; i < nloops; ++i)
     {
-        pool = new threadpool<http_conn>;
+        if (!loops[i]->start())
+        {
+            return 1;
+        }
     }
-    catch (...)
+    loops[0]->loop();
+    for (int i = 1; i < nloops; ++i)
     {
-        return 1;
+        loops[i]->join();
     }
-    // 创建一个数组用于保存所有的客户信息
-    http_conn *users = new http_conn[MAX_FD];
-    // 创建监听的套接字
-    int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-
-    int ret = 0;
-    struct sockaddr_in address;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_family = AF_INET;
-    address.sin_port = htons(port);
-
-    // 端口复用，在绑定之前设置
-    int reuse = 1;
-    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
-    // 绑定
-    ret = bind(listenfd, (struct sockaddr *)&address, sizeof(address));
-    // 监听
-    ret = listen(listenfd, 5);
-
-    // 创建epoll对象，和事件数组，添加监听的文件描述符
-    epoll_event events[MAX_EVENT_NUMBER]; // 最大监听的最大事件数量
-    // 创建epoll对象
-    int epollfd = epoll_create(5);
-    // 添加到epoll对象中
-    addfd(epollfd, listenfd, false);
-    http_conn::m_epollfd = epollfd;
+    return 0;
+}
 
-    while (true)
+int main(int argc, char *argv[])
+{
+    // 默认值 < 配置文件 < 命令行，取值不合法时不启动
+    server_config config;
+    std::string err;
+    if (!config.parse(argc, argv, err))
     {
-        // 主线程循环监测有无事件发生
-        int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
-
-        if ((number < 0) && (errno != EINTR))
+        if (err.empty())
         {
-            printf("epoll failure\n");
-            break;
+            server_config::usage(basename(argv[0]));
         }
-        // 循环遍历事件数
-        for (int i = 0; i < number; i++)
+        else
         {
-            // 监听到的文件描述符
-            int sockfd = events[i].data.fd;
-            // 有客户端连接
-            if (sockfd == listenfd)
-            {
+            printf("%s, run %s -h for the options\n", err.c_str(), basename(argv[0]));
+        }
+        return 1;
+    }
 
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-                int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
+    doc_root = config.doc_root.c_str();
+    http_conn::m_sendfile = strcasecmp(config.send_mode.c_str(), "mmap") != 0;
+    http_conn::m_metrics_url = (config.metrics_url == "off") ? NULL : config.metrics_url.c_str();
+    http_conn::m_idle_timeout = config.idle_timeout_ms;
+    http_conn::m_header_timeout = config.header_timeout_ms;
+    http_conn::m_body_timeout = config.body_timeout_ms;
+    http_conn::m_max_header_size = config.max_header_size;
+    http_conn::m_max_body_size = config.max_body_size;
+    http_conn::m_read_buffer_size = config.read_buffer_size;
+    http_conn::m_write_buffer_size = config.write_buffer_size;
+    eventloop::m_max_fd = config.max_fd;
+    eventloop::m_max_events = config.max_events;
+    eventloop::m_drain_timeout = config.drain_timeout_ms;
+    eventloop::m_tick_ms = config.timer_tick_ms;
+    // 退出和热升级的信号由控制线程接收，要在创建第一个线程(日志、线程池)之前屏蔽
+    server_control::init(argc, argv);
 
-                if (connfd < 0)
-                {
-                    printf("errno is: %d\n", errno);
-                    continue;
-                }
+    int port = config.port;
+    // 事件循环的数量，0表示单Reactor + 线程池，负数表示每个CPU核一个循环
+    int loop_number = (config.loops < 0) ? sysconf(_SC_NPROCESSORS_ONLN) : config.loops;
+    // 线程池请求队列的实现
+    threadpool<http_conn>::QUEUE_MODE queue_mode = threadpool<http_conn>::RING_QUEUE;
+    if (strcasecmp(config.queue_mode.c_str(), "list") == 0)
+    {
+        queue_mode = threadpool<http_conn>::LIST_QUEUE;
+    }
+    else if (strcasecmp(config.queue_mode.c_str(), "steal") == 0)
+    {
+        queue_mode = threadpool<http_conn>::STEAL_QUEUE;
+    }
+    // 静态文件缓存，只缓存不超过cache_file_kb的文件，更大的文件走sendfile/mmap
+    if (config.cache_mb > 0)
+    {
+        try
+        {
+            http_conn::m_cache = new file_cache(doc_root, (size_t)config.cache_mb << 20, (size_t)config.cache_file_kb << 10);
+        }
+        catch (...)
+        {
+            printf("create file cache failed, errno is: %d\n", errno);
+            return 1;
+        }
+    }
+    // I/O后端，io_uring模式下每个循环在本线程内处理请求
+    bool uring = strcasecmp(config.io_mode.c_str(), "uring") == 0;
+    // 日志由后台线程成批写入，工作线程和事件循环线程中只是写入本线程的环
+    const char *log_file = (config.log_file.empty() || config.log_file == "-") ? NULL : config.log_file.c_str();
+    const char *access_file = config.access_log.empty() ? NULL : config.access_log.c_str();
+    if (!async_log::start(log_file, access_file))
+    {
+        printf("open log file failed, errno is: %d\n", errno);
+        return 1;
+    }
+    add_gauge("webserver_connections", "Open client connections.", active_connections, NULL);
+    add_gauge("webserver_log_dropped", "Log lines dropped because a log ring was full.", log_dropped, NULL);
+    // 对SIGPIPE做信号处理
+    addsig(SIGPIPE, SIG_IGN);
+    // 每个事件循环拥有自己的监听socket和epoll对象(或io_uring实例)
+    // numa=1的线程池模式下每个NUMA节点一个事件循环和一个线程池，连接从accept到解析都留在同一个节点上
+    const cpu_topology &topology = cpu_topology::get();
+    bool pool_mode = (loop_number == 0 && !uring);
+    int nloops = (loop_number > 0) ? loop_number : ((pool_mode && config.numa) ? topology.node_count() : 1);
+    // 事件循环绑定的CPU，按列表依次分配，循环比CPU多时从头开始
+    std::vector<int> loop_cpus = config.cpu_list;
+    if (config.numa && pool_mode)
+    {
+        for (int i = 0; i < nloops; ++i)
+        {
+            loop_cpus.push_back(topology.node_cpus(i)[0]);
+        }
+    }
+    else if (config.numa)
+    {
+        loop_cpus = topology.interleaved();
+    }
 
-                if (http_conn::m_user_count >= MAX_FD) // 目前连接数满
-                {
-                    close(connfd); // 关闭连接
-                    // 目前连接满
-                    // 给客户端写一个信息：服务器正满
-                    continue;
-                }
-                // 将新的客户数据初始化，放到数组
-                users[connfd].init(connfd, client_address);
-            }
-            else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    // 创建线程池，初始化线程池，http_con为任务类，多Reactor模式下不需要线程池
+    threadpool<http_conn> **pools = NULL;
+    if (pool_mode)
+    {
+        pools = new threadpool<http_conn> *[nloops + 1]();
+        for (int i = 0; i < nloops; ++i)
+        {
+            // 线程数平均分到各个节点，线程绑定到本节点的CPU上
+            int threads = config.threads / nloops + (i < config.threads % nloops ? 1 : 0);
+            const std::vector<int> &worker_cpus = config.numa ? topology.node_cpus(i) : config.worker_cpu_list;
+            try
             {
-                // 对方异常断开或者错误等事件
-                users[sockfd].close_conn();
+                pools[i] = new threadpool<http_conn>(threads > 0 ? threads : 1, config.queue_size, queue_mode, worker_cpus);
             }
-            else if (events[i].events & EPOLLIN) // 是否有读的事件发生
+            catch (...)
             {
+                return 1;
+            }
+        }
+        // 请求排队超过target并持续interval视为过载，过载时以503拒绝排队太久的请求并暂停accept
+        http_conn::m_admission = new admission(config.admission_target_ms, config.admission_interval_ms);
+        add_gauge("webserver_queue_depth", "Requests waiting in the threadpool queue.", queue_depth, pools);
+        add_gauge("webserver_overloaded", "1 while the admission control sheds load.", overloaded, NULL);
+    }
+    // 文件描述符到连接对象的映射，连接对象由各个事件循环的对象池按需创建
+    http_conn **users = new http_conn *[config.max_fd]();
 
-                if (users[sockfd].read())
-                {                                 // 一次性把所有数据读完
-                    pool->append(users + sockfd); // 交给工作线程处理
-                }
-                else
-                { // 关闭连接
-                    users[sockfd].close_conn();
-                }
+    int *listenfds = new int[nloops];
+    // 热升级启动时沿用旧进程的监听socket，循环数比旧进程多时再创建，少时关闭多余的
+    int inherited[256];
+    int ninherited = server_control::inherit_listenfds(inherited, 256);
+    for (int i = nloops; i < ninherited; ++i)
+    {
+        close(inherited[i]);
+    }
+    eventloop **loops = uring ? NULL : new eventloop *[nloops];
+    uring_loop **rings = uring ? new uring_loop *[nloops] : NULL;
+    for (int i = 0; i < nloops; ++i)
+    {
+        int cpu = loop_cpus.empty() ? -1 : loop_cpus[i % loop_cpus.size()];
+        // 创建监听的套接字，多个循环时每个循环一个SO_REUSEPORT监听socket，并且优先接收绑定的CPU上收到的连接
+        if (i < ninherited)
+        {
+            listenfds[i] = inherited[i];
+            listen(listenfds[i], config.backlog);
+        }
+        else
+        {
+            listenfds[i] = create_listenfd(port, nloops > 1, config.backlog, config.defer_accept, nloops > 1 ? cpu : -1);
+        }
+        if (listenfds[i] < 0)
+        {
+            printf("listen on port %d failed, errno is: %d\n", port, errno);
+            return 1;
+        }
+        try
+        {
+            if (uring)
+            {
+                rings[i] = new uring_loop(listenfds[i]);
+                rings[i]->set_cpu(cpu);
             }
-            else if (events[i].events & EPOLLOUT)
+            else
             {
-
-                if (!users[sockfd].write()) // 写事件，一次性写完所有数据
-                {
-                    users[sockfd].close_conn(); // 关闭连接
-                }
+                loops[i] = new eventloop(listenfds[i], users, pools ? pools[i] : NULL);
+                loops[i]->set_cpu(cpu);
             }
         }
+        catch (...)
+        {
+            printf("create event loop failed, errno is: %d\n", errno);
+            return 1;
+        }
     }
 
-    close(epollfd);
-    close(listenfd);
+    if (!server_control::start(listenfds, nloops))
+    {
+        printf("create control thread failed, errno is: %d\n", errno);
+        return 1;
+    }
+    server_control::ready();
+
+    int ret = uring ? run_loops(rings, nloops) : run_loops(loops, nloops);
+
+    for (int i = 0; i < nloops; ++i)
+    {
+        if (uring)
+        {
+            delete rings[i];
+        }
+        else
+        {
+            delete loops[i];
+        }
+        close(listenfds[i]);
+    }
+    delete[] loops;
+    delete[] rings;
+    delete[] listenfds;
     delete[] users;
-    delete pool;
-    return 0;
-}
\ No newline at end of file
+    for (int i = 0; pools && i < nloops; ++i)
+    {
+        delete pools[i];
+    }
+    delete[] pools;
+    delete http_conn::m_admission;
+    delete http_conn::m_cache;
+    async_log::stop();
+    return ret;
+}
@@ -0,0 +1,195 @@
+#include "metrics.h"
+#include "locker.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <new>
+#include <vector>
+
+// 所有线程的指标块，线程退出后也保留，计数不会丢失
+static locker g_metrics_lock;
+static std::vector<thread_metrics *> g_metrics;
+
+struct gauge
+{
+    const char *name;
+    const char *help;
+    gauge_func fn;
+    void *arg;
+};
+static std::vector<gauge> g_gauges;
+
+static thread_local thread_metrics *t_metrics = NULL;
+
+int thread_metrics::status_index(int status)
+{
+    switch (status)
+    {
+    case 200:
+        return S_200;
+    case 206:
+        return S_206;
+    case 304:
+        return S_304;
+    case 400:
+        return S_400;
+    case 403:
+        return S_403;
+    case 404:
+        return S_404;
+    case 413:
+        return S_413;
+    case 416:
+        return S_416;
+    case 500:
+        return S_500;
+    case 503:
+        return S_503;
+    default:
+        return S_OTHER;
+    }
+}
+
+int thread_metrics::status_code(int index)
+{
+    static const int codes[STATUS_COUNT] = {200, 206, 304, 400, 403, 404, 413, 416, 500, 503, 0};
+    return codes[index];
+}
+
+thread_metrics *local_metrics()
+{
+    if (!t_metrics)
+    {
+        // 按缓存行对齐分配，new在C++11中不保证超过基本对齐的对齐要求
+        void *mem = NULL;
+        if (posix_memalign(&mem, CACHELINE_SIZE, sizeof(thread_metrics)) != 0)
+        {
+            abort();
+        }
+        t_metrics = new (mem) thread_metrics();
+        g_metrics_lock.lock();
+        g_metrics.push_back(t_metrics);
+        g_metrics_lock.unlock();
+    }
+    return t_metrics;
+}
+
+void add_gauge(const char *name, const char *help, gauge_func fn, void *arg)
+{
+    gauge g = {name, help, fn, arg};
+    g_metrics_lock.lock();
+    g_gauges.push_back(g);
+    g_metrics_lock.unlock();
+}
+
+static void append_format(std::string &out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void append_format(std::string &out, const char *format, ...)
+{
+    char buf[256];
+    va_list arg_list;
+    va_start(arg_list, format);
+    int len = vsnprintf(buf, sizeof(buf), format, arg_list);
+    va_end(arg_list);
+    if (len > 0)
+    {
+        out.append(buf, len < (int)sizeof(buf) ? len : (int)sizeof(buf) - 1);
+    }
+}
+
+static void render_counter(std::string &out, const char *name, const char *help, unsigned long value)
+{
+    append_format(out, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name, name, value);
+}
+
+// 把各线程的直方图逐桶相加后以累计计数输出，单位换算成秒
+static void render_histogram(std::string &out, const char *name, const char *help,
+                             latency_histogram thread_metrics::*member, const std::vector<thread_metrics *> &all)
+{
+    append_format(out, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    unsigned long cumulative = 0;
+    unsigned long sum = 0;
+    for (size_t t = 0; t < all.size(); ++t)
+    {
+        sum += (all[t]->*member).sum();
+    }
+    for (int i = 0; i < latency_histogram::BUCKETS; ++i)
+    {
+        for (size_t t = 0; t < all.size(); ++t)
+        {
+            cumulative += (all[t]->*member).count(i);
+        }
+        if (i == latency_histogram::BUCKETS - 1)
+        {
+            break;
+        }
+        append_format(out, "%s_bucket{le=\"%.6f\"} %lu\n", name, latency_histogram::upper_bound(i) / 1e6, cumulative);
+    }
+    append_format(out, "%s_bucket{le=\"+Inf\"} %lu\n%s_sum %.6f\n%s_count %lu\n", name, cumulative, name, sum / 1e6, name,
+                  cumulative);
+}
+
+void render_metrics(std::string &out)
+{
+    g_metrics_lock.lock();
+    std::vector<thread_metrics *> all(g_metrics);
+    std::vector<gauge> gauges(g_gauges);
+    g_metrics_lock.unlock();
+
+    unsigned long wakeups = 0, accepts = 0, rejected = 0, max_batch = 0, bytes = 0, parse_errors = 0, timeouts = 0;
+    unsigned long responses[thread_metrics::STATUS_COUNT] = {0};
+    for (size_t t = 0; t < all.size(); ++t)
+    {
+        const thread_metrics *m = all[t];
+        wakeups += m->accept_wakeups.get();
+        accepts += m->accepts.get();
+        rejected += m->accept_rejected.get();
+        if (m->accept_max_batch.get() > max_batch)
+        {
+            max_batch = m->accept_max_batch.get();
+        }
+        bytes += m->bytes_sent.get();
+        parse_errors += m->parse_errors.get();
+        timeouts += m->timeouts.get();
+        for (int i = 0; i < thread_metrics::STATUS_COUNT; ++i)
+        {
+            responses[i] += m->responses[i].get();
+        }
+    }
+
+    render_counter(out, "webserver_accept_wakeups_total", "Wakeups of the listening sockets.", wakeups);
+    render_counter(out, "webserver_accepts_total", "Connections returned by accept.", accepts);
+    render_counter(out, "webserver_accept_rejected_total", "Connections answered with 503 because the server was full.",
+                   rejected);
+    append_format(out, "# HELP webserver_accept_max_batch Most connections accepted in one wakeup.\n"
+                       "# TYPE webserver_accept_max_batch gauge\nwebserver_accept_max_batch %lu\n",
+                  max_batch);
+    out += "# HELP webserver_responses_total Responses by status code.\n# TYPE webserver_responses_total counter\n";
+    for (int i = 0; i < thread_metrics::STATUS_COUNT; ++i)
+    {
+        int code = thread_metrics::status_code(i);
+        if (code)
+        {
+            append_format(out, "webserver_responses_total{code=\"%d\"} %lu\n", code, responses[i]);
+        }
+        else
+        {
+            append_format(out, "webserver_responses_total{code=\"other\"} %lu\n", responses[i]);
+        }
+    }
+    render_counter(out, "webserver_bytes_sent_total", "Bytes sent to clients.", bytes);
+    render_counter(out, "webserver_parse_errors_total", "Malformed requests.", parse_errors);
+    render_counter(out, "webserver_timeouts_total", "Connections closed by a timeout.", timeouts);
+    render_histogram(out, "webserver_queue_wait_seconds", "Time requests wait in the threadpool queue.",
+                     &thread_metrics::queue_wait, all);
+    render_histogram(out, "webserver_parse_seconds", "Time to parse a request and build its response.",
+                     &thread_metrics::parse, all);
+    render_histogram(out, "webserver_time_to_last_byte_seconds",
+                     "Time from the first byte of a request to the last byte of its response.", &thread_metrics::ttlb,
+                     all);
+    for (size_t i = 0; i < gauges.size(); ++i)
+    {
+        append_format(out, "# HELP %s %s\n# TYPE %s gauge\n%s %ld\n", gauges[i].name, gauges[i].help, gauges[i].name,
+                      gauges[i].name, gauges[i].fn(gauges[i].arg));
+    }
+}
@@ -0,0 +1,142 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <string>
+#include <time.h>
+#include "lockfree_queue.h"
+
+/*
+    内置监控指标
+    每个线程（事件循环线程、工作线程）第一次记录时分配一块自己的指标，按缓存行对齐，只有本线程写入：
+    写入只是一次普通的读和写，没有锁，也没有原子的读改写指令，不同线程的指标不在同一个缓存行上；
+    读取时（访问监控URL）把所有线程的指标加在一起，以Prometheus文本格式输出
+*/
+
+// 单调时钟的当前时间(微秒)，延迟统计和准入控制使用
+inline unsigned long monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// 只由一个线程写入、任何线程都可以读取的计数器
+class local_counter
+{
+public:
+    local_counter() : m_value(0) {}
+    void add(unsigned long n = 1) { m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void max(unsigned long n) // 记录最大值
+    {
+        if (n > m_value.load(std::memory_order_relaxed))
+        {
+            m_value.store(n, std::memory_order_relaxed);
+        }
+    }
+    unsigned long get() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<unsigned long> m_value;
+};
+
+/*
+    HDR风格的延迟直方图，单位微秒
+    值按最高位分组，每组(2的幂区间)再等分为SUB个子桶，相对误差不超过1/SUB，记录是O(1)的位运算
+    超过上限(约134秒)的值记在最后一个桶中
+*/
+class latency_histogram
+{
+public:
+    static const int SUB_BITS = 2;
+    static const int SUB = 1 << SUB_BITS;
+    static const int MAX_BITS = 27;                             // 最大可区分的值为2^27微秒
+    static const int BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB; // 第0组是0 ~ SUB-1的精确值
+
+    void record(unsigned long us)
+    {
+        m_counts[bucket(us)].add();
+        m_sum.add(us);
+    }
+
+    static int bucket(unsigned long us)
+    {
+        if (us < (unsigned long)SUB)
+        {
+            return us;
+        }
+        int msb = 63 - __builtin_clzl(us);
+        if (msb >= MAX_BITS)
+        {
+            return BUCKETS - 1;
+        }
+        int shift = msb - SUB_BITS;
+        return ((shift + 1) << SUB_BITS) | ((us >> shift) & (SUB - 1));
+    }
+
+    // 第i个桶中最大的值，即Prometheus的le
+    static unsigned long upper_bound(int i)
+    {
+        int group = i >> SUB_BITS;
+        unsigned long sub = i & (SUB - 1);
+        if (group == 0)
+        {
+            return sub;
+        }
+        return ((SUB + sub + 1) << (group - 1)) - 1;
+    }
+
+    unsigned long count(int i) const { return m_counts[i].get(); }
+    unsigned long sum() const { return m_sum.get(); }
+
+private:
+    local_counter m_counts[BUCKETS];
+    local_counter m_sum;
+};
+
+// 一个线程的所有指标
+struct thread_metrics
+{
+    // 统计的响应状态码，其他状态码计入最后一项
+    enum STATUS
+    {
+        S_200 = 0,
+        S_206,
+        S_304,
+        S_400,
+        S_403,
+        S_404,
+        S_413,
+        S_416,
+        S_500,
+        S_503,
+        S_OTHER,
+        STATUS_COUNT
+    };
+    static int status_index(int status);
+    static int status_code(int index); // S_OTHER返回0
+
+    local_counter accept_wakeups;   // 监听socket可读(或收到accept完成事件)的轮数
+    local_counter accepts;          // accept返回的连接数(含rejected)，除以accept_wakeups即平均每次唤醒接受的连接数
+    local_counter accept_rejected;  // 因为连接数已满回复503后关闭的连接数
+    local_counter accept_max_batch; // 一次唤醒接受的最多连接数
+    local_counter responses[STATUS_COUNT]; // 按状态码统计的响应数
+    local_counter bytes_sent;       // 发送的字节数
+    local_counter parse_errors;     // 请求语法错误的次数
+    local_counter timeouts;         // 超时关闭的连接数
+    latency_histogram queue_wait;   // 请求在线程池队列中等待的时间
+    latency_histogram parse;        // 解析一个请求(从开始解析到生成响应)的时间
+    latency_histogram ttlb;         // 从请求的第一批数据到达到最后一个字节发出的时间(time to last byte)
+} __attribute__((aligned(CACHELINE_SIZE)));
+
+// 当前线程的指标，第一次调用时分配并登记
+thread_metrics *local_metrics();
+
+// 读取时计算的指标，比如连接数、队列长度，fn在访问监控URL的线程中调用
+typedef long (*gauge_func)(void *arg);
+void add_gauge(const char *name, const char *help, gauge_func fn, void *arg);
+
+// 汇总所有线程的指标，以Prometheus文本格式追加到out
+void render_metrics(std::string &out);
+
+#endif
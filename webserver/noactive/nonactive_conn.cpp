@@ -12,14 +12,25 @@
 #include <stdlib.h>
 #include <sys/epoll.h>
 #include <pthread.h>
-#include "lst_timer.h"
+#include "../time_wheel.h"
 
 #define FD_LIMIT 65535
 #define MAX_EVENT_NUMBER 1024
 #define TIMESLOT 5
+#define BUFFER_SIZE 64
+
+// 用户数据结构
+struct client_data
+{
+    sockaddr_in address;            // 客户端socket地址
+    int sockfd;                     // socket文件描述符
+    char buf[ BUFFER_SIZE ];        // 读缓存
+    tw_timer<client_data> timer;    // 定时器，嵌入在用户数据中，不需要单独分配
+};
 
 static int pipefd[2];
-static sort_timer_lst timer_lst;
+// 时间轮的精度为1秒，添加、刷新、删除定时器都是O(1)
+static time_wheel<client_data> timer_lst( 1000 );
 static int epollfd = 0;
 
 int setnonblocking( int fd )
@@ -98,7 +109,7 @@ int main( int argc, char* argv[] ) {
     assert( ret != -1 );
 
     epoll_event events[ MAX_EVENT_NUMBER ];
-    int epollfd = epoll_create( 5 );
+    epollfd = epoll_create( 5 );
     assert( epollfd != -1 );
     addfd( epollfd, listenfd );
 
@@ -136,14 +147,11 @@ int main( int argc, char* argv[] ) {
                 users[connfd].address = client_address;
                 users[connfd].sockfd = connfd;
                 
-                // 创建定时器，设置其回调函数与超时时间，然后绑定定时器与用户数据，最后将定时器添加到链表timer_lst中
-                util_timer* timer = new util_timer;
+                // 设置定时器的回调函数，绑定定时器与用户数据，然后将定时器添加到时间轮timer_lst中
+                tw_timer<client_data>* timer = &users[connfd].timer;
                 timer->user_data = &users[connfd];
                 timer->cb_func = cb_func;
-                time_t cur = time( NULL );
-                timer->expire = cur + 3 * TIMESLOT;
-                users[connfd].timer = timer;
-                timer_lst.add_timer( timer );
+                timer_lst.add_timer( timer, 3 * TIMESLOT * 1000 );
             } else if( ( sockfd == pipefd[0] ) && ( events[i].events & EPOLLIN ) ) {
                 // 处理信号
                 int sig;
@@ -176,37 +184,27 @@ int main( int argc, char* argv[] ) {
                 memset( users[sockfd].buf, '\0', BUFFER_SIZE );
                 ret = recv( sockfd, users[sockfd].buf, BUFFER_SIZE-1, 0 );
                 printf( "get %d bytes of client data %s from %d\n", ret, users[sockfd].buf, sockfd );
-                util_timer* timer = users[sockfd].timer;
+                tw_timer<client_data>* timer = &users[sockfd].timer;
                 if( ret < 0 )
                 {
                     // 如果发生读错误，则关闭连接，并移除其对应的定时器
                     if( errno != EAGAIN )
                     {
                         cb_func( &users[sockfd] );
-                        if( timer )
-                        {
-                            timer_lst.del_timer( timer );
-                        }
+                        timer_lst.del_timer( timer );
                     }
                 }
                 else if( ret == 0 )
                 {
                     // 如果对方已经关闭连接，则我们也关闭连接，并移除对应的定时器。
                     cb_func( &users[sockfd] );
-                    if( timer )
-                    {
-                        timer_lst.del_timer( timer );
-                    }
+                    timer_lst.del_timer( timer );
                 }
                 else
                 {
                     // 如果某个客户端上有数据可读，则我们要调整该连接对应的定时器，以延迟该连接被关闭的时间。
-                    if( timer ) {
-                        time_t cur = time( NULL );
-                        timer->expire = cur + 3 * TIMESLOT;
-                        printf( "adjust timer once\n" );
-                        timer_lst.adjust_timer( timer );
-                    }
+                    printf( "adjust timer once\n" );
+                    timer_lst.adjust_timer( timer, 3 * TIMESLOT * 1000 );
                 }
             }
            
@@ -0,0 +1,166 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdlib.h>
+#include <vector>
+
+/*
+    按大小分级的缓冲区池，每个事件循环一个，只在本循环的线程中使用，不需要加锁
+    每一级的块大小为 MIN_BLOCK << i，块从SLAB_SIZE大小的slab中切出，
+    释放的块挂在本级的空闲链表上供下次分配，slab直到池销毁才归还给系统
+    连接只在有请求正在处理时持有缓冲区，空闲的长连接不占用缓冲区内存
+*/
+class buffer_pool
+{
+public:
+    static const size_t MIN_BLOCK = 1024;      // 最小一级的块大小
+    static const int CLASSES = 6;              // 1KB ~ 32KB
+    static const size_t MAX_BLOCK = MIN_BLOCK << (CLASSES - 1); // 最大一级的块大小
+    static const size_t SLAB_SIZE = 64 * 1024; // 每次向系统申请的大小
+
+    buffer_pool()
+    {
+        for (int i = 0; i < CLASSES; ++i)
+        {
+            m_free[i] = NULL;
+        }
+    }
+    ~buffer_pool()
+    {
+        for (size_t i = 0; i < m_slabs.size(); ++i)
+        {
+            free(m_slabs[i]);
+        }
+    }
+
+    // 分配至少size字节的缓冲区，size超过最大一级时返回NULL
+    char *alloc(size_t size)
+    {
+        int c = size_class(size);
+        if (c < 0)
+        {
+            return NULL;
+        }
+        if (!m_free[c] && !refill(c))
+        {
+            return NULL;
+        }
+        free_block *block = m_free[c];
+        m_free[c] = block->next;
+        return (char *)block;
+    }
+
+    // 归还缓冲区，size必须与分配时相同
+    void release(char *buf, size_t size)
+    {
+        int c = size_class(size);
+        if (!buf || c < 0)
+        {
+            return;
+        }
+        free_block *block = (free_block *)buf;
+        block->next = m_free[c];
+        m_free[c] = block;
+    }
+
+private:
+    struct free_block
+    {
+        free_block *next;
+    };
+
+    static int size_class(size_t size)
+    {
+        for (int c = 0; c < CLASSES; ++c)
+        {
+            if (size <= (MIN_BLOCK << c))
+            {
+                return c;
+            }
+        }
+        return -1;
+    }
+
+    // 申请一个新的slab，切成第c级的块放入空闲链表
+    bool refill(int c)
+    {
+        char *slab = (char *)malloc(SLAB_SIZE);
+        if (!slab)
+        {
+            return false;
+        }
+        m_slabs.push_back(slab);
+        size_t block_size = MIN_BLOCK << c;
+        for (size_t off = 0; off + block_size <= SLAB_SIZE; off += block_size)
+        {
+            free_block *block = (free_block *)(slab + off);
+            block->next = m_free[c];
+            m_free[c] = block;
+        }
+        return true;
+    }
+
+private:
+    free_block *m_free[CLASSES]; // 每一级的空闲链表
+    std::vector<char *> m_slabs; // 所有申请过的slab
+};
+
+/*
+    对象池，按CHUNK个一批创建对象，释放的对象放回空闲表重复使用，不会析构
+    同样只在一个线程中使用
+*/
+template <typename T>
+class object_pool
+{
+public:
+    static const int CHUNK = 64;
+
+    object_pool() {}
+    ~object_pool()
+    {
+        for (size_t i = 0; i < m_chunks.size(); ++i)
+        {
+            delete[] m_chunks[i];
+        }
+    }
+
+    T *alloc()
+    {
+        if (m_free.empty())
+        {
+            T *chunk = new T[CHUNK];
+            m_chunks.push_back(chunk);
+            for (int i = CHUNK - 1; i >= 0; --i)
+            {
+                m_free.push_back(chunk + i);
+            }
+        }
+        T *obj = m_free.back();
+        m_free.pop_back();
+        return obj;
+    }
+
+    void release(T *obj)
+    {
+        m_free.push_back(obj);
+    }
+
+    // 依次访问创建过的所有对象，包括空闲的，由调用者区分；fn中可以release对象
+    template <typename F>
+    void for_each(F fn)
+    {
+        for (size_t i = 0; i < m_chunks.size(); ++i)
+        {
+            for (int j = 0; j < CHUNK; ++j)
+            {
+                fn(m_chunks[i] + j);
+            }
+        }
+    }
+
+private:
+    std::vector<T *> m_chunks; // 所有创建过的对象块
+    std::vector<T *> m_free;   // 空闲的对象
+};
+
+#endif
@@ -0,0 +1,449 @@
+/*
+    HTTP解析与响应生成的微基准测试，不经过socket，在进程内直接驱动http_conn的各个阶段
+    每个用例把一段请求数据拷入读缓冲区后，分别运行到以下阶段为止：
+        parse_line          把所有行切分出来
+        parse_request_line  再解析每个请求的请求行
+        parse_headers       再解析头部字段
+        process_read        完整的主状态机，包括do_request查找文件(默认命中文件缓存，不需要系统调用)
+        process_write       再生成响应并结束本批，与process()中流水线的处理方式相同
+    每一行输出：
+        ns/req      到该阶段为止每个请求的耗时，已减去拷贝数据的时间
+        own         该阶段自身的耗时，即与上一阶段的差
+        bytes/cycle 请求字节数除以到该阶段为止的CPU周期数(perf_event不可用时用TSC周期)
+        allocs/req  到该阶段为止每个请求的堆分配次数
+    用例包括最短的GET、curl和浏览器的典型头部、16个流水线请求，以及几种错误的请求；
+    错误的请求在第一处错误停止解析，后面的阶段可能比只切分行的parse_line还快
+
+    编译: g++ -O2 -std=c++11 http_bench.cpp ../http_conn.cpp ../http_response.cpp ../http_scan.cpp ../file_cache.cpp
+              ../metrics.cpp ../log.cpp -pthread -o http_bench
+    运行: ./http_bench [每个阶段的最短运行毫秒数] [用例名]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "../http_conn.h"
+
+extern const char *doc_root;
+
+// 统计堆分配次数：替换malloc一族，转发给glibc的实现
+static std::atomic<unsigned long> g_allocs(0);
+
+extern "C"
+{
+    void *__libc_malloc(size_t size);
+    void *__libc_calloc(size_t n, size_t size);
+    void *__libc_realloc(void *ptr, size_t size);
+
+    void *malloc(size_t size)
+    {
+        g_allocs.fetch_add(1, std::memory_order_relaxed);
+        return __libc_malloc(size);
+    }
+    void *calloc(size_t n, size_t size)
+    {
+        g_allocs.fetch_add(1, std::memory_order_relaxed);
+        return __libc_calloc(n, size);
+    }
+    void *realloc(void *ptr, size_t size)
+    {
+        g_allocs.fetch_add(1, std::memory_order_relaxed);
+        return __libc_realloc(ptr, size);
+    }
+}
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// 用户态CPU周期计数器，打开失败时退回TSC
+class cycle_counter
+{
+public:
+    cycle_counter() : m_fd(-1)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~cycle_counter()
+    {
+        if (m_fd >= 0)
+        {
+            close(m_fd);
+        }
+    }
+
+    const char *source() const { return m_fd >= 0 ? "perf cycles" : "TSC"; }
+
+    unsigned long read_cycles() const
+    {
+        if (m_fd >= 0)
+        {
+            unsigned long value = 0;
+            if (::read(m_fd, &value, sizeof(value)) == sizeof(value))
+            {
+                return value;
+            }
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return 0;
+#endif
+    }
+
+private:
+    int m_fd;
+};
+
+struct bench_case
+{
+    const char *name;
+    std::string data; // 一段或多段完整的请求
+    int requests;     // 其中的请求数
+};
+
+// 测量的阶段，每个阶段包含之前的所有阶段
+enum STAGE
+{
+    STAGE_COPY = 0,
+    STAGE_PARSE_LINE,
+    STAGE_REQUEST_LINE,
+    STAGE_HEADERS,
+    STAGE_PROCESS_READ,
+    STAGE_PROCESS_WRITE,
+    STAGE_COUNT
+};
+
+static const char *stage_names[] = {"copy", "parse_line", "parse_request_line", "parse_headers", "process_read",
+                                    "process_write"};
+
+// http_conn的友元，可以调用私有的解析函数
+class http_bench
+{
+public:
+    http_bench() : m_pool()
+    {
+        sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        m_conn.init(-1, addr, -1);
+        m_conn.attach_buffers(&m_pool);
+    }
+    ~http_bench()
+    {
+        m_conn.release_file();
+        m_conn.release_buffers(&m_pool);
+    }
+
+    // 运行一次，返回处理的请求数(错误的请求之后的数据不再处理)
+    int run(STAGE stage, const bench_case &c)
+    {
+        http_conn &h = m_conn;
+        h.init();
+        h.feed(c.data.data(), c.data.size());
+        switch (stage)
+        {
+        case STAGE_COPY:
+            return c.requests;
+        case STAGE_PARSE_LINE:
+            while (h.parse_line() == http_conn::LINE_OK)
+            {
+                h.m_start_line = h.m_checked_idx;
+            }
+            return c.requests;
+        case STAGE_REQUEST_LINE:
+        case STAGE_HEADERS:
+            return parse_lines(stage == STAGE_HEADERS);
+        case STAGE_PROCESS_READ:
+        case STAGE_PROCESS_WRITE:
+            return process(stage == STAGE_PROCESS_WRITE, c.requests);
+        default:
+            return 0;
+        }
+    }
+
+private:
+    // 逐行解析，headers为false时头部只切分不解析
+    int parse_lines(bool headers)
+    {
+        http_conn &h = m_conn;
+        int done = 0;
+        http_conn::LINE_STATUS status;
+        while ((status = h.parse_line()) == http_conn::LINE_OK)
+        {
+            char *text = h.get_line();
+            int len = h.m_checked_idx - h.m_start_line - 2;
+            h.m_start_line = h.m_checked_idx;
+            if (h.m_check_state == http_conn::CHECK_STATE_REQUESTLINE)
+            {
+                if (h.parse_request_line(text, len) == http_conn::BAD_REQUEST)
+                {
+                    return done + 1;
+                }
+            }
+            else if (len == 0 || headers)
+            {
+                http_conn::HTTP_CODE ret = len == 0 && !headers ? http_conn::GET_REQUEST : h.parse_headers(text, len);
+                if (ret == http_conn::GET_REQUEST)
+                {
+                    ++done;
+                    h.init_request();
+                }
+                else if (ret != http_conn::NO_REQUEST)
+                {
+                    return done + 1;
+                }
+            }
+        }
+        // 与process_read一样，行尾错误的请求也算作一个被拒绝的请求
+        return status == http_conn::LINE_BAD ? done + 1 : done;
+    }
+
+    // 与http_conn::process()相同的流水线处理，write为false时只解析不生成响应
+    int process(bool write, int requests)
+    {
+        http_conn &h = m_conn;
+        int done = 0;
+        while (done < requests)
+        {
+            http_conn::HTTP_CODE ret = h.process_read();
+            if (ret == http_conn::NO_REQUEST)
+            {
+                break;
+            }
+            ++done;
+            bool linger = h.m_linger && ret != http_conn::BAD_REQUEST && ret != http_conn::PAYLOAD_TOO_LARGE;
+            if (write)
+            {
+                h.process_write(ret);
+                ++h.m_response_count;
+            }
+            else
+            {
+                h.release_file();
+            }
+            h.init_request();
+            if (!linger)
+            {
+                break;
+            }
+        }
+        if (write)
+        {
+            h.finish_batch();
+        }
+        return done;
+    }
+
+    buffer_pool m_pool;
+    http_conn m_conn;
+};
+
+struct result
+{
+    double ns;      // 每个请求的纳秒数
+    double cycles;  // 每个请求的周期数
+    double allocs;  // 每个请求的分配次数
+};
+
+// 运行ROUNDS轮，每轮至少min_ns / ROUNDS纳秒，取最快的一轮，减少其他进程和中断的干扰
+static const int ROUNDS = 5;
+
+static result measure(http_bench &bench, STAGE stage, const bench_case &c, const cycle_counter &counter,
+                      unsigned long min_ns)
+{
+    // 预热，同时让文件缓存装入文件
+    for (int i = 0; i < 1000; ++i)
+    {
+        bench.run(stage, c);
+    }
+    result best;
+    best.ns = -1;
+    for (int round = 0; round < ROUNDS; ++round)
+    {
+        // 按用例中的请求数平均，错误的请求提前结束时也是如此，各阶段之间可以相减
+        unsigned long requests = 0;
+        unsigned long allocs = g_allocs.load(std::memory_order_relaxed);
+        unsigned long cycles = counter.read_cycles();
+        unsigned long start = now_ns(), elapsed = 0;
+        while (elapsed < min_ns / ROUNDS)
+        {
+            for (int i = 0; i < 1000; ++i)
+            {
+                bench.run(stage, c);
+                requests += c.requests;
+            }
+            elapsed = now_ns() - start;
+        }
+        result r;
+        r.cycles = (double)(counter.read_cycles() - cycles) / requests;
+        r.allocs = (double)(g_allocs.load(std::memory_order_relaxed) - allocs) / requests;
+        r.ns = (double)elapsed / requests;
+        if (best.ns < 0 || r.ns < best.ns)
+        {
+            best = r;
+        }
+    }
+    return best;
+}
+
+static void write_file(const std::string &path, size_t size)
+{
+    FILE *fp = fopen(path.c_str(), "w");
+    if (fp)
+    {
+        std::string content(size, 'x');
+        fwrite(content.data(), 1, content.size(), fp);
+        fclose(fp);
+    }
+}
+
+static std::vector<bench_case> make_corpus()
+{
+    const std::string browser =
+        "GET /index.html HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+        "sec-ch-ua-mobile: ?0\r\n"
+        "sec-ch-ua-platform: \"Linux\"\r\n"
+        "Upgrade-Insecure-Requests: 1\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 "
+        "Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8,"
+        "application/signed-exchange;v=b3;q=0.7\r\n"
+        "Sec-Fetch-Site: none\r\n"
+        "Sec-Fetch-Mode: navigate\r\n"
+        "Sec-Fetch-User: ?1\r\n"
+        "Sec-Fetch-Dest: document\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Accept-Language: en-US,en;q=0.9,zh-CN;q=0.8,zh;q=0.7\r\n"
+        "Cookie: session=6f1c2a9e0b7d4e3f8a5c1d2e3f4a5b6c; theme=dark; _ga=GA1.1.123456789.1700000000\r\n"
+        "\r\n";
+    const std::string asset =
+        "GET /images/image1.jpg HTTP/1.1\r\n"
+        "Host: www.example.com\r\n"
+        "Connection: keep-alive\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/124.0.0.0 "
+        "Safari/537.36\r\n"
+        "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+        "Referer: http://www.example.com/index.html\r\n"
+        "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+        "Accept-Language: en-US,en;q=0.9\r\n"
+        "\r\n";
+    std::vector<bench_case> corpus;
+    bench_case c;
+    c.requests = 1;
+    c.name = "tiny";
+    c.data = "GET /a HTTP/1.1\r\nHost: x\r\n\r\n";
+    corpus.push_back(c);
+    c.name = "curl";
+    c.data = "GET /index.html HTTP/1.1\r\nHost: localhost:9006\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n";
+    corpus.push_back(c);
+    c.name = "browser";
+    c.data = browser;
+    corpus.push_back(c);
+    c.name = "pipelined16";
+    c.data.clear();
+    for (int i = 0; i < 16; ++i)
+    {
+        c.data += (i % 4 == 0) ? browser : asset;
+    }
+    c.requests = 16;
+    corpus.push_back(c);
+    c.requests = 1;
+    c.name = "not_found";
+    c.data = "GET /missing.html HTTP/1.1\r\nHost: x\r\nConnection: keep-alive\r\n\r\n";
+    corpus.push_back(c);
+    c.name = "bad_method";
+    c.data = "BREW /pot HTTP/1.1\r\nHost: x\r\n\r\n";
+    corpus.push_back(c);
+    c.name = "http10";
+    c.data = "GET /index.html HTTP/1.0\r\nHost: x\r\n\r\n";
+    corpus.push_back(c);
+    c.name = "no_version";
+    c.data = "GET /index.html\r\nHost: x\r\n\r\n";
+    corpus.push_back(c);
+    c.name = "bare_lf";
+    c.data = "GET /index.html HTTP/1.1\nHost: x\n\n";
+    corpus.push_back(c);
+    return corpus;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long min_ns = (argc > 1 ? atol(argv[1]) : 200) * 1000000UL;
+    const char *only = argc > 2 ? argv[2] : NULL;
+
+    // 临时的网站根目录，文件全部进入缓存
+    char root[] = "/tmp/http_bench.XXXXXX";
+    if (!mkdtemp(root))
+    {
+        printf("mkdtemp failed\n");
+        return 1;
+    }
+    std::string dir = root;
+    mkdir((dir + "/images").c_str(), 0755);
+    write_file(dir + "/a", 16);
+    write_file(dir + "/index.html", 350);
+    write_file(dir + "/images/image1.jpg", 67313);
+    doc_root = root;
+    http_conn::m_cache = new file_cache(root, 64 << 20, 1 << 20);
+    http_conn::m_read_buffer_size = buffer_pool::MAX_BLOCK; // 放得下流水线用例
+    http_conn::m_write_buffer_size = 8192;
+
+    cycle_counter counter;
+    std::vector<bench_case> corpus = make_corpus();
+    printf("min %lu ms per stage, bytes/cycle from %s\n", min_ns / 1000000, counter.source());
+    printf("%-12s %6s %5s  %-18s %10s %10s %12s %11s\n", "case", "bytes", "reqs", "stage", "ns/req", "own", "bytes/cycle",
+           "allocs/req");
+    {
+        http_bench bench;
+        for (size_t i = 0; i < corpus.size(); ++i)
+        {
+            const bench_case &c = corpus[i];
+            if (only && strcmp(only, c.name) != 0)
+            {
+                continue;
+            }
+            result base = measure(bench, STAGE_COPY, c, counter, min_ns);
+            double prev = 0;
+            for (int s = STAGE_PARSE_LINE; s < STAGE_COUNT; ++s)
+            {
+                result r = measure(bench, (STAGE)s, c, counter, min_ns);
+                double ns = r.ns - base.ns;
+                double cycles = r.cycles - base.cycles;
+                printf("%-12s %6zu %5d  %-18s %10.1f %10.1f %12.2f %11.2f\n", c.name, c.data.size(), c.requests,
+                       stage_names[s], ns, ns - prev, cycles > 0 ? c.data.size() / (double)c.requests / cycles : 0.0,
+                       r.allocs - base.allocs);
+                prev = ns;
+            }
+        }
+    }
+
+    delete http_conn::m_cache;
+    unlink((dir + "/a").c_str());
+    unlink((dir + "/index.html").c_str());
+    unlink((dir + "/images/image1.jpg").c_str());
+    rmdir((dir + "/images").c_str());
+    rmdir(root);
+    return 0;
+}
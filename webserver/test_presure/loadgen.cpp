@@ -0,0 +1,975 @@
+/*
+    HTTP/1.1压测工具，用来代替webbench
+    每个线程一个epoll，负责一部分连接；连接默认keep-alive，每个连接上同时有pipeline个请求在途(流水线)，
+    一个响应收完就在同一个连接上发出下一个请求(闭环)；-K时每个请求新建一个连接
+    -R指定速率时改为开环：请求按固定的时间表发出，与响应快慢无关，没有空闲连接时请求在本地排队，
+    延迟从请求本应发出的时间算起(修正coordinated omission：闭环模式下服务器变慢时客户端也跟着少发请求，
+    排队的时间不会出现在延迟里)。-R给出多个速率(1000,2000或1000:20000:1000)时依次压测，
+    每个速率输出一行吞吐与延迟，可以保存下来与其他版本的结果diff，最后给出还能跟上目标速率的最高速率
+    请求的URL按权重从文件中随机选取，文件每行"权重 路径"，#之后是注释：
+        10 /index.html
+        1  /images/image1.jpg
+    延迟从发出请求算到收完响应，用对数分桶的直方图记录(相对误差约0.2%)，结束时输出p50/p90/p99/p99.9和按状态码分类的计数
+
+    编译: g++ -O2 -std=c++11 loadgen.cpp -pthread -o loadgen
+    运行: ./loadgen [-c 连接数] [-t 线程数] [-d 秒数] [-w 预热秒数] [-p 流水线深度] [-u URL文件] [-T 超时秒数] [-K]
+                    [-R 速率列表] 主机:端口
+    例如: ./loadgen -c 10000 -t 4 -d 30 -p 4 -u urls.txt 127.0.0.1:9006
+          ./loadgen -c 1000 -d 10 -w 2 -R 5000:50000:5000 127.0.0.1:9006 > curve.txt
+    上万个连接时需要足够的文件描述符(ulimit -n，程序会尝试调高)和本地端口(net.ipv4.ip_local_port_range)
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#ifndef SYS_epoll_pwait2
+#define SYS_epoll_pwait2 441
+#endif
+
+static unsigned long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+// 纳秒精度的epoll_wait，开环模式下按时间表发请求需要比毫秒更细的超时；内核不支持时退回epoll_wait
+static int wait_events(int epfd, struct epoll_event *events, int max, unsigned long timeout_ns)
+{
+    static bool has_pwait2 = true;
+    if (has_pwait2)
+    {
+        struct timespec ts;
+        ts.tv_sec = timeout_ns / 1000000000UL;
+        ts.tv_nsec = timeout_ns % 1000000000UL;
+        int n = syscall(SYS_epoll_pwait2, epfd, events, max, &ts, NULL, 0);
+        if (n >= 0 || errno != ENOSYS)
+        {
+            return n;
+        }
+        has_pwait2 = false;
+    }
+    return epoll_wait(epfd, events, max, (timeout_ns + 999999) / 1000000);
+}
+
+// 对数分桶的延迟直方图，单位微秒：小于1024的值各占一个桶，之后每翻一倍分成512个桶
+struct histogram
+{
+    static const int LINEAR = 1024;
+    static const int SUB = 512;
+    static const int BUCKETS = LINEAR + 40 * SUB;
+
+    std::vector<unsigned long> counts;
+    unsigned long total;
+    unsigned long max;
+    double sum;
+
+    histogram() : counts(BUCKETS, 0), total(0), max(0), sum(0) {}
+
+    static int index(unsigned long us)
+    {
+        if (us < (unsigned long)LINEAR)
+        {
+            return us;
+        }
+        int shift = (63 - __builtin_clzl(us)) - 9; // us >> shift 落在[512, 1024)
+        int idx = LINEAR + (shift - 1) * SUB + (int)((us >> shift) - SUB);
+        return idx < BUCKETS ? idx : BUCKETS - 1;
+    }
+
+    // 桶中值的中点
+    static unsigned long value(int idx)
+    {
+        if (idx < LINEAR)
+        {
+            return idx;
+        }
+        int shift = (idx - LINEAR) / SUB + 1;
+        unsigned long low = (unsigned long)((idx - LINEAR) % SUB + SUB) << shift;
+        return low + (1UL << shift) / 2;
+    }
+
+    void add(unsigned long us)
+    {
+        ++counts[index(us)];
+        ++total;
+        sum += us;
+        if (us > max)
+        {
+            max = us;
+        }
+    }
+
+    void merge(const histogram &other)
+    {
+        for (int i = 0; i < BUCKETS; ++i)
+        {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+        sum += other.sum;
+        if (other.max > max)
+        {
+            max = other.max;
+        }
+    }
+
+    unsigned long percentile(double p) const
+    {
+        if (total == 0)
+        {
+            return 0;
+        }
+        unsigned long rank = (unsigned long)(p / 100.0 * total + 0.5);
+        if (rank < 1)
+        {
+            rank = 1;
+        }
+        unsigned long seen = 0;
+        for (int i = 0; i < BUCKETS; ++i)
+        {
+            seen += counts[i];
+            if (seen >= rank)
+            {
+                unsigned long v = value(i);
+                return v < max ? v : max;
+            }
+        }
+        return max;
+    }
+};
+
+// 压测参数，所有线程共享，只读
+struct options
+{
+    int connections;
+    int threads;
+    int duration;
+    int warmup;      // 开始后这么多秒内发出的请求不计入统计
+    int pipeline;
+    int timeout;
+    bool keepalive;
+    struct sockaddr_in addr;
+    std::vector<std::string> requests; // 每个URL对应的完整请求
+    std::vector<double> weights;       // 累计权重，最后一个为总和
+};
+
+// 一个连接的状态
+struct conn
+{
+    int fd;
+    bool connected;
+    bool want_out;                   // 是否在等待EPOLLOUT
+    std::vector<unsigned long> sent; // 在途请求的发出时间，按发出顺序
+    size_t sent_head;                // 最早的在途请求
+    std::string out;                 // 还没写出的请求
+    size_t out_off;
+    std::string head;                // 还没收完的响应头
+    long body_left;                  // 正在接收的响应体还剩的字节数，-1表示在收响应头
+    int status;
+    bool server_close;               // 响应带Connection: close
+    bool listed;                     // 开环模式下是否在可用连接栈中
+
+    size_t inflight() const { return sent.size() - sent_head; }
+};
+
+// 每个线程的统计，结束后合并
+struct stats
+{
+    histogram latency;
+    std::map<int, unsigned long> status;
+    unsigned long bytes;
+    unsigned long connect_errors;
+    unsigned long read_errors;
+    unsigned long timeouts;
+    unsigned long closed; // 服务器关闭连接时还没有收到响应的请求
+    unsigned long unfinished; // 结束时还在排队或者在途的请求
+
+    stats() : bytes(0), connect_errors(0), read_errors(0), timeouts(0), closed(0), unfinished(0) {}
+
+    void merge(const stats &other)
+    {
+        latency.merge(other.latency);
+        for (std::map<int, unsigned long>::const_iterator it = other.status.begin(); it != other.status.end(); ++it)
+        {
+            status[it->first] += it->second;
+        }
+        bytes += other.bytes;
+        connect_errors += other.connect_errors;
+        read_errors += other.read_errors;
+        timeouts += other.timeouts;
+        closed += other.closed;
+        unfinished += other.unfinished;
+    }
+};
+
+static options g_opt;
+static std::atomic<bool> g_stop(false);
+
+class worker
+{
+public:
+    static const size_t OPEN_BATCH = 256; // 每轮事件循环最多新建的连接数
+
+    // rate为本线程每秒的请求数，0为闭环；start之后的第k个请求本应在start + k / rate发出，record_from之前发出的请求不计入统计
+    worker(int connections, double rate, unsigned long start, unsigned long record_from)
+        : m_epollfd(-1), m_conns(connections), m_seed(0), m_interval(rate > 0 ? 1e9 / rate : 0), m_start(start),
+          m_record_from(record_from), m_recording(false), m_issued(0)
+    {
+    }
+
+    static void *run(void *arg)
+    {
+        ((worker *)arg)->loop();
+        return NULL;
+    }
+
+    stats m_stats;
+    pthread_t m_thread;
+
+private:
+    void loop()
+    {
+        m_seed = now_ns() ^ (unsigned long)this;
+        m_epollfd = epoll_create1(EPOLL_CLOEXEC);
+        for (size_t i = 0; i < m_conns.size(); ++i)
+        {
+            m_conns[i].fd = -1;
+            m_conns[i].listed = false;
+        }
+        std::vector<struct epoll_event> events(1024);
+        unsigned long last_check = now_ns();
+        size_t opened = 0;
+        while (!g_stop.load(std::memory_order_relaxed))
+        {
+            // 连接分批建立，先建立的连接不必等全部建立完就开始发请求
+            for (size_t end = std::min(opened + OPEN_BATCH, m_conns.size()); opened < end; ++opened)
+            {
+                open_conn(&m_conns[opened]);
+            }
+            unsigned long timeout = (opened < m_conns.size()) ? 0 : 100000000UL;
+            if (m_interval > 0)
+            {
+                // 发出所有已经到时间的请求，然后最多等到下一个请求的时间
+                unsigned long now = now_ns();
+                schedule(now);
+                unsigned long due = next_due();
+                timeout = std::min(timeout, due > now ? due - now : 0);
+            }
+            int n = wait_events(m_epollfd, &events[0], events.size(), timeout);
+            m_recording = m_recording || now_ns() >= m_record_from;
+            for (int i = 0; i < n; ++i)
+            {
+                conn *c = (conn *)events[i].data.ptr;
+                // 已经建立的连接上出错时可能还有没读完的响应，交给read处理
+                if ((events[i].events & (EPOLLERR | EPOLLHUP)) && (!c->connected || !(events[i].events & EPOLLIN)))
+                {
+                    fail(c, !c->connected);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT)
+                {
+                    c->connected = true;
+                    if (!flush(c))
+                    {
+                        continue;
+                    }
+                }
+                if (events[i].events & EPOLLIN)
+                {
+                    on_readable(c);
+                }
+            }
+            unsigned long now = now_ns();
+            if (now - last_check >= 100000000UL)
+            {
+                check_timeouts(now, opened);
+                last_check = now;
+            }
+        }
+        // 以RST关闭，本地端口不进入TIME_WAIT，连续多次压测时不会耗尽端口
+        struct linger lg;
+        lg.l_onoff = 1;
+        lg.l_linger = 0;
+        for (size_t i = 0; i < m_conns.size(); ++i)
+        {
+            if (m_conns[i].fd >= 0)
+            {
+                setsockopt(m_conns[i].fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                close(m_conns[i].fd);
+                m_stats.unfinished += m_conns[i].inflight();
+            }
+        }
+        m_stats.unfinished += m_backlog.size();
+        close(m_epollfd);
+    }
+
+    // xorshift，按累计权重选一个URL
+    const std::string &pick_request()
+    {
+        m_seed ^= m_seed << 13;
+        m_seed ^= m_seed >> 7;
+        m_seed ^= m_seed << 17;
+        if (g_opt.requests.size() == 1)
+        {
+            return g_opt.requests[0];
+        }
+        double r = (m_seed >> 11) * (1.0 / 9007199254740992.0) * g_opt.weights.back();
+        size_t lo = 0, hi = g_opt.weights.size() - 1;
+        while (lo < hi)
+        {
+            size_t mid = (lo + hi) / 2;
+            if (g_opt.weights[mid] <= r)
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        return g_opt.requests[lo];
+    }
+
+    unsigned long next_due() const { return m_start + (unsigned long)(m_issued * m_interval); }
+
+    // 开环模式：到时间的请求先进入本地队列，再分给有空位的连接；没有空位时留在队列中，
+    // 记录的发出时间仍是时间表上的时间，排队的时间因此计入延迟
+    void schedule(unsigned long now)
+    {
+        for (unsigned long due = next_due(); due <= now; due = next_due())
+        {
+            m_backlog.push_back(due);
+            ++m_issued;
+        }
+        int depth = g_opt.keepalive ? g_opt.pipeline : 1;
+        while (!m_backlog.empty() && !m_ready.empty())
+        {
+            conn *c = m_ready.back();
+            m_ready.pop_back();
+            c->listed = false;
+            if (c->fd < 0 || c->server_close || (int)c->inflight() >= depth)
+            {
+                continue;
+            }
+            c->out += pick_request();
+            c->sent.push_back(m_backlog.front());
+            m_backlog.pop_front();
+            if (c->connected && !flush(c))
+            {
+                continue;
+            }
+            make_ready(c);
+        }
+    }
+
+    // 连接还有空位时放回可用连接栈
+    void make_ready(conn *c)
+    {
+        int depth = g_opt.keepalive ? g_opt.pipeline : 1;
+        if (m_interval > 0 && !c->listed && c->fd >= 0 && !c->server_close && (int)c->inflight() < depth)
+        {
+            c->listed = true;
+            m_ready.push_back(c);
+        }
+    }
+
+    void open_conn(conn *c)
+    {
+        c->connected = false;
+        c->want_out = true;
+        c->sent.clear();
+        c->sent_head = 0;
+        c->out.clear();
+        c->out_off = 0;
+        c->head.clear();
+        c->body_left = -1;
+        c->server_close = false;
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (c->fd < 0)
+        {
+            ++m_stats.connect_errors;
+            return;
+        }
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (connect(c->fd, (struct sockaddr *)&g_opt.addr, sizeof(g_opt.addr)) < 0 && errno != EINPROGRESS)
+        {
+            ++m_stats.connect_errors;
+            close(c->fd);
+            c->fd = -1;
+            return;
+        }
+        struct epoll_event ev;
+        ev.data.ptr = c;
+        ev.events = EPOLLIN | EPOLLOUT;
+        epoll_ctl(m_epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+        if (m_interval > 0)
+        {
+            make_ready(c);
+            return;
+        }
+        // 连接建立之前就把请求放进发送缓冲，建立后一起写出
+        fill(c, now_ns());
+    }
+
+    // 补足在途请求，sent_at为请求的发出时间，连接出错返回false
+    bool fill(conn *c, unsigned long sent_at)
+    {
+        int depth = g_opt.keepalive ? g_opt.pipeline : 1;
+        while ((int)c->inflight() < depth && !c->server_close)
+        {
+            c->out += pick_request();
+            c->sent.push_back(sent_at);
+        }
+        return !c->connected || flush(c);
+    }
+
+    // 写出发送缓冲，写不完时等待EPOLLOUT，连接出错返回false
+    bool flush(conn *c)
+    {
+        while (c->out_off < c->out.size())
+        {
+            ssize_t n = write(c->fd, c->out.data() + c->out_off, c->out.size() - c->out_off);
+            if (n < 0)
+            {
+                if (errno == EAGAIN)
+                {
+                    break;
+                }
+                fail(c, false);
+                return false;
+            }
+            c->out_off += n;
+        }
+        if (c->out_off == c->out.size())
+        {
+            c->out.clear();
+            c->out_off = 0;
+        }
+        // 只在需要改变时修改epoll，大多数请求一次就能写完
+        if (c->want_out == c->out.empty())
+        {
+            c->want_out = !c->out.empty();
+            struct epoll_event ev;
+            ev.data.ptr = c;
+            ev.events = c->want_out ? EPOLLIN | EPOLLOUT : EPOLLIN;
+            epoll_ctl(m_epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+        return true;
+    }
+
+    void on_readable(conn *c)
+    {
+        while (true)
+        {
+            ssize_t n = read(c->fd, m_buf, sizeof(m_buf));
+            if (n < 0)
+            {
+                if (errno != EAGAIN)
+                {
+                    fail(c, false);
+                }
+                return;
+            }
+            if (n == 0)
+            {
+                // 服务器关闭连接，还没收到响应的请求计为closed
+                m_stats.closed += c->inflight();
+                reconnect(c);
+                return;
+            }
+            if (m_recording)
+            {
+                m_stats.bytes += n;
+            }
+            if (!consume(c, m_buf, n))
+            {
+                return;
+            }
+        }
+    }
+
+    // 解析收到的数据，连接被重建时返回false
+    bool consume(conn *c, const char *data, size_t len)
+    {
+        while (len > 0)
+        {
+            if (c->body_left < 0)
+            {
+                // 响应头可能分多次到达，先拼接再查找空行
+                size_t old = c->head.size();
+                c->head.append(data, len);
+                size_t end = c->head.find("\r\n\r\n", old >= 3 ? old - 3 : 0);
+                if (end == std::string::npos)
+                {
+                    return true;
+                }
+                size_t used = end + 4 - old;
+                data += used;
+                len -= used;
+                parse_head(c, end);
+                c->head.clear();
+            }
+            size_t take = (size_t)c->body_left < len ? c->body_left : len;
+            c->body_left -= take;
+            data += take;
+            len -= take;
+            if (c->body_left == 0 && !complete(c))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void parse_head(conn *c, size_t end)
+    {
+        const char *h = c->head.c_str();
+        c->status = (strncmp(h, "HTTP/1.", 7) == 0) ? atoi(h + 9) : 0;
+        c->body_left = 0;
+        // 逐行查找需要的字段，忽略大小写
+        size_t pos = c->head.find("\r\n");
+        while (pos < end)
+        {
+            const char *line = h + pos + 2;
+            if (strncasecmp(line, "Content-Length:", 15) == 0)
+            {
+                c->body_left = atol(line + 15);
+            }
+            else if (strncasecmp(line, "Connection:", 11) == 0)
+            {
+                const char *v = line + 11;
+                while (*v == ' ')
+                {
+                    ++v;
+                }
+                c->server_close = strncasecmp(v, "close", 5) == 0;
+            }
+            pos = c->head.find("\r\n", pos + 2);
+        }
+        if (c->status == 304 || c->status == 204 || (c->status >= 100 && c->status < 200))
+        {
+            c->body_left = 0;
+        }
+    }
+
+    // 一个响应收完，记录延迟并发出下一个请求，连接被重建时返回false
+    bool complete(conn *c)
+    {
+        unsigned long now = now_ns();
+        unsigned long sent_at = c->sent[c->sent_head];
+        if (sent_at >= m_record_from)
+        {
+            m_stats.latency.add((now - sent_at) / 1000);
+            ++m_stats.status[c->status];
+        }
+        ++c->sent_head;
+        c->body_left = -1;
+        if (c->sent_head == c->sent.size())
+        {
+            c->sent.clear();
+            c->sent_head = 0;
+        }
+        if (c->server_close || !g_opt.keepalive)
+        {
+            m_stats.closed += c->inflight();
+            reconnect(c);
+            return false;
+        }
+        if (m_interval > 0)
+        {
+            // 下一个请求由schedule按时间表发出
+            make_ready(c);
+            return true;
+        }
+        return fill(c, now);
+    }
+
+    // 连接失败时不马上重试，由check_timeouts稍后重连，避免服务器不可用时空转
+    void fail(conn *c, bool connecting)
+    {
+        if (connecting)
+        {
+            ++m_stats.connect_errors;
+        }
+        else
+        {
+            ++m_stats.read_errors;
+        }
+        m_stats.closed += c->inflight();
+        reconnect(c, connecting);
+    }
+
+    void reconnect(conn *c, bool later = false)
+    {
+        if (c->fd >= 0)
+        {
+            epoll_ctl(m_epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+            close(c->fd);
+            c->fd = -1;
+        }
+        if (!later && !g_stop.load(std::memory_order_relaxed))
+        {
+            open_conn(c);
+        }
+    }
+
+    // 最早的在途请求超过超时时间的连接计为超时并重建；连接失败的连接也在这里重试
+    void check_timeouts(unsigned long now, size_t opened)
+    {
+        unsigned long limit = g_opt.timeout * 1000000000UL;
+        for (size_t i = 0; i < opened; ++i)
+        {
+            conn *c = &m_conns[i];
+            if (c->fd < 0)
+            {
+                open_conn(c);
+            }
+            else if (c->inflight() > 0 && now - c->sent[c->sent_head] > limit)
+            {
+                m_stats.timeouts += c->inflight();
+                reconnect(c);
+            }
+        }
+    }
+
+    int m_epollfd;
+    std::vector<conn> m_conns;
+    unsigned long m_seed;
+    double m_interval;                 // 开环模式下两个请求之间的纳秒数，0为闭环
+    unsigned long m_start;
+    unsigned long m_record_from;
+    bool m_recording;                  // 已经过了预热时间
+    unsigned long m_issued;            // 时间表上已经到时间的请求数
+    std::deque<unsigned long> m_backlog; // 到了时间还没有可用连接的请求
+    std::vector<conn *> m_ready;       // 还能再发请求的连接
+    char m_buf[64 * 1024];
+};
+
+static std::string make_request(const std::string &path, const std::string &host)
+{
+    return "GET " + path + " HTTP/1.1\r\nHost: " + host + "\r\nConnection: " +
+           (g_opt.keepalive ? "keep-alive" : "close") + "\r\n\r\n";
+}
+
+// 读取URL文件，每行"权重 路径"，只有路径时权重为1
+static bool load_urls(const char *path, const std::string &host)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        return false;
+    }
+    char line[4096];
+    double total = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        char *hash = strchr(line, '#');
+        if (hash)
+        {
+            *hash = '\0';
+        }
+        char first[4096], second[4096];
+        int n = sscanf(line, "%4095s %4095s", first, second);
+        if (n <= 0)
+        {
+            continue;
+        }
+        double weight = (n == 2) ? atof(first) : 1;
+        if (weight <= 0)
+        {
+            continue;
+        }
+        total += weight;
+        g_opt.requests.push_back(make_request(n == 2 ? second : first, host));
+        g_opt.weights.push_back(total);
+    }
+    fclose(fp);
+    return !g_opt.requests.empty();
+}
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-c connections] [-t threads] [-d seconds] [-w seconds] [-p pipeline] [-u url_file] [-T timeout]\n"
+           "       [-K] [-R rates] host:port[/path]\n"
+           "  -c  concurrent connections (default 100)\n"
+           "  -t  threads (default: online CPUs)\n"
+           "  -d  duration in seconds, per rate when sweeping (default 10)\n"
+           "  -w  warmup seconds at the start of each run that are not measured (default 0)\n"
+           "  -p  requests in flight per connection (default 1)\n"
+           "  -u  weighted URL mix, one \"weight path\" per line\n"
+           "  -T  request timeout in seconds (default 10)\n"
+           "  -K  no keep-alive, one connection per request\n"
+           "  -R  open loop at a fixed total rate in req/s; a list (1000,2000) or a range (1000:20000:1000)\n"
+           "      runs each rate in turn and prints a latency-vs-throughput table\n",
+           prog);
+}
+
+// 展开速率列表：逗号分隔，每一项是一个速率或者 起点:终点:步长
+static bool parse_rates(const char *text, std::vector<double> &rates)
+{
+    std::string list = text;
+    size_t pos = 0;
+    while (pos <= list.size())
+    {
+        size_t comma = list.find(',', pos);
+        std::string item = list.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        double first = 0, last = 0, step = 0;
+        int n = sscanf(item.c_str(), "%lf:%lf:%lf", &first, &last, &step);
+        if (n == 1 && first > 0)
+        {
+            rates.push_back(first);
+        }
+        else if (n == 3 && first > 0 && last >= first && step > 0)
+        {
+            for (double r = first; r <= last + step / 2; r += step)
+            {
+                rates.push_back(r);
+            }
+        }
+        else
+        {
+            return false;
+        }
+        if (comma == std::string::npos)
+        {
+            break;
+        }
+        pos = comma + 1;
+    }
+    return !rates.empty();
+}
+
+// 以rate(0为闭环)压测一轮，返回合并后的统计和计入统计的秒数
+static bool run(double rate, stats &total, double &measured)
+{
+    g_stop.store(false);
+    std::vector<worker *> workers;
+    unsigned long start = now_ns();
+    unsigned long record_from = start + g_opt.warmup * 1000000000UL;
+    for (int i = 0; i < g_opt.threads; ++i)
+    {
+        int n = g_opt.connections / g_opt.threads + (i < g_opt.connections % g_opt.threads ? 1 : 0);
+        // 各线程的时间表错开，合起来是均匀的
+        double thread_rate = rate / g_opt.threads;
+        unsigned long offset = thread_rate > 0 ? (unsigned long)(1e9 / thread_rate * i / g_opt.threads) : 0;
+        worker *w = new worker(n, thread_rate, start + offset, record_from);
+        if (pthread_create(&w->m_thread, NULL, worker::run, w) != 0)
+        {
+            printf("create thread failed\n");
+            return false;
+        }
+        workers.push_back(w);
+    }
+    sleep(g_opt.duration);
+    g_stop.store(true);
+    measured = (now_ns() - record_from) / 1e9;
+    for (size_t i = 0; i < workers.size(); ++i)
+    {
+        pthread_join(workers[i]->m_thread, NULL);
+        total.merge(workers[i]->m_stats);
+        delete workers[i];
+    }
+    return true;
+}
+
+static unsigned long errors(const stats &s)
+{
+    unsigned long count = s.connect_errors + s.read_errors + s.timeouts + s.closed;
+    for (std::map<int, unsigned long>::const_iterator it = s.status.begin(); it != s.status.end(); ++it)
+    {
+        if (it->first < 200 || it->first >= 400)
+        {
+            count += it->second;
+        }
+    }
+    return count;
+}
+
+static void report(const stats &total, double measured, double rate)
+{
+    const histogram &lat = total.latency;
+    if (rate > 0)
+    {
+        printf("target %.1f req/s, unfinished %lu\n", rate, total.unfinished);
+    }
+    printf("requests %lu, %.1f req/s, %.2f MB/s\n", lat.total, lat.total / measured, total.bytes / measured / 1048576);
+    printf("latency (us): mean %.0f, p50 %lu, p90 %lu, p99 %lu, p99.9 %lu, max %lu\n",
+           lat.total ? lat.sum / lat.total : 0.0, lat.percentile(50), lat.percentile(90), lat.percentile(99),
+           lat.percentile(99.9), lat.max);
+    printf("status:");
+    for (std::map<int, unsigned long>::const_iterator it = total.status.begin(); it != total.status.end(); ++it)
+    {
+        printf(" %d=%lu", it->first, it->second);
+    }
+    printf("\nerrors: connect %lu, read %lu, timeout %lu, closed %lu\n", total.connect_errors, total.read_errors,
+           total.timeouts, total.closed);
+}
+
+int main(int argc, char *argv[])
+{
+    g_opt.connections = 100;
+    g_opt.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    g_opt.duration = 10;
+    g_opt.warmup = 0;
+    g_opt.pipeline = 1;
+    g_opt.timeout = 10;
+    g_opt.keepalive = true;
+    const char *url_file = NULL;
+    std::vector<double> rates;
+    int ch;
+    while ((ch = getopt(argc, argv, "c:t:d:w:p:u:T:KR:h")) != -1)
+    {
+        switch (ch)
+        {
+        case 'c': g_opt.connections = atoi(optarg); break;
+        case 't': g_opt.threads = atoi(optarg); break;
+        case 'd': g_opt.duration = atoi(optarg); break;
+        case 'w': g_opt.warmup = atoi(optarg); break;
+        case 'p': g_opt.pipeline = atoi(optarg); break;
+        case 'u': url_file = optarg; break;
+        case 'T': g_opt.timeout = atoi(optarg); break;
+        case 'K': g_opt.keepalive = false; break;
+        case 'R':
+            if (!parse_rates(optarg, rates))
+            {
+                printf("bad rate list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind >= argc || g_opt.connections < 1 || g_opt.threads < 1 || g_opt.duration < 1 || g_opt.pipeline < 1 ||
+        g_opt.timeout < 1 || g_opt.warmup < 0 || g_opt.warmup >= g_opt.duration)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (g_opt.threads > g_opt.connections)
+    {
+        g_opt.threads = g_opt.connections;
+    }
+
+    // 目标写作 host:port[/path]
+    std::string target = argv[optind];
+    if (target.compare(0, 7, "http://") == 0)
+    {
+        target = target.substr(7);
+    }
+    std::string path = "/index.html";
+    size_t slash = target.find('/');
+    if (slash != std::string::npos)
+    {
+        path = target.substr(slash);
+        target = target.substr(0, slash);
+    }
+    std::string host = target, port = "80";
+    size_t colon = target.rfind(':');
+    if (colon != std::string::npos)
+    {
+        host = target.substr(0, colon);
+        port = target.substr(colon + 1);
+    }
+    struct addrinfo hints, *res = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res)
+    {
+        printf("cannot resolve %s\n", target.c_str());
+        return 1;
+    }
+    memcpy(&g_opt.addr, res->ai_addr, sizeof(g_opt.addr));
+    freeaddrinfo(res);
+    if (url_file)
+    {
+        if (!load_urls(url_file, target))
+        {
+            printf("cannot read urls from %s\n", url_file);
+            return 1;
+        }
+    }
+    else
+    {
+        g_opt.requests.push_back(make_request(path, target));
+        g_opt.weights.push_back(1);
+    }
+
+    // 每个连接一个文件描述符，尽量调高上限
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)g_opt.connections + 64)
+    {
+        rl.rlim_cur = (rl.rlim_max == RLIM_INFINITY || rl.rlim_max > (rlim_t)g_opt.connections + 64)
+                          ? (rlim_t)g_opt.connections + 64
+                          : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    // 输出以#开头的行是说明，其余行可以直接与其他版本的结果diff或者画图
+    printf("# %s: %d connections, %d threads, pipeline %d, keep-alive %s, %d urls, %ds (warmup %ds)\n", target.c_str(),
+           g_opt.connections, g_opt.threads, g_opt.pipeline, g_opt.keepalive ? "on" : "off",
+           (int)g_opt.requests.size(), g_opt.duration, g_opt.warmup);
+    if (rates.size() <= 1)
+    {
+        stats total;
+        double measured = 0;
+        double rate = rates.empty() ? 0 : rates[0];
+        if (!run(rate, total, measured))
+        {
+            return 1;
+        }
+        report(total, measured, rate);
+        return 0;
+    }
+
+    // 速率扫描：实际吞吐低于目标的95%说明已经越过饱和点，之后的速率不再计入
+    printf("#%9s %10s %10s %10s %10s %10s %10s %10s %10s\n", "target", "rps", "p50_us", "p90_us", "p99_us",
+           "p999_us", "max_us", "errors", "unfinished");
+    double knee = 0;
+    bool saturated = false;
+    for (size_t i = 0; i < rates.size(); ++i)
+    {
+        stats total;
+        double measured = 0;
+        if (!run(rates[i], total, measured))
+        {
+            return 1;
+        }
+        const histogram &lat = total.latency;
+        double rps = lat.total / measured;
+        printf("%10.0f %10.0f %10lu %10lu %10lu %10lu %10lu %10lu %10lu\n", rates[i], rps, lat.percentile(50),
+               lat.percentile(90), lat.percentile(99), lat.percentile(99.9), lat.max, errors(total), total.unfinished);
+        fflush(stdout);
+        if (!saturated && rps >= rates[i] * 0.95)
+        {
+            knee = rates[i];
+        }
+        else
+        {
+            saturated = true;
+        }
+    }
+    printf("# highest rate sustained: %.0f req/s\n", knee);
+    return 0;
+}
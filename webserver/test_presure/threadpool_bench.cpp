@@ -0,0 +1,99 @@
+/*
+    线程池请求队列微基准测试：比较 list / ring / steal 三种队列在 1~64 个工作线程下的吞吐
+    一个投递线程不断append任务，任务本身只做少量计算，测量的主要是队列的入队、出队和唤醒开销
+
+    编译: g++ -O2 -std=c++11 threadpool_bench.cpp -pthread -o threadpool_bench
+    运行: ./threadpool_bench [任务数量] [每个任务的计算量]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include "../threadpool.h"
+
+// 基准任务，process由工作线程调用
+struct bench_task
+{
+    std::atomic<bool> done;
+    int work;
+    unsigned long result;
+
+    void process()
+    {
+        unsigned long x = (unsigned long)this;
+        for (int i = 0; i < work; ++i)
+        {
+            x = x * 6364136223846793005UL + 1442695040888963407UL;
+        }
+        result = x;
+        done.store(true, std::memory_order_release);
+    }
+};
+
+static double now_sec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// 运行一次测试，所有任务完成后销毁线程池，析构函数等待工作线程全部退出后才返回
+static double run_once(threadpool<bench_task>::QUEUE_MODE mode, int threads, int tasks, int work)
+{
+    bench_task *arr = new bench_task[tasks];
+    for (int i = 0; i < tasks; ++i)
+    {
+        arr[i].done.store(false);
+        arr[i].work = work;
+    }
+    threadpool<bench_task> *pool = new threadpool<bench_task>(threads, 10000, mode);
+    usleep(10000); // 等待工作线程启动
+
+    double start = now_sec();
+    int next = 0;     // 下一个待投递的任务
+    int finished = 0; // 从头开始连续完成的任务数
+    while (finished < tasks)
+    {
+        // 队列满时append返回false，转而检查完成情况
+        while (next < tasks && pool->append(arr + next, next))
+        {
+            ++next;
+        }
+        while (finished < next && arr[finished].done.load(std::memory_order_acquire))
+        {
+            ++finished;
+        }
+    }
+    double elapsed = now_sec() - start;
+    delete pool;
+    delete[] arr;
+    return tasks / elapsed;
+}
+
+int main(int argc, char *argv[])
+{
+    int tasks = (argc > 1) ? atoi(argv[1]) : 500000;
+    int work = (argc > 2) ? atoi(argv[2]) : 50;
+    const char *names[] = {"list", "ring", "steal"};
+    threadpool<bench_task>::QUEUE_MODE modes[] = {threadpool<bench_task>::LIST_QUEUE,
+                                                  threadpool<bench_task>::RING_QUEUE,
+                                                  threadpool<bench_task>::STEAL_QUEUE};
+    int thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+
+    printf("tasks=%d work=%d (ops/sec)\n", tasks, work);
+    printf("%8s %14s %14s %14s\n", "threads", names[0], names[1], names[2]);
+    for (unsigned int t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); ++t)
+    {
+        printf("%8d", thread_counts[t]);
+        fflush(stdout);
+        for (int m = 0; m < 3; ++m)
+        {
+            double ops = run_once(modes[m], thread_counts[t], tasks, work);
+            printf(" %14.0f", ops);
+            fflush(stdout);
+        }
+        printf("\n");
+    }
+    return 0;
+}
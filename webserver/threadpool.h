@@ -2,25 +2,67 @@
 #define THREADPOOL_H
 
 #include <list>
+#include <deque>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <vector>
 #include "locker.h"
+#include "lockfree_queue.h"
+#include "affinity.h"
 
 // 线程池类，将它定义为模板类是为了代码复用，模板参数T是任务类
 template <typename T>
 class threadpool
 {
 public:
-    /*thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量*/
-    threadpool(int thread_number = 8, int max_requests = 10000);
+    /*
+        请求队列的实现方式
+        LIST_QUEUE  :   std::list + 互斥锁 + 信号量，每个请求一次加锁、一次链表节点分配和一对sem_post/sem_wait
+        RING_QUEUE  :   有界无锁环形队列，只有在有线程空闲等待时才唤醒
+        STEAL_QUEUE :   工作窃取，每个线程一个本地双端队列，本地队列为空时从其他线程的队列尾部窃取
+    */
+    enum QUEUE_MODE
+    {
+        LIST_QUEUE = 0,
+        RING_QUEUE,
+        STEAL_QUEUE
+    };
+
+public:
+    /*thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待处理的请求的数量，mode选择请求队列的实现，
+      cpus不为空时第i个线程绑定到cpus[i % cpus.size()]上*/
+    threadpool(int thread_number = 8, int max_requests = 10000, QUEUE_MODE mode = RING_QUEUE,
+               const std::vector<int> &cpus = std::vector<int>());
+    // 唤醒所有线程并等待它们退出，队列中剩下的请求不再处理，调用前应当已经没有新的请求
     ~threadpool();
-    bool append(T *request);
+    // hint为非负数时（例如socket的文件描述符），STEAL_QUEUE模式下同一个hint总是投递给同一个线程，使连接的数据留在该线程的缓存中
+    bool append(T *request, int hint = -1);
+    // 队列中等待处理的请求数，只用于监控，无锁模式下是近似值
+    int queue_depth();
 
 private:
     /*工作线程运行的函数，它不断从工作队列中取出任务并执行之*/
     static void *worker(void *arg);
-    void run();
+    void run(int index);
+    void shutdown(); // 结束并等待所有线程，释放队列
+    void wake_idle(); // 新任务入队后，仅在有线程睡眠时唤醒一个
+    void run_list();
+    void run_ring();
+    bool pop_ring(T *&request); // 从无锁队列取任务，取不到时短暂自旋
+    void run_steal(int index);
+    bool pop_steal(int index, T *&request); // 先取本地队列，再从其他线程窃取
+
+    // 工作窃取模式下每个线程的本地队列，按缓存行填充，避免相邻队列的锁互相干扰
+    struct steal_queue
+    {
+        char pad0[CACHELINE_SIZE];
+        locker lock;
+        std::deque<T *> tasks;
+        char pad1[CACHELINE_SIZE];
+    };
 
 private:
     // 线程的数量
@@ -42,12 +84,41 @@ private:
     sem m_queuestat;
 
     // 是否结束线程
-    bool m_stop;
+    std::atomic<bool> m_stop;
+
+    // 请求队列的实现方式
+    QUEUE_MODE m_mode;
+
+    // 无锁请求队列，RING_QUEUE模式下使用
+    mpmc_queue<T *> *m_ringqueue;
+
+    // 正在信号量上睡眠的线程数，生产者只在它大于0时才post，避免每个请求一次唤醒系统调用
+    std::atomic<int> m_idle;
+
+    // 工作窃取模式下每个线程的本地队列，大小为m_thread_number
+    steal_queue *m_stealqueues;
+
+    // 工作窃取模式下所有本地队列中的任务总数，用于维持m_max_requests上限
+    std::atomic<int> m_pending;
+
+    // 轮询投递的下一个线程，只由投递任务的线程修改
+    unsigned int m_next_queue;
+
+    // 分配给新启动线程的编号
+    std::atomic<int> m_next_index;
+
+    // 取不到任务时睡眠前的自旋次数，单核机器上自旋只会抢占投递线程，因此不自旋
+    int m_spin;
+
+    // 工作线程绑定的CPU，为空时不绑定
+    std::vector<int> m_cpus;
 };
 
 template <typename T>
-threadpool<T>::threadpool(int thread_number, int max_requests) : m_thread_number(thread_number), m_max_requests(max_requests),
-                                                                 m_stop(false), m_threads(NULL)
+threadpool<T>::threadpool(int thread_number, int max_requests, QUEUE_MODE mode, const std::vector<int> &cpus)
+    : m_thread_number(thread_number), m_threads(NULL), m_max_requests(max_requests), m_stop(false), m_mode(mode), m_ringqueue(NULL),
+      m_idle(0), m_stealqueues(NULL), m_pending(0), m_next_queue(0), m_next_index(0),
+      m_spin(sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 64 : 1), m_cpus(cpus)
 {
 
     if ((thread_number <= 0) || (max_requests <= 0))
@@ -55,25 +126,29 @@ threadpool<T>::threadpool(int thread_number, int max_requests) : m_thread_number
         throw std::exception();
     }
 
+    if (m_mode == RING_QUEUE)
+    {
+        m_ringqueue = new mpmc_queue<T *>(max_requests);
+    }
+    else if (m_mode == STEAL_QUEUE)
+    {
+        m_stealqueues = new steal_queue[thread_number];
+    }
+
     m_threads = new pthread_t[m_thread_number];
     if (!m_threads)
     {
         throw std::exception();
     }
 
-    // 创建thread_number 个线程，并将他们设置为脱离线程（让子线程自己销毁）
+    // 创建thread_number 个线程，析构时等待它们退出
     for (int i = 0; i < thread_number; ++i)
     {
-        printf("create the %dth thread\n", i);
         if (pthread_create(m_threads + i, NULL, worker, this) != 0) // work函数,为静态函数，this作为参数传递到work函数当中，就可以访问变量
         {
-            delete[] m_threads;
-            throw std::exception();
-        }
-
-        if (pthread_detach(m_threads[i]))
-        {
-            delete[] m_threads;
+            // 已经创建的线程要先退出，才能释放它们使用的队列
+            m_thread_number = i;
+            shutdown();
             throw std::exception();
         }
     }
@@ -82,16 +157,59 @@ threadpool<T>::threadpool(int thread_number, int max_requests) : m_thread_number
 template <typename T>
 threadpool<T>::~threadpool()
 {
-    delete[] m_threads; // 释放资源
+    shutdown();
+}
+
+template <typename T>
+void threadpool<T>::shutdown()
+{
     m_stop = true;
+    // 每个线程最多在信号量上睡眠一次，各post一次就能全部唤醒，醒来后看到m_stop退出
+    for (int i = 0; i < m_thread_number; ++i)
+    {
+        m_queuestat.post();
+    }
+    for (int i = 0; i < m_thread_number; ++i)
+    {
+        pthread_join(m_threads[i], NULL);
+    }
+    delete[] m_threads; // 释放资源
+    delete m_ringqueue;
+    delete[] m_stealqueues;
 }
 
 template <typename T>
-bool threadpool<T>::append(T *request) // 添加任务
+bool threadpool<T>::append(T *request, int hint) // 添加任务
 {
+    if (m_mode == RING_QUEUE)
+    {
+        if (!m_ringqueue->push(request))
+        {
+            return false;
+        }
+        wake_idle();
+        return true;
+    }
+    if (m_mode == STEAL_QUEUE)
+    {
+        if (m_pending.fetch_add(1, std::memory_order_relaxed) >= m_max_requests)
+        {
+            m_pending.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        // 有hint时固定投递给同一个线程，否则轮询
+        int index = (hint >= 0) ? hint % m_thread_number : (m_next_queue++) % m_thread_number;
+        steal_queue &q = m_stealqueues[index];
+        q.lock.lock();
+        q.tasks.push_back(request);
+        q.lock.unlock();
+        wake_idle();
+        return true;
+    }
     // 操作工作队列时一定要加锁，因为它被所有线程共享。
     m_queuelocker.lock();
-    if (m_workqueue.size() > m_max_requests)
+    // 构造函数已经保证m_max_requests为正，与环形队列和窃取模式一样最多容纳m_max_requests个任务
+    if (m_workqueue.size() >= (size_t)m_max_requests)
     {
         m_queuelocker.unlock();
         return false;
@@ -102,16 +220,66 @@ bool threadpool<T>::append(T *request) // 添加任务
     return true;
 }
 
+template <typename T>
+int threadpool<T>::queue_depth()
+{
+    if (m_mode == RING_QUEUE)
+    {
+        return m_ringqueue->size();
+    }
+    if (m_mode == STEAL_QUEUE)
+    {
+        return m_pending.load(std::memory_order_relaxed);
+    }
+    m_queuelocker.lock();
+    int depth = m_workqueue.size();
+    m_queuelocker.unlock();
+    return depth;
+}
+
+template <typename T>
+void threadpool<T>::wake_idle()
+{
+    // 与工作线程登记空闲后的栅栏配对：要么工作线程看到新任务，要么这里看到它已经空闲
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_idle.load(std::memory_order_relaxed) > 0)
+    {
+        m_queuestat.post();
+    }
+}
+
 template <typename T>
 void *threadpool<T>::worker(void *arg)
 {
     threadpool *pool = (threadpool *)arg;
-    pool->run(); // 执行
+    pool->run(pool->m_next_index.fetch_add(1)); // 执行
     return pool;
 }
 
 template <typename T>
-void threadpool<T>::run()
+void threadpool<T>::run(int index)
+{
+    if (!m_cpus.empty())
+    {
+        // 绑定之后本线程处理请求时分配的内存也优先来自所在的NUMA节点
+        pin_thread(m_cpus[index % m_cpus.size()]);
+    }
+    if (m_mode == RING_QUEUE)
+    {
+        run_ring();
+    }
+    else if (m_mode == STEAL_QUEUE)
+    {
+        run_steal(index);
+    }
+    else
+    {
+        run_list();
+    }
+}
+
+template <typename T>
+void threadpool<T>::run_list()
 {
 
     while (!m_stop) // 线程一直循环，直到遇到m_stop停止
@@ -134,4 +302,119 @@ void threadpool<T>::run()
     }
 }
 
+template <typename T>
+bool threadpool<T>::pop_ring(T *&request)
+{
+    // 先自旋几轮，突发流量下任务往往马上就到，省去一次睡眠和唤醒
+    for (int i = 0; i < m_spin; ++i)
+    {
+        if (m_ringqueue->pop(request))
+        {
+            return true;
+        }
+        cpu_relax();
+    }
+    return false;
+}
+
+template <typename T>
+void threadpool<T>::run_ring()
+{
+    while (!m_stop)
+    {
+        T *request = NULL;
+        if (!pop_ring(request))
+        {
+            // 登记为空闲后再检查一次队列，防止在登记之前到达的任务没有人唤醒
+            m_idle.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!m_ringqueue->pop(request))
+            {
+                m_queuestat.wait();
+                m_idle.fetch_sub(1, std::memory_order_relaxed);
+                continue;
+            }
+            m_idle.fetch_sub(1, std::memory_order_relaxed);
+        }
+        if (!request)
+        {
+            continue;
+        }
+        request->process();
+    }
+}
+
+template <typename T>
+bool threadpool<T>::pop_steal(int index, T *&request)
+{
+    // 本地队列从头部取，保证同一个线程上的任务先来先服务
+    steal_queue &local = m_stealqueues[index];
+    local.lock.lock();
+    if (!local.tasks.empty())
+    {
+        request = local.tasks.front();
+        local.tasks.pop_front();
+        local.lock.unlock();
+        m_pending.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+    }
+    local.lock.unlock();
+
+    // 从其他线程的队列尾部窃取，锁被占用就跳过，不与队列的主人争抢
+    for (int i = 1; i < m_thread_number; ++i)
+    {
+        steal_queue &victim = m_stealqueues[(index + i) % m_thread_number];
+        if (!victim.lock.trylock())
+        {
+            continue;
+        }
+        if (!victim.tasks.empty())
+        {
+            request = victim.tasks.back();
+            victim.tasks.pop_back();
+            victim.lock.unlock();
+            m_pending.fetch_sub(1, std::memory_order_relaxed);
+            return true;
+        }
+        victim.lock.unlock();
+    }
+    return false;
+}
+
+template <typename T>
+void threadpool<T>::run_steal(int index)
+{
+    while (!m_stop)
+    {
+        T *request = NULL;
+        bool got = false;
+        for (int i = 0; i < m_spin && !got; ++i)
+        {
+            got = pop_steal(index, request);
+            if (!got)
+            {
+                cpu_relax();
+            }
+        }
+        if (!got)
+        {
+            // 与run_ring相同：登记为空闲后再检查一次，m_pending为0时才真正睡眠
+            m_idle.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_pending.load(std::memory_order_relaxed) == 0 || !pop_steal(index, request))
+            {
+                m_queuestat.wait();
+                m_idle.fetch_sub(1, std::memory_order_relaxed);
+                continue;
+            }
+            m_idle.fetch_sub(1, std::memory_order_relaxed);
+        }
+        if (!request)
+        {
+            continue;
+        }
+        request->process();
+    }
+}
+
 #endif
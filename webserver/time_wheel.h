@@ -0,0 +1,293 @@
+#ifndef TIME_WHEEL
+#define TIME_WHEEL
+
+#include <stdio.h>
+#include <time.h>
+
+template <typename T>
+class time_wheel;
+
+// 定时器类，嵌入到用户数据中使用，时间轮不负责分配和释放定时器
+template <typename T>
+class tw_timer
+{
+public:
+    tw_timer() : expire(0), cb_func(NULL), user_data(NULL), prev(NULL), next(NULL) {}
+
+    // 定时器是否在时间轮中
+    bool pending() const { return next != NULL; }
+
+public:
+    unsigned long expire;  // 任务超时时间，以时间轮的tick为单位的绝对时间
+    void (*cb_func)(T *);  // 任务回调函数，回调函数处理的客户数据，由定时器的执行者传递给回调函数
+    T *user_data;
+
+private:
+    friend class time_wheel<T>;
+    tw_timer *prev; // 指向前一个定时器
+    tw_timer *next; // 指向后一个定时器
+};
+
+/*
+    分层时间轮，4层，每层64个槽，第0层每个槽代表一个tick，第n层每个槽代表64^n个tick。
+    添加定时器时根据剩余时间直接算出所在的层和槽；删除只是从双向链表中摘下；
+    延长超时时间时只修改expire，不移动定时器，等它所在的槽到期时再重新放到正确的位置。
+    所以添加、删除、刷新都是O(1)，与定时器的数量无关。
+    低层转完一圈时把上一层对应槽中的定时器重新分配到下层（级联）。
+*/
+template <typename T>
+class time_wheel
+{
+public:
+    static const int LEVEL_BITS = 6;
+    static const int SLOTS = 1 << LEVEL_BITS; // 每层的槽数
+    static const int LEVELS = 4;              // 层数，可以直接表示 64^4 个tick 以内的超时
+
+    // tick_ms为时间轮的精度，即一个tick的毫秒数
+    explicit time_wheel(int tick_ms = 1000);
+    ~time_wheel();
+
+    // 添加定时器，timeout_ms毫秒后到期
+    void add_timer(tw_timer<T> *timer, long timeout_ms);
+    // 把定时器的超时时间重新设置为从现在起timeout_ms毫秒之后
+    void adjust_timer(tw_timer<T> *timer, long timeout_ms);
+    // 删除定时器，不释放它
+    void del_timer(tw_timer<T> *timer);
+    // 处理到当前时间为止所有到期的定时器，到期的定时器先被摘下再调用回调，回调中可以重新添加或者释放它
+    void tick();
+
+    int tick_ms() const { return m_tick_ms; }
+    int size() const { return m_count; }
+
+private:
+    unsigned long now_ticks() const;                   // 当前时间，以tick为单位
+    void link(tw_timer<T> *head, tw_timer<T> *timer);  // 把定时器加到链表头之前（链表尾部）
+    void unlink(tw_timer<T> *timer);                   // 从所在的链表中摘下
+    void place(tw_timer<T> *timer);                    // 根据expire放到对应的层和槽
+    void cascade(int level);                           // 把level层当前槽的定时器重新分配到下层
+    void run_one_tick();                               // 处理m_current对应的槽，然后前进一个tick
+
+private:
+    tw_timer<T> m_slots[LEVELS][SLOTS]; // 每个槽是一个带哨兵头节点的双向循环链表
+    unsigned long m_current;            // 下一个要处理的tick
+    int m_tick_ms;
+    int m_count; // 时间轮中的定时器数量
+};
+
+template <typename T>
+time_wheel<T>::time_wheel(int tick_ms) : m_current(0), m_tick_ms(tick_ms > 0 ? tick_ms : 1), m_count(0)
+{
+    for (int l = 0; l < LEVELS; ++l)
+    {
+        for (int s = 0; s < SLOTS; ++s)
+        {
+            m_slots[l][s].prev = m_slots[l][s].next = &m_slots[l][s];
+        }
+    }
+    m_current = now_ticks();
+}
+
+template <typename T>
+time_wheel<T>::~time_wheel()
+{
+    // 定时器由使用者管理，这里只把它们摘下
+    for (int l = 0; l < LEVELS; ++l)
+    {
+        for (int s = 0; s < SLOTS; ++s)
+        {
+            tw_timer<T> *head = &m_slots[l][s];
+            while (head->next != head)
+            {
+                unlink(head->next);
+            }
+        }
+    }
+}
+
+template <typename T>
+unsigned long time_wheel<T>::now_ticks() const
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    unsigned long ms = (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    return ms / m_tick_ms;
+}
+
+template <typename T>
+void time_wheel<T>::link(tw_timer<T> *head, tw_timer<T> *timer)
+{
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+template <typename T>
+void time_wheel<T>::unlink(tw_timer<T> *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer->next = NULL;
+}
+
+template <typename T>
+void time_wheel<T>::place(tw_timer<T> *timer)
+{
+    unsigned long expire = timer->expire;
+    if (expire < m_current)
+    {
+        // 已经过期的定时器放到下一个要处理的槽
+        expire = m_current;
+    }
+    unsigned long delta = expire - m_current;
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1UL << (LEVEL_BITS * (level + 1))))
+    {
+        ++level;
+    }
+    if (delta >= (1UL << (LEVEL_BITS * LEVELS)))
+    {
+        // 超出时间轮的范围，先放在最高层最远的槽，到时再重新分配
+        expire = m_current + (1UL << (LEVEL_BITS * LEVELS)) - 1;
+    }
+    int slot = (expire >> (LEVEL_BITS * level)) & (SLOTS - 1);
+    link(&m_slots[level][slot], timer);
+}
+
+template <typename T>
+void time_wheel<T>::add_timer(tw_timer<T> *timer, long timeout_ms)
+{
+    if (!timer)
+    {
+        return;
+    }
+    if (timer->pending())
+    {
+        del_timer(timer);
+    }
+    // 向上取整，到期时间的误差在一个tick之内
+    timer->expire = now_ticks() + (timeout_ms + m_tick_ms - 1) / m_tick_ms;
+    place(timer);
+    ++m_count;
+}
+
+template <typename T>
+void time_wheel<T>::adjust_timer(tw_timer<T> *timer, long timeout_ms)
+{
+    if (!timer)
+    {
+        return;
+    }
+    if (!timer->pending())
+    {
+        add_timer(timer, timeout_ms);
+        return;
+    }
+    unsigned long expire = now_ticks() + (timeout_ms + m_tick_ms - 1) / m_tick_ms;
+    if (expire >= timer->expire)
+    {
+        // 延长：只记录新的超时时间，所在的槽到期时会发现还没到时间并重新放置
+        timer->expire = expire;
+        return;
+    }
+    // 提前：必须移动到更早的槽
+    unlink(timer);
+    timer->expire = expire;
+    place(timer);
+}
+
+template <typename T>
+void time_wheel<T>::del_timer(tw_timer<T> *timer)
+{
+    if (!timer || !timer->pending())
+    {
+        return;
+    }
+    unlink(timer);
+    --m_count;
+}
+
+template <typename T>
+void time_wheel<T>::cascade(int level)
+{
+    int slot = (m_current >> (LEVEL_BITS * level)) & (SLOTS - 1);
+    tw_timer<T> *head = &m_slots[level][slot];
+    // 先把整条链表摘到临时链表上，避免重新放回同一个槽时死循环
+    tw_timer<T> list;
+    list.prev = list.next = &list;
+    if (head->next != head)
+    {
+        list.next = head->next;
+        list.prev = head->prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head->prev = head->next = head;
+    }
+    while (list.next != &list)
+    {
+        tw_timer<T> *timer = list.next;
+        unlink(timer);
+        place(timer);
+    }
+}
+
+template <typename T>
+void time_wheel<T>::run_one_tick()
+{
+    int slot = m_current & (SLOTS - 1);
+    // 第0层转完一圈，从第1层取下对应槽的定时器；第1层也转完一圈时继续向上
+    for (int level = 1; level < LEVELS; ++level)
+    {
+        if (((m_current >> (LEVEL_BITS * (level - 1))) & (SLOTS - 1)) != 0)
+        {
+            break;
+        }
+        cascade(level);
+    }
+
+    tw_timer<T> *head = &m_slots[0][slot];
+    tw_timer<T> list;
+    list.prev = list.next = &list;
+    if (head->next != head)
+    {
+        list.next = head->next;
+        list.prev = head->prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head->prev = head->next = head;
+    }
+    ++m_current;
+    while (list.next != &list)
+    {
+        tw_timer<T> *timer = list.next;
+        unlink(timer);
+        if (timer->expire >= m_current)
+        {
+            // 超时时间被延长过，重新放置
+            place(timer);
+            continue;
+        }
+        --m_count;
+        // 调用定时器的回调函数，以执行定时任务
+        timer->cb_func(timer->user_data);
+    }
+}
+
+template <typename T>
+void time_wheel<T>::tick()
+{
+    unsigned long now = now_ticks();
+    if (m_count == 0)
+    {
+        // 没有定时器时直接跳到当前时间，不必逐个tick空转
+        m_current = now + 1;
+        return;
+    }
+    // 一次处理从上次到现在经过的所有tick，每个tick只是访问一个槽
+    while (m_current <= now)
+    {
+        run_one_tick();
+    }
+}
+
+#endif
@@ -0,0 +1,672 @@
+#include "uring_loop.h"
+#include "eventloop.h"
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <time.h>
+
+// 当前线程运行的事件循环，时间轮的回调函数通过它找到连接所属的循环
+static thread_local uring_loop *t_loop = NULL;
+
+static unsigned long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// glibc没有封装io_uring的系统调用，这里直接调用，不依赖liburing
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+uring_loop::uring_loop(int listenfd)
+    : m_ringfd(-1), m_listenfd(listenfd), m_disabled(false), m_ring_ptr(MAP_FAILED), m_sqes((struct io_uring_sqe *)MAP_FAILED),
+      m_sq_local_tail(0), m_buf_ring(NULL), m_bufs(NULL), m_buf_tail(0), m_timers(eventloop::m_tick_ms), m_now(now_ms()),
+      m_accept_batch(0), m_cpu(-1), m_conn_count(0), m_draining(false), m_accept_armed(false),
+      m_drain_deadline(0)
+{
+    // 只有循环线程提交请求，内核可以省去锁，完成事件的后续处理推迟到io_uring_enter中进行；
+    // 这两个标志要求由提交的线程启用环，所以先以禁用状态创建
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_R_DISABLED | IORING_SETUP_CQSIZE;
+    p.cq_entries = RING_ENTRIES * 4;
+    m_ringfd = io_uring_setup(RING_ENTRIES, &p);
+    m_disabled = true;
+    if (m_ringfd < 0 && errno == EINVAL)
+    {
+        // 旧内核不支持这些标志
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = RING_ENTRIES * 4;
+        m_ringfd = io_uring_setup(RING_ENTRIES, &p);
+        m_disabled = false;
+    }
+    if (m_ringfd < 0)
+    {
+        throw std::exception();
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+    {
+        close(m_ringfd);
+        throw std::exception();
+    }
+
+    // 提交队列和完成队列映射在同一块内存中
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    m_ring_size = sq_size > cq_size ? sq_size : cq_size;
+    m_ring_ptr = mmap(0, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd, IORING_OFF_SQ_RING);
+    m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (struct io_uring_sqe *)mmap(0, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringfd,
+                                         IORING_OFF_SQES);
+    if (m_ring_ptr == MAP_FAILED || m_sqes == MAP_FAILED)
+    {
+        cleanup();
+        throw std::exception();
+    }
+    char *ring = (char *)m_ring_ptr;
+    m_sq_head = (unsigned *)(ring + p.sq_off.head);
+    m_sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    m_sq_array = (unsigned *)(ring + p.sq_off.array);
+    m_sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    m_sq_entries = p.sq_entries;
+    m_sq_local_tail = *m_sq_tail;
+    m_cq_head = (unsigned *)(ring + p.cq_off.head);
+    m_cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    m_cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    m_cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    // 注册接收缓冲区环，组号为0
+    size_t ring_bytes = BUF_COUNT * sizeof(struct io_uring_buf);
+    if (posix_memalign((void **)&m_buf_ring, sysconf(_SC_PAGESIZE), ring_bytes) != 0)
+    {
+        m_buf_ring = NULL;
+        cleanup();
+        throw std::exception();
+    }
+    memset(m_buf_ring, 0, ring_bytes);
+    m_bufs = (char *)malloc((size_t)BUF_COUNT * BUF_SIZE);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long)m_buf_ring;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = 0;
+    if (!m_bufs || io_uring_register(m_ringfd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        cleanup();
+        throw std::exception();
+    }
+    for (unsigned bid = 0; bid < BUF_COUNT; ++bid)
+    {
+        recycle_buffer(bid);
+    }
+
+    m_tick.tv_sec = m_timers.tick_ms() / 1000;
+    m_tick.tv_nsec = (m_timers.tick_ms() % 1000) * 1000000L;
+}
+
+uring_loop::~uring_loop()
+{
+    cleanup();
+}
+
+void uring_loop::cleanup()
+{
+    if (m_sqes != MAP_FAILED)
+    {
+        munmap(m_sqes, m_sqes_size);
+        m_sqes = (struct io_uring_sqe *)MAP_FAILED;
+    }
+    if (m_ring_ptr != MAP_FAILED)
+    {
+        munmap(m_ring_ptr, m_ring_size);
+        m_ring_ptr = MAP_FAILED;
+    }
+    if (m_ringfd >= 0)
+    {
+        close(m_ringfd);
+        m_ringfd = -1;
+    }
+    free(m_buf_ring);
+    m_buf_ring = NULL;
+    free(m_bufs);
+    m_bufs = NULL;
+}
+
+bool uring_loop::start()
+{
+    return pthread_create(&m_thread, NULL, worker, this) == 0;
+}
+
+void uring_loop::join()
+{
+    pthread_join(m_thread, NULL);
+}
+
+void *uring_loop::worker(void *arg)
+{
+    uring_loop *ul = (uring_loop *)arg;
+    ul->loop();
+    return ul;
+}
+
+struct io_uring_sqe *uring_loop::get_sqe(uring_conn *uc, int op)
+{
+    if (m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_sq_entries)
+    {
+        // 提交队列满了，先交给内核
+        enter(0);
+    }
+    unsigned index = m_sq_local_tail & m_sq_mask;
+    struct io_uring_sqe *sqe = &m_sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    m_sq_array[index] = index;
+    ++m_sq_local_tail;
+    sqe->user_data = (unsigned long)uc | op;
+    if (uc)
+    {
+        ++uc->inflight;
+    }
+    return sqe;
+}
+
+int uring_loop::enter(unsigned wait)
+{
+    __atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+    int ret;
+    do
+    {
+        ret = io_uring_enter(m_ringfd, to_submit, wait, wait ? IORING_ENTER_GETEVENTS : 0);
+    } while (ret < 0 && errno == EINTR);
+    return ret;
+}
+
+void uring_loop::arm_accept()
+{
+    struct io_uring_sqe *sqe = get_sqe(NULL, OP_ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = m_listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    m_accept_armed = true;
+}
+
+void uring_loop::arm_recv(uring_conn *uc)
+{
+    // 不指定缓冲区，数据到达时由内核从0号缓冲区组中挑选
+    struct io_uring_sqe *sqe = get_sqe(uc, OP_RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uc->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    uc->recv_armed = true;
+}
+
+void uring_loop::arm_timeout()
+{
+    struct io_uring_sqe *sqe = get_sqe(NULL, OP_TIMEOUT);
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&m_tick;
+    sqe->len = 1;
+}
+
+void uring_loop::recycle_buffer(unsigned bid)
+{
+    // 环的第0项与头部的tail共用同一块内存，C++中bufs成员的偏移不是0，这里直接按数组访问
+    struct io_uring_buf *buf = (struct io_uring_buf *)m_buf_ring + (m_buf_tail & (BUF_COUNT - 1));
+    buf->addr = (unsigned long)(m_bufs + (size_t)bid * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    ++m_buf_tail;
+    __atomic_store_n(&m_buf_ring->tail, m_buf_tail, __ATOMIC_RELEASE);
+}
+
+void uring_loop::loop()
+{
+    t_loop = this;
+    if (!pin_thread(m_cpu))
+    {
+        LOG_WARN("pin io_uring loop to cpu %d failed", m_cpu);
+    }
+    if (m_disabled && io_uring_register(m_ringfd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0)
+    {
+        LOG_ERROR("enable io_uring failed, errno is: %d", errno);
+        return;
+    }
+    arm_accept();
+    arm_timeout();
+    while (true)
+    {
+        // 提交上一轮产生的所有请求，同时等待至少一个完成事件
+        if (enter(1) < 0 && errno != EAGAIN && errno != EBUSY)
+        {
+            LOG_ERROR("io_uring_enter failure, errno is: %d", errno);
+            break;
+        }
+        m_now = now_ms();
+        unsigned head = *m_cq_head;
+        unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+        {
+            handle_cqe(&m_cqes[head & m_cq_mask]);
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+        if (m_accept_batch > 0)
+        {
+            thread_metrics *metrics = local_metrics();
+            metrics->accept_wakeups.add();
+            metrics->accepts.add(m_accept_batch);
+            metrics->accept_max_batch.max(m_accept_batch);
+            m_accept_batch = 0;
+        }
+        if (m_draining && m_conn_count == 0 && !m_accept_armed)
+        {
+            break;
+        }
+    }
+}
+
+void uring_loop::handle_cqe(const struct io_uring_cqe *cqe)
+{
+    int op = cqe->user_data & 7;
+    uring_conn *uc = (uring_conn *)(unsigned long)(cqe->user_data & ~7UL);
+    switch (op)
+    {
+    case OP_ACCEPT:
+        handle_accept(cqe->res, cqe->flags);
+        return;
+    case OP_TIMEOUT:
+        m_timers.tick();
+        if (http_conn::m_draining.load(std::memory_order_relaxed))
+        {
+            drain();
+        }
+        arm_timeout();
+        return;
+    case OP_CANCEL:
+        if (!uc)
+        {
+            return; // 取消监听socket上的accept
+        }
+        break;
+    case OP_RECV:
+        handle_recv(uc, cqe->res, cqe->flags);
+        break;
+    case OP_SENDMSG:
+    case OP_READ:
+    case OP_SEND:
+        handle_sent(uc, op, cqe->res);
+        break;
+    default:
+        break;
+    }
+    // multishot的操作只有最后一个完成事件才算结束
+    if (!(cqe->flags & IORING_CQE_F_MORE))
+    {
+        --uc->inflight;
+    }
+    if (uc->closing && uc->inflight == 0)
+    {
+        finalize(uc);
+    }
+}
+
+void uring_loop::handle_accept(int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        // multishot accept因为错误（比如文件描述符用完）停止了，重新提交；退出时是被drain取消的
+        m_accept_armed = false;
+        if (!m_draining)
+        {
+            arm_accept();
+        }
+    }
+    if (res < 0)
+    {
+        return;
+    }
+    int connfd = res;
+    ++m_accept_batch;
+    if (connfd >= eventloop::m_max_fd || http_conn::m_user_count >= eventloop::m_max_fd) // 目前连接数满
+    {
+        send_unavailable(connfd);
+        close(connfd);
+        local_metrics()->accept_rejected.add();
+        return;
+    }
+    struct sockaddr_in client_address;
+    socklen_t client_addrlength = sizeof(client_address);
+    if (getpeername(connfd, (struct sockaddr *)&client_address, &client_addrlength) < 0)
+    {
+        bzero(&client_address, sizeof(client_address));
+    }
+
+    http_conn *user = m_users.alloc();
+    user->init(connfd, client_address, -1);
+    uring_conn *uc = m_conns.alloc();
+    ++m_conn_count;
+    uc->user = user;
+    uc->fd = connfd;
+    uc->inflight = 0;
+    uc->recv_armed = false;
+    uc->sending = false;
+    uc->closing = false;
+    uc->stage = NULL;
+    uc->stage_len = uc->stage_sent = 0;
+    uc->timer.user_data = uc;
+    uc->timer.cb_func = on_timeout;
+    user->touch(m_now, false);
+    m_timers.add_timer(&uc->timer, user->timeout_left(m_now));
+    arm_recv(uc);
+}
+
+void uring_loop::handle_recv(uring_conn *uc, int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        uc->recv_armed = false;
+    }
+    if (res > 0)
+    {
+        unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        if (!uc->closing)
+        {
+            http_conn *user = uc->user;
+            bool start = user->idle();
+            user->touch(m_now, start);
+            if (uc->sending || !uc->backlog.empty())
+            {
+                // 本批响应还没发完，数据先积压起来
+                uc->backlog.append(m_bufs + (size_t)bid * BUF_SIZE, res);
+            }
+            else
+            {
+                drain(uc, m_bufs + (size_t)bid * BUF_SIZE, res);
+            }
+            refresh_timer(uc);
+        }
+        // 数据已经拷到连接的读缓冲区或者积压区，缓冲区可以马上还给内核
+        recycle_buffer(bid);
+    }
+    else if (res != -ENOBUFS)
+    {
+        // 对方关闭连接、出错，或者操作被取消
+        close_conn(uc);
+        return;
+    }
+    if (uc->closing || uc->recv_armed)
+    {
+        return;
+    }
+    if (uc->backlog.size() < BACKLOG_MAX)
+    {
+        // 接收缓冲区暂时用完时multishot recv会停止，这里重新提交
+        arm_recv(uc);
+    }
+    else
+    {
+        // 积压太多时不再接收，等积压的数据处理完，send_done中恢复
+    }
+}
+
+void uring_loop::drain(uring_conn *uc, const char *data, int len)
+{
+    http_conn *user = uc->user;
+    while (!uc->sending && !uc->closing)
+    {
+        if (len == 0 && !user->has_pending_request())
+        {
+            break;
+        }
+        if (len > 0)
+        {
+            // 读缓冲区满时扩展，超过请求头的上限时失败
+            if (!user->attach_buffers(&m_buffers))
+            {
+                close_conn(uc);
+                return;
+            }
+            int n = user->feed(data, len);
+            data += n;
+            len -= n;
+        }
+        user->set_busy();
+        if (user->process())
+        {
+            uc->sending = true;
+            submit_send(uc);
+        }
+        else if (len == 0)
+        {
+            // 请求还不完整
+            break;
+        }
+    }
+    if (len > 0)
+    {
+        uc->backlog.append(data, len);
+    }
+    if (!uc->sending && user->idle())
+    {
+        user->release_buffers(&m_buffers);
+    }
+}
+
+void uring_loop::submit_send(uring_conn *uc)
+{
+    http_conn *user = uc->user;
+    int file_fd;
+    off_t offset;
+    off_t file_left = user->pending_file(&file_fd, &offset);
+    struct iovec *iov;
+    int iov_count = user->pending_iov(&iov);
+    if (iov_count > 0)
+    {
+        // 响应头、缓存或mmap的文件内容，后面还有文件内容时带上MSG_MORE
+        memset(&uc->msg, 0, sizeof(uc->msg));
+        uc->msg.msg_iov = iov;
+        uc->msg.msg_iovlen = iov_count;
+        struct io_uring_sqe *sqe = get_sqe(uc, OP_SENDMSG);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = uc->fd;
+        sqe->addr = (unsigned long)&uc->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL | (file_left > 0 ? MSG_MORE : 0);
+        return;
+    }
+
+    if (uc->stage_len > uc->stage_sent)
+    {
+        // 中转缓冲区中上次没有发完的部分
+        struct io_uring_sqe *sqe = get_sqe(uc, OP_SEND);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = uc->fd;
+        sqe->addr = (unsigned long)(uc->stage + uc->stage_sent);
+        sqe->len = uc->stage_len - uc->stage_sent;
+        sqe->msg_flags = MSG_NOSIGNAL | (file_left > uc->stage_len - uc->stage_sent ? MSG_MORE : 0);
+        return;
+    }
+
+    // sendfile模式的文件内容：读一段到中转缓冲区，链接的send在读完成后才开始；
+    // 读出错或者读到的比要求的少（文件被截断）时，链接的send被取消
+    if (!uc->stage)
+    {
+        uc->stage = m_buffers.alloc(buffer_pool::MAX_BLOCK);
+        if (!uc->stage)
+        {
+            close_conn(uc);
+            return;
+        }
+    }
+    int len = file_left < (off_t)buffer_pool::MAX_BLOCK ? (int)file_left : (int)buffer_pool::MAX_BLOCK;
+    uc->stage_len = len;
+    uc->stage_sent = 0;
+    struct io_uring_sqe *sqe = get_sqe(uc, OP_READ);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = file_fd;
+    sqe->addr = (unsigned long)uc->stage;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = get_sqe(uc, OP_SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = uc->fd;
+    sqe->addr = (unsigned long)uc->stage;
+    sqe->len = len;
+    sqe->msg_flags = MSG_NOSIGNAL | (file_left > len ? MSG_MORE : 0);
+}
+
+void uring_loop::handle_sent(uring_conn *uc, int op, int res)
+{
+    if (uc->closing)
+    {
+        return;
+    }
+    if (op == OP_READ)
+    {
+        if (res != uc->stage_len)
+        {
+            close_conn(uc);
+        }
+        return;
+    }
+    if (res <= 0)
+    {
+        close_conn(uc);
+        return;
+    }
+    if (op == OP_SEND)
+    {
+        uc->stage_sent += res;
+    }
+    if (uc->user->sent(res))
+    {
+        send_done(uc);
+        return;
+    }
+    // 对方接收慢时只发出了一部分，继续发送剩下的
+    submit_send(uc);
+}
+
+void uring_loop::send_done(uring_conn *uc)
+{
+    http_conn *user = uc->user;
+    uc->sending = false;
+    if (uc->stage)
+    {
+        m_buffers.release(uc->stage, buffer_pool::MAX_BLOCK);
+        uc->stage = NULL;
+        uc->stage_len = uc->stage_sent = 0;
+    }
+    // 根据最后一个请求的Connection字段决定是否关闭连接
+    if (!user->finish_batch())
+    {
+        close_conn(uc);
+        return;
+    }
+    user->touch(m_now, false);
+    // 处理读缓冲区中剩下的流水线请求和发送期间积压的数据
+    std::string pending;
+    pending.swap(uc->backlog);
+    drain(uc, pending.data(), pending.size());
+    if (uc->closing)
+    {
+        return;
+    }
+    refresh_timer(uc);
+    if (!uc->recv_armed && uc->backlog.size() < BACKLOG_MAX)
+    {
+        arm_recv(uc);
+    }
+}
+
+void uring_loop::refresh_timer(uring_conn *uc)
+{
+    // 延长只修改到期时间，只有期限提前时才移动定时器
+    m_timers.adjust_timer(&uc->timer, uc->user->timeout_left(m_now));
+}
+
+void uring_loop::close_conn(uring_conn *uc)
+{
+    if (uc->closing)
+    {
+        return;
+    }
+    uc->closing = true;
+    m_timers.del_timer(&uc->timer);
+    // 取消这个socket上所有还在进行的操作，它们的完成事件都到达之后才能关闭socket、回收连接
+    struct io_uring_sqe *sqe = get_sqe(uc, OP_CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = uc->fd;
+    sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+}
+
+void uring_loop::finalize(uring_conn *uc)
+{
+    http_conn *user = uc->user;
+    user->close_conn();
+    user->release_buffers(&m_buffers);
+    if (uc->stage)
+    {
+        m_buffers.release(uc->stage, buffer_pool::MAX_BLOCK);
+        uc->stage = NULL;
+    }
+    std::string().swap(uc->backlog);
+    uc->fd = -1;
+    m_users.release(user);
+    m_conns.release(uc);
+    --m_conn_count;
+}
+
+void uring_loop::drain()
+{
+    if (!m_draining)
+    {
+        m_draining = true;
+        m_drain_deadline = m_now + eventloop::m_drain_timeout;
+        struct io_uring_sqe *sqe = get_sqe(NULL, OP_CANCEL);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = m_listenfd;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+    bool expired = m_now >= m_drain_deadline;
+    m_conns.for_each([this, expired](uring_conn *uc) {
+        if (uc->fd >= 0 && !uc->closing && (expired || (!uc->sending && uc->user->idle())))
+        {
+            close_conn(uc);
+        }
+    });
+}
+
+void uring_loop::on_timeout(uring_conn *uc)
+{
+    t_loop->expire(uc);
+}
+
+void uring_loop::expire(uring_conn *uc)
+{
+    // 到期的定时器已经从时间轮上摘下，按连接当前的阶段算出真正的期限
+    long left = uc->user->timeout_left(m_now);
+    if (left > 0)
+    {
+        m_timers.add_timer(&uc->timer, left);
+        return;
+    }
+    local_metrics()->timeouts.add();
+    close_conn(uc);
+}
@@ -0,0 +1,133 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <linux/io_uring.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <string>
+#include "http_conn.h"
+#include "time_wheel.h"
+#include "slab.h"
+#include "eventloop.h"
+
+// io_uring后端中的一个连接：http_conn负责缓冲、解析和记账，这里记录正在进行的异步操作
+struct uring_conn
+{
+    uring_conn() : fd(-1) {}
+
+    http_conn *user;
+    int fd;                     // 回收后为-1
+    int inflight;               // 已提交还没有最终完成的操作数，为0之前连接不能回收
+    bool recv_armed;            // 多次接收(multishot recv)是否在进行
+    bool sending;               // 本批响应是否正在发送
+    bool closing;               // 已经取消了所有操作，等待它们完成后关闭
+    std::string backlog;        // 发送期间收到的数据，本批发送完再交给连接
+    struct msghdr msg;          // 正在进行的sendmsg
+    char *stage;                // 文件内容的中转缓冲区，只在发送文件时持有
+    int stage_len;              // 中转缓冲区中本次读到的文件字节数
+    int stage_sent;             // 其中已经发送的字节数
+    tw_timer<uring_conn> timer; // 超时定时器
+};
+
+/*
+    io_uring事件循环，与eventloop的多Reactor模式相同，每个线程一个循环和一个SO_REUSEPORT监听socket，
+    请求在本线程内解析，不使用线程池。
+    accept和recv都是multishot的，提交一次之后每个新连接、每批数据都产生一个完成事件；
+    接收缓冲区由内核从注册的缓冲区环(provided buffer ring)中挑选，空闲的连接不占用接收缓冲区；
+    响应的内存部分用sendmsg发送，sendfile模式下的文件内容用链接在一起的read + send发送。
+    一轮循环只需要一次io_uring_enter系统调用：提交本轮产生的所有请求并等待新的完成事件。
+*/
+class uring_loop
+{
+public:
+    static const unsigned RING_ENTRIES = 4096; // 提交队列的大小
+    static const unsigned BUF_COUNT = 512;     // 接收缓冲区环中的缓冲区个数，必须是2的幂
+    static const unsigned BUF_SIZE = 4096;     // 每个接收缓冲区的大小
+    static const size_t BACKLOG_MAX = 64 * 1024; // 积压的接收数据超过这个大小时暂停接收
+
+    explicit uring_loop(int listenfd);
+    ~uring_loop();
+
+    bool start(); // 创建一个线程运行事件循环
+    void join();  // 等待事件循环线程结束
+    void loop();  // 在当前线程运行事件循环
+    void set_cpu(int cpu) { m_cpu = cpu; } // 运行循环的线程绑定到cpu上，在start或loop之前调用
+
+private:
+    // 完成事件的user_data低3位是操作类型，其余是uring_conn指针
+    enum OP
+    {
+        OP_ACCEPT = 1,
+        OP_RECV,
+        OP_SENDMSG,
+        OP_READ,
+        OP_SEND,
+        OP_CANCEL,
+        OP_TIMEOUT
+    };
+
+    static void *worker(void *arg);
+    void cleanup(); // 释放环和缓冲区，构造失败时也调用
+    struct io_uring_sqe *get_sqe(uring_conn *uc, int op); // 取一个空的提交项，设置user_data并计入uc的inflight
+    int enter(unsigned wait);                             // 提交所有新的提交项，wait为要等待的完成事件数
+    void arm_accept();
+    void arm_recv(uring_conn *uc);
+    void arm_timeout();
+    void recycle_buffer(unsigned bid); // 把接收缓冲区还给内核
+
+    void handle_cqe(const struct io_uring_cqe *cqe);
+    void handle_accept(int res, unsigned flags);
+    void handle_recv(uring_conn *uc, int res, unsigned flags);
+    void handle_sent(uring_conn *uc, int op, int res);
+    void drain(uring_conn *uc, const char *data, int len); // 把数据交给连接解析，能生成响应就开始发送
+    void submit_send(uring_conn *uc);                      // 提交本批响应下一段的发送
+    void send_done(uring_conn *uc);
+    void refresh_timer(uring_conn *uc);
+    void close_conn(uring_conn *uc); // 取消连接上所有的操作，全部完成后由finalize关闭
+    void finalize(uring_conn *uc);
+    static void on_timeout(uring_conn *uc);
+    void expire(uring_conn *uc);
+    void drain(); // 与eventloop::drain相同，退出过程中每个tick调用一次
+
+private:
+    int m_ringfd;
+    int m_listenfd;
+    bool m_disabled; // 以IORING_SETUP_R_DISABLED创建，需要在循环线程中启用
+
+    // 提交队列和完成队列，与内核共享
+    void *m_ring_ptr;
+    size_t m_ring_size;
+    struct io_uring_sqe *m_sqes;
+    size_t m_sqes_size;
+    unsigned *m_sq_head;
+    unsigned *m_sq_tail;
+    unsigned *m_sq_array;
+    unsigned m_sq_mask;
+    unsigned m_sq_entries;
+    unsigned m_sq_local_tail; // 已经填好、还没有告诉内核的提交项的尾部
+    unsigned *m_cq_head;
+    unsigned *m_cq_tail;
+    unsigned m_cq_mask;
+    struct io_uring_cqe *m_cqes;
+
+    // 接收缓冲区环
+    struct io_uring_buf_ring *m_buf_ring;
+    char *m_bufs;
+    unsigned short m_buf_tail;
+
+    struct __kernel_timespec m_tick; // 时间轮的精度
+    object_pool<http_conn> m_users;
+    object_pool<uring_conn> m_conns;
+    buffer_pool m_buffers;
+    time_wheel<uring_conn> m_timers;
+    unsigned long m_now; // 本轮完成事件处理开始时的时间(毫秒)
+    unsigned long m_accept_batch; // 本轮收到的accept完成事件数
+    int m_cpu;                    // 绑定的CPU，-1表示不绑定
+    int m_conn_count;             // 本循环中打开的连接数
+    bool m_draining;              // 已经开始退出，不再accept
+    bool m_accept_armed;          // multishot accept还没有结束，退出前要等它被取消，否则内核仍会把连接交给这个环
+    unsigned long m_drain_deadline; // 超过这个时间(毫秒)关闭所有连接
+    pthread_t m_thread;
+};
+
+#endif